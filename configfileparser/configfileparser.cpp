@@ -18,7 +18,7 @@
 #include "configfileparser.h"
 #include "string_utils.h"
 #include "simpleexception.h"
-#include "debug.h"
+#include "tracing.h"
 #include <fstream>
 #include <regex>
 
@@ -223,6 +223,7 @@ std::shared_ptr<ConfigItemVector> ConfigFileParser::parser(std::string filename,
   std::ifstream in;
   std::string last_line;
   int n_line = 0;
+  TRACE_ZONE("parse", "config", filename);
   in.open(filename.c_str());
   if(!in.is_open())
     throw(SimpleException(std::string("[ConfigFileParser::parser] File ") + filename + " cannot be opened."));
@@ -232,6 +233,7 @@ std::shared_ptr<ConfigItemVector> ConfigFileParser::parser(std::string filename,
     throw(SimpleException(filename + std::string(": ") + e.what()));
   }
   in.close();
+  TRACE_COUNTER("config lines", n_line);
 
   return std::static_pointer_cast<ConfigItemVector>(vec);
 }
@@ -242,7 +244,9 @@ std::shared_ptr<ConfigItemVector> ConfigFileParser::parser(std::istream &in, con
   std::shared_ptr<ConfigItem> vec;
   std::string last_line;
   int n_line = 0;
+  TRACE_ZONE("parse", "config");
   std::tie(vec, last_line) = vector_map_parser(in, 0, std::string(), n_line, ContainerType::VECTOR_TYPE, allowed_tags);
+  TRACE_COUNTER("config lines", n_line);
 
   return std::static_pointer_cast<ConfigItemVector>(vec);
 }
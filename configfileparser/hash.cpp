@@ -0,0 +1,169 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "hash.h"
+#include "hashcache.h"
+#include "simpleexception.h"
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <memory>
+
+Hash::Hash(HashType type)
+{
+  EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+  if(md_ctx == nullptr)
+    throw(SimpleException("[Hash::Hash] Hash context cannot be allocated."));
+  const EVP_MD *md = type == HashType::BLAKE2 ? EVP_blake2b512() : EVP_md5();
+  if(EVP_DigestInit_ex(md_ctx, md, nullptr) != 1) {
+    EVP_MD_CTX_free(md_ctx);
+    throw(SimpleException("[Hash::Hash] Hash cannot be init."));
+  }
+  ctx = md_ctx;
+}
+
+Hash::~Hash()
+{
+  EVP_MD_CTX_free((EVP_MD_CTX *)ctx);
+}
+
+void Hash::update(const void *data, size_t size)
+{
+  EVP_DigestUpdate((EVP_MD_CTX *)ctx, data, size);
+}
+
+static std::string to_hex(EVP_MD_CTX *ctx)
+{
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  EVP_DigestFinal_ex(ctx, digest, &len);
+  static const char hex[] = "0123456789abcdef";
+  std::string out;
+  out.reserve(len * 2);
+  for(unsigned int i = 0; i < len; i++) {
+    out += hex[digest[i] >> 4];
+    out += hex[digest[i] & 0x0f];
+  }
+  return out;
+}
+
+std::string Hash::final()
+{
+  return to_hex((EVP_MD_CTX *)ctx);
+}
+
+std::string Hash::current()
+{
+  EVP_MD_CTX *copy = EVP_MD_CTX_new();
+  if(copy == nullptr || !EVP_MD_CTX_copy_ex(copy, (EVP_MD_CTX *)ctx)) {
+    EVP_MD_CTX_free(copy);
+    throw(SimpleException("[Hash] Hash cannot be copied."));
+  }
+  std::string out = to_hex(copy);
+  EVP_MD_CTX_free(copy);
+  return out;
+}
+
+std::string Hash::file(const std::string &path, HashType type, HashProgress progress)
+{
+  FILE *in = fopen(path.c_str(), "r");
+  if(in == nullptr)
+    throw(SimpleException("[Hash::file] File " + path + " cannot be opened."));
+  posix_fadvise(fileno(in), 0, 0, POSIX_FADV_SEQUENTIAL);
+  fseek(in, 0, SEEK_END);
+  uintmax_t total = ftell(in), done = 0;
+  fseek(in, 0, SEEK_SET);
+
+  Hash hash(type);
+  const size_t buffer_size = 1024 * 1024;
+  std::unique_ptr<char[]> buffer(new char[buffer_size]);
+  size_t nbytes;
+  while((nbytes = fread(buffer.get(), 1, buffer_size, in)) > 0) {
+    hash.update(buffer.get(), nbytes);
+    done += nbytes;
+    if(progress && !progress(done, total)) {
+      fclose(in);
+      return std::string();
+    }
+  }
+  bool error = ferror(in);
+  fclose(in);
+  if(error)
+    throw(SimpleException("[Hash::file] File " + path + " cannot be read."));
+  return hash.final();
+}
+
+struct HashFilesData {
+  const std::vector<std::string> *paths;
+  std::vector<std::string> *digests;
+  std::string error;
+  HashType type;
+  size_t next;
+  pthread_mutex_t mutex;
+};
+
+static void *hash_files_thread(void *ptr)
+{
+  HashFilesData *data = (HashFilesData *)ptr;
+  while(true) {
+    pthread_mutex_lock(&data->mutex);
+    size_t i = data->next++;
+    pthread_mutex_unlock(&data->mutex);
+    if(i >= data->paths->size())
+      break;
+    try {
+      (*data->digests)[i] = HashCache::file((*data->paths)[i], data->type);
+    } catch(SimpleException &e) {
+      pthread_mutex_lock(&data->mutex);
+      data->error = e.what();
+      pthread_mutex_unlock(&data->mutex);
+    }
+  }
+  return nullptr;
+}
+
+std::vector<std::string> Hash::files(const std::vector<std::string> &paths, HashType type, int threads)
+{
+  std::vector<std::string> digests(paths.size());
+  if(threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads > (int)paths.size())
+    threads = paths.size();
+
+  HashFilesData data;
+  data.paths = &paths;
+  data.digests = &digests;
+  data.type = type;
+  data.next = 0;
+  if(pthread_mutex_init(&data.mutex, NULL) != 0)
+    throw(SimpleException("Error: mutex init failed\n"));
+
+  std::vector<pthread_t> pool(threads > 1 ? threads : 0);
+  for(pthread_t &thread : pool)
+    pthread_create(&thread, NULL, hash_files_thread, &data);
+  if(pool.empty())
+    hash_files_thread(&data);
+  for(pthread_t &thread : pool)
+    pthread_join(thread, NULL);
+  pthread_mutex_destroy(&data.mutex);
+
+  if(!data.error.empty())
+    throw(SimpleException(data.error));
+  return digests;
+}
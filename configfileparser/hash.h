@@ -0,0 +1,72 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+enum class HashType {
+  MD5,    // Compatible with md5sum. Used to check files on remote hosts.
+  BLAKE2  // Faster on 64 bits CPUs. Used as cache key.
+};
+
+/** Progress of a file hash. Returns false to cancel the hash.
+ */
+typedef std::function<bool(uintmax_t done, uintmax_t total)> HashProgress;
+
+/** In-process hash (OpenSSL). The digest is returned as a hex string, like md5sum.
+ *
+ *  Hash md5;
+ *  md5.update(buffer, size);
+ *  std::string hex = md5.final();
+ *
+ *  std::string hex = Hash::file("/path/to/file");
+ */
+class Hash {
+  public:
+    Hash(HashType type = HashType::MD5);
+    ~Hash();
+    Hash(const Hash &) = delete;
+    Hash &operator=(const Hash &) = delete;
+
+    void update(const void *data, size_t size);
+    /** Returns the hex digest. The hash can't be updated after calling it.
+     */
+    std::string final();
+    /** Returns the hex digest of the data added until now. The hash can be updated after calling it.
+     */
+    std::string current();
+
+    /** Hashes a file. Returns an empty string if progress cancels the hash.
+     * Throws SimpleException if the file cannot be read.
+     */
+    static std::string file(const std::string &path, HashType type = HashType::MD5, HashProgress progress = nullptr);
+    /** Hashes several files in parallel. threads <= 0 uses one thread per CPU.
+     * The digests are returned in the same order as paths. Digests of
+     * unchanged files are taken from HashCache.
+     */
+    static std::vector<std::string> files(const std::vector<std::string> &paths, HashType type = HashType::MD5, int threads = 0);
+
+  private:
+    void *ctx; // EVP_MD_CTX
+};
+
+#endif
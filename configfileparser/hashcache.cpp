@@ -0,0 +1,179 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "hashcache.h"
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdlib>
+#include <filesystem>
+
+// Fixed size record of the index file
+struct HashCacheRecord {
+  uint64_t path_hash;
+  uint64_t dev, inode, size;
+  int64_t mtime_sec, mtime_nsec;
+  uint32_t type;
+  uint32_t digest_len;
+  char digest[128];
+};
+
+// The index is truncated when it reaches this number of records
+static const size_t MAX_RECORDS = 65536;
+
+static uint64_t path_hash(const std::string &path)
+{
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for(unsigned char ch : path) {
+    hash ^= ch;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void make_key(HashCacheRecord &record, const std::string &path, HashType type, const struct stat &st)
+{
+  memset(&record, 0, sizeof(record));
+  record.path_hash = path_hash(path);
+  record.dev = st.st_dev;
+  record.inode = st.st_ino;
+  record.size = st.st_size;
+  record.mtime_sec = st.st_mtim.tv_sec;
+  record.mtime_nsec = st.st_mtim.tv_nsec;
+  record.type = (uint32_t) type;
+}
+
+static bool same_key(const HashCacheRecord &a, const HashCacheRecord &b)
+{
+  return a.path_hash == b.path_hash && a.dev == b.dev && a.inode == b.inode && a.size == b.size 
+    && a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec && a.type == b.type;
+}
+
+std::string HashCache::cacheFolder()
+{
+  std::filesystem::path path;
+  char *cache_home = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  if(cache_home != nullptr && cache_home[0] != '\0')
+    path = cache_home;
+  else if(home != nullptr)
+    path = std::filesystem::path(home) / ".cache";
+  else
+    return std::string();
+  path /= "ssh_helper";
+  return path.string();
+}
+
+std::string HashCache::indexPath()
+{
+  std::string folder = cacheFolder();
+  if(folder.empty())
+    return folder;
+  return (std::filesystem::path(folder) / "hash_index").string();
+}
+
+std::string HashCache::lookup(const std::string &path, HashType type)
+{
+  std::string index = indexPath();
+  struct stat st;
+  if(index.empty() || stat(path.c_str(), &st) != 0)
+    return std::string();
+  HashCacheRecord key;
+  make_key(key, std::filesystem::absolute(path).string(), type, st);
+
+  int fd = open(index.c_str(), O_RDONLY);
+  if(fd < 0)
+    return std::string();
+  // store() truncates the index under LOCK_EX. Reading a truncated mapping raises SIGBUS.
+  if(flock(fd, LOCK_SH) != 0) {
+    close(fd);
+    return std::string();
+  }
+  struct stat index_st;
+  std::string digest;
+  if(fstat(fd, &index_st) == 0 && index_st.st_size >= (off_t)sizeof(HashCacheRecord)) {
+    size_t n = index_st.st_size / sizeof(HashCacheRecord);
+    void *ptr = mmap(nullptr, n * sizeof(HashCacheRecord), PROT_READ, MAP_SHARED, fd, 0);
+    if(ptr != MAP_FAILED) {
+      const HashCacheRecord *records = (const HashCacheRecord *)ptr;
+      // Newest records are at the end
+      for(size_t i = n; i > 0; i--) {
+        const HashCacheRecord &record = records[i - 1];
+        if(same_key(record, key) && record.digest_len <= sizeof(record.digest)) {
+          digest = std::string(record.digest, record.digest_len);
+          break;
+        }
+      }
+      munmap(ptr, n * sizeof(HashCacheRecord));
+    }
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  return digest;
+}
+
+void HashCache::store(const std::string &path, HashType type, const std::string &digest, const struct stat &st)
+{
+  std::string index = indexPath();
+  struct stat now;
+  if(index.empty() || digest.empty() || digest.size() > sizeof(HashCacheRecord::digest))
+    return;
+  // File has been modified while it was hashed
+  if(stat(path.c_str(), &now) != 0 || now.st_size != st.st_size || now.st_ino != st.st_ino
+      || now.st_mtim.tv_sec != st.st_mtim.tv_sec || now.st_mtim.tv_nsec != st.st_mtim.tv_nsec)
+    return;
+
+  HashCacheRecord record;
+  make_key(record, std::filesystem::absolute(path).string(), type, st);
+  record.digest_len = digest.size();
+  memcpy(record.digest, digest.c_str(), digest.size());
+
+  std::error_code error;
+  std::filesystem::create_directories(std::filesystem::path(index).parent_path(), error);
+  int fd = open(index.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+  if(fd < 0)
+    return;
+  if(flock(fd, LOCK_EX) == 0) {
+    struct stat index_st;
+    if(fstat(fd, &index_st) == 0) {
+      // Drop partial records (interrupted writes) and old entries
+      if(index_st.st_size % sizeof(HashCacheRecord) != 0 
+          || (size_t)index_st.st_size >= MAX_RECORDS * sizeof(HashCacheRecord))
+        ftruncate(fd, 0);
+      if(write(fd, &record, sizeof(record)) != sizeof(record))
+        ftruncate(fd, index_st.st_size - index_st.st_size % sizeof(HashCacheRecord));
+    }
+    flock(fd, LOCK_UN);
+  }
+  close(fd);
+}
+
+std::string HashCache::file(const std::string &path, HashType type, HashProgress progress)
+{
+  std::string digest = lookup(path, type);
+  if(!digest.empty())
+    return digest;
+  struct stat st;
+  bool ok = stat(path.c_str(), &st) == 0;
+  digest = Hash::file(path, type, progress);
+  if(ok)
+    store(path, type, digest, st);
+  return digest;
+}
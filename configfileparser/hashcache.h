@@ -0,0 +1,51 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef _HASHCACHE_H_
+#define _HASHCACHE_H_
+
+#include "hash.h"
+#include <string>
+#include <sys/stat.h>
+
+/** Persistent index of file hashes saved in "~/.cache/ssh_helper/hash_index".
+ * Entries are keyed by (path, device, inode, size, mtime), so a modified file 
+ * is hashed again. The index is memory-mapped for lookups and new entries 
+ * are appended under an exclusive lock. CLI and GUI share the index.
+ */
+class HashCache {
+  public:
+    /** Returns the cached digest of path or an empty string if it is not cached.
+     */
+    static std::string lookup(const std::string &path, HashType type = HashType::MD5);
+    /** Saves the digest of path. stat is taken before hashing the file, 
+     * the entry is not saved if the file has been modified.
+     */
+    static void store(const std::string &path, HashType type, const std::string &digest, const struct stat &st);
+    /** Like Hash::file, but the cached digest is returned when the file is unchanged.
+     */
+    static std::string file(const std::string &path, HashType type = HashType::MD5, HashProgress progress = nullptr);
+    /** Path of the index file. Empty if $HOME is not defined.
+     */
+    static std::string indexPath();
+    /** Folder of ssh_helper local cache files ("~/.cache/ssh_helper"). 
+     * Empty if $HOME is not defined.
+     */
+    static std::string cacheFolder();
+};
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "configfileparser.h"
+#include "scripttags.h"
+#include "simpleexception.h"
+#include <malloc.h>
+#include <stdlib.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <set>
+#include <filesystem>
+#include <algorithm>
+#include <functional>
+
+// Allocations of operator new. Live bytes are counted with malloc_usable_size,
+// so deletes without size are counted too.
+static std::atomic<uint64_t> allocations(0), allocated_bytes(0), live_bytes(0), peak_live_bytes(0);
+
+static void *count_new(size_t size)
+{
+  void *ptr = malloc(size > 0 ? size : 1);
+  if(ptr == nullptr)
+    throw(std::bad_alloc());
+  size_t usable = malloc_usable_size(ptr);
+  allocations++;
+  allocated_bytes += size;
+  uint64_t live = live_bytes += usable;
+  uint64_t peak = peak_live_bytes;
+  while(live > peak && !peak_live_bytes.compare_exchange_weak(peak, live));
+  return ptr;
+}
+
+static void count_delete(void *ptr)
+{
+  if(ptr == nullptr)
+    return;
+  live_bytes -= malloc_usable_size(ptr);
+  free(ptr);
+}
+
+void *operator new(size_t size) {return count_new(size);}
+void *operator new[](size_t size) {return count_new(size);}
+void *operator new(size_t size, const std::nothrow_t &) noexcept {try {return count_new(size);} catch(...) {return nullptr;}}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {try {return count_new(size);} catch(...) {return nullptr;}}
+void operator delete(void *ptr) noexcept {count_delete(ptr);}
+void operator delete[](void *ptr) noexcept {count_delete(ptr);}
+void operator delete(void *ptr, size_t) noexcept {count_delete(ptr);}
+void operator delete[](void *ptr, size_t) noexcept {count_delete(ptr);}
+
+struct ParserBenchOptions
+{
+  unsigned hosts = 8000;
+  unsigned steps = 200;
+  // Levels of "monitor" steps with their own "scripts"
+  unsigned depth = 3;
+  unsigned command_lines = 5;
+  unsigned runs = 5;
+  std::filesystem::path dir = "/tmp/ssh_helper_bench";
+};
+
+void print_help(const char *command)
+{
+  std::cout << command << " [options]" << std::endl;
+  std::cout << R"(
+Generates a synthetic inventory and scripts file and measures ConfigFileParser:
+parsing, print_tree and a traversal of the tree like the one of the manager.
+Time, MB/s, nodes/s, allocations and peak memory of every phase are printed.
+
+The available options are:
+--hosts n             Hosts of the inventory. The default is 8000.
+--steps n             Steps of every "scripts" list. The default is 200.
+--depth n             Levels of "monitor" steps with their own "scripts". The default is 3.
+--command-lines n     Lines of every command. The default is 5.
+--runs n              Every phase is run n times, the median time is shown. The default is 5.
+--dir path            Folder of the generated file. The default is /tmp/ssh_helper_bench.
+
+)";
+}
+
+// Steps of a "scripts +" at level tabs. Every step kind of the manager is used.
+static void write_steps(std::ostream &out, const ParserBenchOptions &bench, unsigned level, unsigned depth)
+{
+  std::string tabs(level, '\t');
+  for(unsigned i = 0; i < bench.steps; i++) {
+    std::string name = "step " + std::to_string(depth) + "." + std::to_string(i);
+    switch(i % 4) {
+      case 0:
+      case 1:
+        out << tabs << "script -\n" << tabs << "\tname: " << name << "\n" << tabs << "\tsudo: " << (i % 2 ? "yes" : "no") << "\n"
+          << tabs << "\tcommand:\n";
+        for(unsigned line = 0; line < bench.command_lines; line++)
+          out << tabs << "\t\techo \"##log: " << name << " line " << line << "\" && ls -l /var/tmp/" << line << "\n";
+        break;
+      case 2:
+        out << tabs << "upload -\n" << tabs << "\tname: " << name << "\n" << tabs << "\torig: /srv/files/" << i << ".tar\n"
+          << tabs << "\tdest: /opt/files/\n" << tabs << "\tuser: root\n" << tabs << "\tcompress: auto\n"
+          << tabs << "\tmd5: " << std::setw(32) << std::setfill('0') << std::hex << i * 2654435761u << std::dec << std::setfill(' ') << "\n";
+        break;
+      case 3:
+        out << tabs << "download -\n" << tabs << "\tname: " << name << "\n" << tabs << "\torig: /var/log/syslog." << i << "\n"
+          << tabs << "\tdest: logs\n" << tabs << "\tparallel: 4\n";
+        break;
+    }
+  }
+  if(depth < bench.depth) {
+    out << tabs << "monitor -\n" << tabs << "\tname: monitor " << depth << "\n" << tabs << "\tthreads: 4\n" << tabs << "\tscripts +\n";
+    write_steps(out, bench, level + 2, depth + 1);
+  }
+}
+
+static void write_inventory(std::filesystem::path path, const ParserBenchOptions &bench)
+{
+  std::ofstream out(path);
+  out << "bandwidth -\n\tlimit: 10240\n\tsites +\n";
+  for(unsigned i = 0; i < 16; i++)
+    out << "\t\tsite -\n\t\t\tname: site" << i << "\n\t\t\tlimit: 2048\n";
+  out << "hosts +\n";
+  for(unsigned i = 0; i < bench.hosts; i++)
+    out << "\thost -\n\t\tuser: admin\n\t\thost: 10." << (i >> 16) << "." << ((i >> 8) & 255) << "." << (i & 255) 
+      << "\n\t\tport: 22\n\t\tsite: site" << i % 16 << "\n";
+  out << "scripts +\n";
+  write_steps(out, bench, 1, 0);
+  if(!out)
+    throw(SimpleException("Error: " + path.string() + " cannot be written."));
+}
+
+// Visits every node like the manager does: tags of vectors and values of maps
+static void traverse(std::shared_ptr<ConfigItem> item, uint64_t &nodes, uint64_t &chars)
+{
+  nodes++;
+  switch(item->getType()) {
+    case ConfigItemType::STRING:
+      chars += std::static_pointer_cast<ConfigItemString>(item)->getValue().size();
+      break;
+    case ConfigItemType::VECTOR:
+      for(const std::tuple<std::string, std::shared_ptr<ConfigItem> > &value : std::static_pointer_cast<ConfigItemVector>(item)->getValue()) {
+        chars += std::get<0>(value).size();
+        traverse(std::get<1>(value), nodes, chars);
+      }
+      break;
+    case ConfigItemType::MAP:
+      for(const auto& [key, value] : std::static_pointer_cast<ConfigItemMap>(item)->getValue()) {
+        chars += key.size();
+        traverse(value, nodes, chars);
+      }
+      break;
+    case ConfigItemType::NONE:
+      break;
+  }
+}
+
+// Peak RSS (VmHWM) of this process in MB. It is reset writing "5" to /proc/self/clear_refs.
+static double peak_rss()
+{
+  std::ifstream status("/proc/self/status");
+  std::string key;
+  double value;
+  while(status >> key) {
+    if(key == "VmHWM:" && status >> value)
+      return value / 1024;
+    status.ignore(4096, '\n');
+  }
+  return 0;
+}
+
+static void reset_peak_rss()
+{
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  clear_refs << "5";
+}
+
+struct PhaseResult
+{
+  std::vector<double> seconds;
+  uint64_t allocations = 0, allocated_bytes = 0;
+  // Peak of heap used by the phase over the heap used before it, and heap kept after it
+  uint64_t peak_heap = 0, kept_heap = 0;
+  double peak_rss = 0;
+};
+
+// Runs phase bench.runs times, calling prepare before every run without measuring it. 
+// Allocations and memory are the ones of the last run.
+static PhaseResult measure(const ParserBenchOptions &bench, std::function<void()> phase, std::function<void()> prepare = nullptr)
+{
+  PhaseResult result;
+  for(unsigned run = 0; run < bench.runs; run++) {
+    if(prepare)
+      prepare();
+    reset_peak_rss();
+    uint64_t live = live_bytes;
+    peak_live_bytes = live;
+    uint64_t start_allocations = allocations, start_bytes = allocated_bytes;
+    auto start = std::chrono::steady_clock::now();
+    phase();
+    result.seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    result.allocations = allocations - start_allocations;
+    result.allocated_bytes = allocated_bytes - start_bytes;
+    result.peak_heap = peak_live_bytes - live;
+    result.kept_heap = live_bytes > live ? live_bytes - live : 0;
+    result.peak_rss = peak_rss();
+  }
+  std::sort(result.seconds.begin(), result.seconds.end());
+  return result;
+}
+
+static void print_result(std::string phase, const PhaseResult &result, uint64_t bytes, uint64_t nodes)
+{
+  const double MB = 1024 * 1024;
+  double seconds = result.seconds[result.seconds.size() / 2];
+  std::cout << std::left << std::setw(12) << phase << std::right << std::setw(10) << seconds * 1000 
+    << std::setw(10) << bytes / MB / seconds << std::setw(12) << (uint64_t) (nodes / seconds) 
+    << std::setw(12) << result.allocations << std::setw(12) << result.allocated_bytes / MB 
+    << std::setw(11) << result.peak_heap / MB << std::setw(11) << result.kept_heap / MB 
+    << std::setw(10) << result.peak_rss << std::endl;
+}
+
+int main(int argn, char* argv[])
+{
+  ParserBenchOptions bench;
+
+  for(int i = 1; i < argn; i++) {
+    static const std::set<std::string> with_value = {"--hosts", "--steps", "--depth", "--command-lines", "--runs", "--dir"};
+    if(with_value.contains(argv[i]) && i + 1 >= argn) {
+      std::cerr << "Error: " << argv[i] << " needs a value" << std::endl;
+      print_help(argv[0]);
+      return 1;
+    }
+    std::string option = argv[i];
+    std::stringstream value(with_value.contains(option) ? argv[++i] : "");
+    if(option == "--help") {
+      print_help(argv[0]);
+      return 0;
+    } else if(option == "--hosts")
+      value >> bench.hosts;
+    else if(option == "--steps")
+      value >> bench.steps;
+    else if(option == "--depth")
+      value >> bench.depth;
+    else if(option == "--command-lines")
+      value >> bench.command_lines;
+    else if(option == "--runs")
+      value >> bench.runs;
+    else if(option == "--dir")
+      bench.dir = value.str();
+    else {
+      std::cerr << "Unknown argument: " << argv[i] << std::endl;
+      print_help(argv[0]);
+      return 1;
+    }
+  }
+  if(bench.runs == 0) {
+    std::cerr << "Error: --runs must be greater than 0." << std::endl;
+    return 1;
+  }
+
+  try {
+    std::error_code error;
+    std::filesystem::create_directories(bench.dir, error);
+    std::filesystem::path path = bench.dir / "parser_bench.txt";
+    write_inventory(path, bench);
+    uint64_t file_size = std::filesystem::file_size(path);
+
+    std::shared_ptr<ConfigItemVector> tree;
+    PhaseResult parse = measure(bench, [&]() {
+      tree = ConfigFileParser::parser(path.string(), scriptTags());
+    }, [&]() {
+      tree = nullptr;
+    });
+    uint64_t nodes = 0, chars = 0;
+    traverse(tree, nodes, chars);
+    uint64_t printed = 0;
+    PhaseResult print = measure(bench, [&]() {
+      std::ostringstream out;
+      ConfigFileParser::print_tree(out, tree);
+      printed = out.tellp();
+    });
+    PhaseResult traversal = measure(bench, [&]() {
+      uint64_t count = 0, size = 0;
+      traverse(tree, count, size);
+    });
+
+    std::cout << "Inventory: " << bench.hosts << " hosts, " << bench.steps << " steps, depth " << bench.depth 
+      << ": " << path.string() << ", " << std::fixed << std::setprecision(2) << file_size / (1024.0 * 1024.0) 
+      << " MB, " << nodes << " nodes" << std::endl;
+    std::cout << std::left << std::setw(12) << "phase" << std::right << std::setw(10) << "ms" << std::setw(10) << "MB/s" 
+      << std::setw(12) << "nodes/s" << std::setw(12) << "allocs" << std::setw(12) << "alloc MB" << std::setw(11) << "peak MB" 
+      << std::setw(11) << "kept MB" << std::setw(10) << "RSS MB" << std::endl;
+    print_result("parse", parse, file_size, nodes);
+    print_result("print_tree", print, printed, nodes);
+    print_result("traverse", traversal, chars, nodes);
+    std::cout << "Median of " << bench.runs << " runs. peak MB is the heap used by the phase, kept MB the heap it has not freed "
+      "(the tree after parse). RSS MB is the peak RSS of the process while the phase runs." << std::endl;
+  } catch(SimpleException &error) {
+    std::cerr << error.what() << std::endl;
+    return 3;
+  } catch(std::exception &error) {
+    std::cerr << error.what() << std::endl;
+    return 3;
+  }
+  return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "scripttags.h"
+
+const std::set<std::string> &scriptTags()
+{
+  static const std::set<std::string> tags = {"hosts", "scripts", "user", "host", "port", "password", "script", "name", "command", "sudo", "stop_on_error", "args", "orig", "dest", "md5", "threads", "scripts_lock", "type", "upload", "download", "monitor", "delta", "delete", "compress", "parallel", "streams", "bandwidth", "limit", "sites", "site"};
+  return tags;
+}
@@ -15,7 +15,14 @@
  * this program. If not, see <https://www.gnu.org/licenses/>. 
  */
 
-#include "debug.h"
+#ifndef _SCRIPTTAGS_H_
+#define _SCRIPTTAGS_H_
 
-bool m_debug = true;
+#include <string>
+#include <set>
 
+/** Tags allowed in scripts files.
+ */
+const std::set<std::string> &scriptTags();
+
+#endif
@@ -15,18 +15,17 @@
  * this program. If not, see <https://www.gnu.org/licenses/>. 
  */
 
-#ifndef __DEBUG_H__
-#define __DEBUG_H__
+#include "tracing.h"
+#include <atomic>
 
-#include <iostream>
+static std::atomic<TraceSink *> trace_sink(nullptr);
 
-#define debug if(m_debug) std::cerr << "[" << __PRETTY_FUNCTION__ << "] Line:" << __LINE__ << "\t"
+void Tracing::setSink(TraceSink *sink)
+{
+  trace_sink = sink;
+}
 
-#define debug_get_func std::string("[") + std::string(__PRETTY_FUNCTION__) + std::string("]")
-
-#define debug_error std::cerr << "ERROR: [" << __PRETTY_FUNCTION__ << "] Line:" << __LINE__ << "\t"
-
-
-extern bool m_debug;
-
-#endif
+TraceSink *Tracing::sink()
+{
+  return trace_sink;
+}
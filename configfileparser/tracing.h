@@ -0,0 +1,109 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __TRACING_H__
+#define __TRACING_H__
+
+#include <string>
+#include <chrono>
+
+/** Tracing zones, counters and instant events for profiling. They are only 
+ * compiled with the SSH_HELPER_TRACING CMake option:
+ *
+ *  cmake -DSSH_HELPER_TRACING=ON ..
+ *
+ * Otherwise the macros are empty and their arguments are not evaluated:
+ *
+ *  {
+ *    TRACE_ZONE("select", "ssh");
+ *    ...
+ *  }
+ *  TRACE_COUNTER("open channels", channels.size());
+ *  TRACE_INSTANT("reconnect", "ssh", host);
+ *
+ * Events are sent to the sink set with Tracing::setSink. Without sink, nothing is recorded.
+ */
+#ifdef SSH_HELPER_TRACING
+constexpr bool TRACING_ENABLED = true;
+#else
+constexpr bool TRACING_ENABLED = false;
+#endif
+
+/** Receiver of the trace events. It is called from many threads.
+ */
+class TraceSink
+{
+  public:
+    virtual ~TraceSink() = default;
+    virtual void zone(const char *name, const char *category, std::chrono::steady_clock::time_point start, 
+      std::chrono::steady_clock::time_point end, const std::string &detail) = 0;
+    virtual void counter(const char *name, long long value, std::chrono::steady_clock::time_point time) = 0;
+    virtual void instant(const char *name, const char *category, std::chrono::steady_clock::time_point time, 
+      const std::string &detail) = 0;
+};
+
+class Tracing
+{
+  public:
+    static void setSink(TraceSink *sink);
+    static TraceSink *sink();
+
+    static void counter(const char *name, long long value) {
+      TraceSink *receiver = sink();
+      if(receiver != nullptr)
+        receiver->counter(name, value, std::chrono::steady_clock::now());
+    }
+    static void instant(const char *name, const char *category, const std::string &detail = "") {
+      TraceSink *receiver = sink();
+      if(receiver != nullptr)
+        receiver->instant(name, category, std::chrono::steady_clock::now(), detail);
+    }
+};
+
+/** Zone from its construction to its destruction. Use TRACE_ZONE.
+ */
+class TraceZone
+{
+  public:
+    TraceZone(const char *name, const char *category, std::string detail = "") 
+      : name(name), category(category), detail(detail), start(std::chrono::steady_clock::now()) {}
+    ~TraceZone() {
+      TraceSink *receiver = Tracing::sink();
+      if(receiver != nullptr)
+        receiver->zone(name, category, start, std::chrono::steady_clock::now(), detail);
+    }
+
+  private:
+    const char *name, *category;
+    std::string detail;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef SSH_HELPER_TRACING
+#define TRACE_ZONE(...) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(__VA_ARGS__)
+#else
+#define TRACE_ZONE(...) do {} while(0)
+#endif
+
+// The code is checked by the compiler also when tracing is disabled
+#define TRACE_COUNTER(name, value) do { if constexpr(TRACING_ENABLED) Tracing::counter(name, value); } while(0)
+#define TRACE_INSTANT(...) do { if constexpr(TRACING_ENABLED) Tracing::instant(__VA_ARGS__); } while(0)
+
+#endif
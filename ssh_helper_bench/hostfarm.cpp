@@ -0,0 +1,590 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "hostfarm.h"
+#include "simpleexception.h"
+#include <libssh/callbacks.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <regex>
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Session loop wakes up at least every POLL_MS to check commands and stop()
+static const int POLL_MS = 50;
+// Child output is read in blocks of BUFFER_SIZE
+static const size_t BUFFER_SIZE = 64 * 1024;
+
+struct FarmSession;
+
+/** A channel of a session. Its command is started when its latency has passed.
+ */
+struct FarmChannel
+{
+  FarmSession *session;
+  ssh_channel channel;
+  struct ssh_channel_callbacks_struct callbacks;
+  std::string command;
+  std::chrono::steady_clock::time_point start_at;
+  pid_t pid = -1;
+  int in_fd = -1, out_fd = -1, err_fd = -1;
+  // Data from the client not written to the command yet
+  std::string pending;
+  // "sh -s" reads a script (the bootstrap). It is rewritten as commands when it is complete.
+  bool script = false;
+  bool started = false, eof = false, closed = false, done = false;
+  int status = 0;
+};
+
+struct FarmSession
+{
+  HostFarm *farm;
+  FarmHost *host;
+  ssh_session session;
+  ssh_event event = nullptr;
+  struct ssh_server_callbacks_struct callbacks;
+  std::vector<std::unique_ptr<FarmChannel> > channels;
+  std::string user, home;
+  bool drop = false;
+  std::mt19937 random;
+
+  void startCommand(FarmChannel *channel);
+  void flushInput(FarmChannel *channel);
+  // Returns false at the end of fd
+  bool pumpOutput(FarmChannel *channel, int fd, bool is_stderr);
+  void finishCommand(FarmChannel *channel);
+  std::string rewrite(std::string command);
+  // Sets user and makes its home. Returns false on error.
+  bool setUser(const char *user);
+
+  // libssh callbacks
+  static int authPassword(ssh_session ssh, const char *user, const char *password, void *userdata);
+  static int authPubkey(ssh_session ssh, const char *user, struct ssh_key_struct *pubkey, char signature_state, void *userdata);
+  static ssh_channel channelOpen(ssh_session ssh, void *userdata);
+  static int channelData(ssh_session ssh, ssh_channel, void *data, uint32_t len, int is_stderr, void *userdata);
+  static void channelEof(ssh_session ssh, ssh_channel, void *userdata);
+  static void channelClose(ssh_session ssh, ssh_channel, void *userdata);
+  static int channelExec(ssh_session ssh, ssh_channel, const char *command, void *userdata);
+};
+
+static uint64_t thread_cpu_us()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return time.tv_sec * 1000000ULL + time.tv_nsec / 1000;
+}
+
+static void set_nonblocking(int fd)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void replace_all(std::string &text, const std::string &from, const std::string &to)
+{
+  for(size_t pos = text.find(from); pos != std::string::npos; pos = text.find(from, pos + to.size()))
+    text.replace(pos, from.size(), to);
+}
+
+// sudo of the hosts, first in PATH. Commands are run as the local user, but as
+// "sudo -S" the password is read from stdin and checked, and the command is 
+// run by exec, so builtins and shell syntax fail as with sudo.
+static const std::string SUDO_SH = R"SH(#!/bin/bash
+stdin_password=no
+while [ $# -gt 0 ]; do
+  case "$1" in
+    -S) stdin_password=yes; shift;;
+    -Sp) stdin_password=yes; shift 2;;
+    -p) shift 2;;
+    --) shift; break;;
+    -*) shift;;
+    *) break;;
+  esac
+done
+if [ $stdin_password = yes ]; then
+  IFS= read -r password
+  [ "$password" = "$FARM_PASSWORD" ] || { echo "sudo: 1 incorrect password attempt" >&2; exit 1; }
+fi
+[ $# -gt 0 ] || { echo "usage: sudo command" >&2; exit 1; }
+[ -n "$(type -P -- "$1")" ] || { echo "sudo: $1: command not found" >&2; exit 1; }
+exec "$@"
+)SH";
+
+std::string FarmSession::rewrite(std::string command)
+{
+  replace_all(command, "/home/" + user, home);
+  // Relays between hosts (P2P) must use the farm port
+  replace_all(command, " scp ", " scp" + farm->scp_options + " -P " + std::to_string(farm->port) + " -o StrictHostKeyChecking=no -o UserKnownHostsFile=/dev/null ");
+  return command;
+}
+
+void FarmSession::startCommand(FarmChannel *channel)
+{
+  int in[2], out[2], err[2];
+  if(pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0) {
+    channel->status = 127;
+    channel->done = true;
+    return;
+  }
+  // Everything used by the child is prepared before fork
+  std::vector<std::string> env;
+  std::string path = "/usr/local/bin:/usr/bin:/bin";
+  for(char **var = environ; *var != nullptr; var++) {
+    if(strncmp(*var, "PATH=", 5) == 0)
+      path = *var + 5;
+    else if(strncmp(*var, "HOME=", 5) != 0)
+      env.push_back(*var);
+  }
+  env.push_back("HOME=" + home);
+  env.push_back("PATH=" + farm->root + "/bin:" + path);
+  env.push_back("FARM_PASSWORD=" + farm->password);
+  std::vector<char *> envp;
+  for(std::string &var : env)
+    envp.push_back(var.data());
+  envp.push_back(nullptr);
+  const char *argv[] = {"bash", "-c", channel->command.c_str(), nullptr};
+
+  pid_t pid = fork();
+  if(pid == 0) {
+    dup2(in[0], 0);
+    dup2(out[1], 1);
+    dup2(err[1], 2);
+    if(chdir(home.c_str()) != 0)
+      _exit(127);
+    execve("/bin/bash", (char **) argv, envp.data());
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  if(pid < 0) {
+    close(in[1]);
+    close(out[0]);
+    close(err[0]);
+    channel->status = 127;
+    channel->done = true;
+    return;
+  }
+  channel->pid = pid;
+  channel->in_fd = in[1];
+  channel->out_fd = out[0];
+  channel->err_fd = err[0];
+  set_nonblocking(channel->in_fd);
+  set_nonblocking(channel->out_fd);
+  set_nonblocking(channel->err_fd);
+  // Output wakes up the session loop. It is read by pumpOutput.
+  auto wake_up = [](socket_t, int, void *) { return 0; };
+  ssh_event_add_fd(event, channel->out_fd, POLLIN, wake_up, channel);
+  ssh_event_add_fd(event, channel->err_fd, POLLIN, wake_up, channel);
+  channel->started = true;
+  flushInput(channel);
+}
+
+void FarmSession::flushInput(FarmChannel *channel)
+{
+  if(!channel->started || channel->in_fd < 0 || (channel->script && !channel->eof && !channel->closed))
+    return;
+  while(!channel->pending.empty()) {
+    ssize_t n = write(channel->in_fd, channel->pending.data(), channel->pending.size());
+    if(n > 0)
+      channel->pending.erase(0, n);
+    else if(n < 0 && errno == EAGAIN)
+      return;
+    else {
+      // The command does not read its input
+      channel->pending.clear();
+      break;
+    }
+  }
+  if(channel->eof || channel->closed) {
+    close(channel->in_fd);
+    channel->in_fd = -1;
+  }
+}
+
+bool FarmSession::pumpOutput(FarmChannel *channel, int fd, bool is_stderr)
+{
+  char buffer[BUFFER_SIZE];
+  ssize_t n;
+  while((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    if(channel->closed)
+      continue;
+    farm->limiter.acquire(host->address + " out", n);
+    if(is_stderr)
+      ssh_channel_write_stderr(channel->channel, buffer, n);
+    else
+      ssh_channel_write(channel->channel, buffer, n);
+  }
+  return n < 0 && errno == EAGAIN;
+}
+
+void FarmSession::finishCommand(FarmChannel *channel)
+{
+  if(channel->in_fd >= 0)
+    close(channel->in_fd);
+  channel->in_fd = -1;
+  if(!channel->closed) {
+    ssh_channel_request_send_exit_status(channel->channel, channel->status);
+    ssh_channel_send_eof(channel->channel);
+    ssh_channel_close(channel->channel);
+  }
+  channel->done = true;
+}
+
+bool FarmSession::setUser(const char *user)
+{
+  this->user = user;
+  home = farm->root + "/hosts/" + host->address + "/home/" + user;
+  std::error_code error;
+  std::filesystem::create_directories(home, error);
+  return !error;
+}
+
+int FarmSession::authPassword(ssh_session, const char *user, const char *password, void *userdata)
+{
+  FarmSession *session = (FarmSession *) userdata;
+  if(session->farm->password != password)
+    return SSH_AUTH_DENIED;
+  return session->setUser(user) ? SSH_AUTH_SUCCESS : SSH_AUTH_DENIED;
+}
+
+int FarmSession::authPubkey(ssh_session, const char *user, struct ssh_key_struct *pubkey, char signature_state, void *userdata)
+{
+  FarmSession *session = (FarmSession *) userdata;
+  if(signature_state != SSH_PUBLICKEY_STATE_NONE && signature_state != SSH_PUBLICKEY_STATE_VALID)
+    return SSH_AUTH_DENIED;
+  // Keys are read from authorized_keys of the host, installed by the bootstrap of the manager
+  std::ifstream in(session->farm->root + "/hosts/" + session->host->address + "/home/" + user + "/.ssh/authorized_keys");
+  std::string line;
+  bool found = false;
+  while(!found && std::getline(in, line)) {
+    std::stringstream fields(line);
+    std::string type, base64;
+    if(!(fields >> type >> base64))
+      continue;
+    ssh_key key;
+    if(ssh_pki_import_pubkey_base64(base64.c_str(), ssh_key_type_from_name(type.c_str()), &key) != SSH_OK)
+      continue;
+    found = ssh_key_cmp(key, pubkey, SSH_KEY_CMP_PUBLIC) == 0;
+    ssh_key_free(key);
+  }
+  if(!found)
+    return SSH_AUTH_DENIED;
+  // The first request only asks if the key is accepted
+  if(signature_state == SSH_PUBLICKEY_STATE_NONE)
+    return SSH_AUTH_SUCCESS;
+  return session->setUser(user) ? SSH_AUTH_SUCCESS : SSH_AUTH_DENIED;
+}
+
+int FarmSession::channelData(ssh_session, ssh_channel, void *data, uint32_t len, int, void *userdata)
+{
+  FarmChannel *channel = (FarmChannel *) userdata;
+  FarmSession *session = channel->session;
+  session->farm->limiter.acquire(session->host->address + " in", len);
+  // Data is kept until the command reads it. The client is not stopped, so 
+  // a command which does not read its input can hold a whole upload.
+  channel->pending.append((const char *) data, len);
+  session->flushInput(channel);
+  return len;
+}
+
+void FarmSession::channelEof(ssh_session, ssh_channel, void *userdata)
+{
+  FarmChannel *channel = (FarmChannel *) userdata;
+  channel->eof = true;
+  if(channel->script)
+    channel->pending = channel->session->rewrite(channel->pending);
+  channel->session->flushInput(channel);
+}
+
+void FarmSession::channelClose(ssh_session, ssh_channel, void *userdata)
+{
+  FarmChannel *channel = (FarmChannel *) userdata;
+  channel->closed = true;
+  if(channel->pid > 0)
+    kill(channel->pid, SIGTERM);
+}
+
+int FarmSession::channelExec(ssh_session, ssh_channel, const char *command, void *userdata)
+{
+  FarmChannel *channel = (FarmChannel *) userdata;
+  FarmSession *session = channel->session;
+  const HostProfile &profile = session->host->profile;
+  if(!channel->command.empty())
+    return SSH_ERROR;
+  if(profile.failure_rate > 0 && std::uniform_real_distribution<double>(0, 1)(session->random) < profile.failure_rate) {
+    session->drop = true;
+    return SSH_ERROR;
+  }
+  session->farm->command_count++;
+  channel->command = session->rewrite(command);
+  channel->script = channel->command == "sh -s";
+  channel->start_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(profile.latency_ms + profile.command_ms);
+  return SSH_OK;
+}
+
+ssh_channel FarmSession::channelOpen(ssh_session ssh, void *userdata)
+{
+  FarmSession *session = (FarmSession *) userdata;
+  std::unique_ptr<FarmChannel> channel = std::make_unique<FarmChannel>();
+  channel->session = session;
+  channel->channel = ssh_channel_new(ssh);
+  if(channel->channel == nullptr)
+    return nullptr;
+  memset(&channel->callbacks, 0, sizeof(channel->callbacks));
+  channel->callbacks.userdata = channel.get();
+  channel->callbacks.channel_data_function = channelData;
+  channel->callbacks.channel_eof_function = channelEof;
+  channel->callbacks.channel_close_function = channelClose;
+  channel->callbacks.channel_exec_request_function = channelExec;
+  ssh_callbacks_init(&channel->callbacks);
+  ssh_set_channel_callbacks(channel->channel, &channel->callbacks);
+  session->channels.push_back(std::move(channel));
+  return session->channels.back()->channel;
+}
+
+HostFarm::HostFarm(std::string root, int port, std::string password)
+  : stopping(false), cpu_us(0), session_count(0), command_count(0), dropped_count(0), running_threads(0)
+{
+  this->root = root;
+  this->port = port;
+  this->password = password;
+  key_path = root + "/host_key";
+  acceptor_running = false;
+  if(pthread_mutex_init(&mutex, NULL) != 0)
+    throw(SimpleException("Error: mutex init failed\n"));
+}
+
+HostFarm::~HostFarm()
+{
+  stop();
+  pthread_mutex_destroy(&mutex);
+}
+
+std::string HostFarm::addHost(const HostProfile &profile)
+{
+  // 127.0.0.1 is left to local services
+  size_t n = hosts.size() + 2;
+  if(n >= 254 * 254)
+    throw(SimpleException("Error: too many hosts in the farm."));
+  std::unique_ptr<FarmHost> host = std::make_unique<FarmHost>();
+  host->address = "127.0." + std::to_string(n / 254) + "." + std::to_string(n % 254);
+  host->profile = profile;
+  limiter.setSiteLimit(host->address + " in", profile.bandwidth);
+  limiter.setSiteLimit(host->address + " out", profile.bandwidth);
+  hosts.push_back(std::move(host));
+  return hosts.back()->address;
+}
+
+void HostFarm::start()
+{
+  std::error_code error;
+  std::filesystem::create_directories(root + "/bin", error);
+  std::ofstream sudo(root + "/bin/sudo");
+  sudo << SUDO_SH;
+  sudo.close();
+  std::filesystem::permissions(root + "/bin/sudo", std::filesystem::perms::owner_all, error);
+  if(!sudo || error)
+    throw(SimpleException("Error: " + root + "/bin/sudo cannot be written."));
+  // scp of OpenSSH 9.0 or newer uses sftp, which the farm does not serve. -O selects the scp protocol.
+  scp_options = "";
+  FILE *usage = popen("scp 2>&1", "r");
+  if(usage != nullptr) {
+    char line[256];
+    if(fgets(line, sizeof(line), usage) != nullptr && std::regex_search(line, std::regex("\\[-[0-9A-Za-z]*O[0-9A-Za-z]*\\]")))
+      scp_options = " -O";
+    pclose(usage);
+  }
+  if(!std::filesystem::exists(key_path)) {
+    ssh_key key;
+    if(ssh_pki_generate(SSH_KEYTYPE_RSA, 2048, &key) != SSH_OK)
+      throw(SimpleException("Error: host key cannot be generated."));
+    int rc = ssh_pki_export_privkey_file(key, NULL, NULL, NULL, key_path.c_str());
+    ssh_key_free(key);
+    if(rc != SSH_OK)
+      throw(SimpleException("Error: host key cannot be saved in " + key_path));
+  }
+  for(std::unique_ptr<FarmHost> &host : hosts) {
+    host->bind = ssh_bind_new();
+    ssh_bind_options_set(host->bind, SSH_BIND_OPTIONS_BINDADDR, host->address.c_str());
+    ssh_bind_options_set(host->bind, SSH_BIND_OPTIONS_BINDPORT, &port);
+    ssh_bind_options_set(host->bind, SSH_BIND_OPTIONS_HOSTKEY, key_path.c_str());
+    if(ssh_bind_listen(host->bind) != SSH_OK)
+      throw(SimpleException("Error: " + host->address + ":" + std::to_string(port) + " cannot be listened: " + ssh_get_error(host->bind)));
+  }
+  stopping = false;
+  acceptor_running = pthread_create(&acceptor, NULL, &HostFarm::acceptLoop, this) == 0;
+  if(!acceptor_running)
+    throw(SimpleException("Error: farm thread cannot be started."));
+}
+
+void HostFarm::stop()
+{
+  stopping = true;
+  if(acceptor_running) {
+    pthread_join(acceptor, NULL);
+    acceptor_running = false;
+  }
+  pthread_mutex_lock(&mutex);
+  std::vector<pthread_t> threads;
+  threads.swap(session_threads);
+  pthread_mutex_unlock(&mutex);
+  for(pthread_t thread : threads)
+    pthread_join(thread, NULL);
+  for(std::unique_ptr<FarmHost> &host : hosts) {
+    if(host->bind != nullptr)
+      ssh_bind_free(host->bind);
+    host->bind = nullptr;
+  }
+}
+
+void HostFarm::addCpuTime()
+{
+  cpu_us += thread_cpu_us();
+}
+
+void *HostFarm::acceptLoop(void *data)
+{
+  HostFarm *farm = (HostFarm *) data;
+  farm->running_threads++;
+  std::vector<struct pollfd> fds;
+  for(std::unique_ptr<FarmHost> &host : farm->hosts)
+    fds.push_back({ssh_bind_get_fd(host->bind), POLLIN, 0});
+  while(!farm->stopping) {
+    if(poll(fds.data(), fds.size(), POLL_MS) <= 0)
+      continue;
+    for(size_t i = 0; i < fds.size(); i++) {
+      if(!(fds[i].revents & POLLIN))
+        continue;
+      FarmSession *session = new FarmSession();
+      session->farm = farm;
+      session->host = farm->hosts[i].get();
+      session->session = ssh_new();
+      session->random.seed(std::hash<std::string>()(session->host->address) + farm->session_count);
+      pthread_t thread;
+      if(ssh_bind_accept(session->host->bind, session->session) != SSH_OK 
+          || pthread_create(&thread, NULL, &HostFarm::sessionLoop, session) != 0) {
+        ssh_free(session->session);
+        delete session;
+        continue;
+      }
+      farm->session_count++;
+      pthread_mutex_lock(&farm->mutex);
+      farm->session_threads.push_back(thread);
+      pthread_mutex_unlock(&farm->mutex);
+    }
+  }
+  farm->addCpuTime();
+  farm->running_threads--;
+  return nullptr;
+}
+
+void *HostFarm::sessionLoop(void *data)
+{
+  FarmSession *session = (FarmSession *) data;
+  HostFarm *farm = session->farm;
+  farm->running_threads++;
+  const HostProfile &profile = session->host->profile;
+  // TCP handshake and key exchange round trips
+  usleep(2 * profile.latency_ms * 1000);
+
+  memset(&session->callbacks, 0, sizeof(session->callbacks));
+  session->callbacks.userdata = session;
+  session->callbacks.auth_password_function = FarmSession::authPassword;
+  session->callbacks.auth_pubkey_function = FarmSession::authPubkey;
+  session->callbacks.channel_open_request_session_function = FarmSession::channelOpen;
+  ssh_callbacks_init(&session->callbacks);
+  ssh_set_server_callbacks(session->session, &session->callbacks);
+  ssh_set_auth_methods(session->session, SSH_AUTH_METHOD_PASSWORD | SSH_AUTH_METHOD_PUBLICKEY);
+
+  if(ssh_handle_key_exchange(session->session) == SSH_OK) {
+    session->event = ssh_event_new();
+    ssh_event_add_session(session->event, session->session);
+    while(!farm->stopping && !session->drop) {
+      bool busy = false;
+      for(std::unique_ptr<FarmChannel> &channel : session->channels)
+        busy = busy || !channel->pending.empty();
+      // Input waiting for a full pipe is retried soon
+      if(ssh_event_dopoll(session->event, busy ? 5 : POLL_MS) == SSH_ERROR)
+        break;
+      auto now = std::chrono::steady_clock::now();
+      for(std::unique_ptr<FarmChannel> &channel : session->channels) {
+        if(channel->done)
+          continue;
+        if(!channel->started && !channel->command.empty() && now >= channel->start_at)
+          session->startCommand(channel.get());
+        if(!channel->started)
+          continue;
+        session->flushInput(channel.get());
+        if(channel->out_fd >= 0 && !session->pumpOutput(channel.get(), channel->out_fd, false)) {
+          ssh_event_remove_fd(session->event, channel->out_fd);
+          close(channel->out_fd);
+          channel->out_fd = -1;
+        }
+        if(channel->err_fd >= 0 && !session->pumpOutput(channel.get(), channel->err_fd, true)) {
+          ssh_event_remove_fd(session->event, channel->err_fd);
+          close(channel->err_fd);
+          channel->err_fd = -1;
+        }
+        int status;
+        if(channel->out_fd < 0 && channel->err_fd < 0 && waitpid(channel->pid, &status, WNOHANG) == channel->pid) {
+          channel->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+          session->finishCommand(channel.get());
+        }
+      }
+      if(ssh_get_status(session->session) & (SSH_CLOSED | SSH_CLOSED_ERROR))
+        break;
+    }
+  }
+  if(session->drop)
+    farm->dropped_count++;
+
+  // Commands of a dropped or finished session are stopped
+  for(std::unique_ptr<FarmChannel> &channel : session->channels) {
+    if(channel->pid > 0 && !channel->done) {
+      kill(channel->pid, SIGKILL);
+      waitpid(channel->pid, NULL, 0);
+    }
+    for(int fd : {channel->in_fd, channel->out_fd, channel->err_fd}) {
+      if(fd >= 0) {
+        if(session->event != nullptr && fd != channel->in_fd)
+          ssh_event_remove_fd(session->event, fd);
+        close(fd);
+      }
+    }
+  }
+  if(session->event != nullptr) {
+    ssh_event_remove_session(session->event, session->session);
+    ssh_event_free(session->event);
+  }
+  ssh_disconnect(session->session);
+  ssh_free(session->session);
+  delete session;
+  farm->addCpuTime();
+  farm->running_threads--;
+  return nullptr;
+}
@@ -0,0 +1,114 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __HOSTFARM_H__
+#define __HOSTFARM_H__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+#include <libssh/libssh.h>
+#include <libssh/server.h>
+#include "bandwidthlimiter.h"
+
+/** Conditions emulated on a host.
+ */
+struct HostProfile
+{
+  // Round trip time. Connections wait 2 round trips (TCP and key exchange), commands 1.
+  unsigned latency_ms = 0;
+  // Bandwidth of the host link in bytes per second (each direction), 0 is no limit
+  uintmax_t bandwidth = 0;
+  // Probability (0..1) of dropping the connection when a command is requested
+  double failure_rate = 0;
+  // Time added to every command
+  unsigned command_ms = 0;
+};
+
+struct FarmHost
+{
+  std::string address;
+  HostProfile profile;
+  ssh_bind bind = nullptr;
+};
+
+/** SSH servers (libssh) in this process emulating a fleet of hosts, 
+ * one per address (127.0.0.2, 127.0.0.3...) on the same port.
+ * Every host has its own folder: commands are run locally by bash with 
+ * HOME=root/hosts/address/home/user and "/home/user" in commands (and in scripts
+ * read by "sh -s") is rewritten to that folder. root/bin/sudo is first in PATH: it checks the password read 
+ * with -S and runs the command as the local user.
+ * Password and public key authentication are accepted. Public keys are read
+ * from .ssh/authorized_keys in the folder of the host.
+ *
+ *  HostFarm farm("/tmp/ssh_helper_bench", 2222, "password");
+ *  std::string address = farm.addHost(profile);
+ *  farm.start();
+ *  ...
+ *  farm.stop();
+ */
+class HostFarm
+{
+  public:
+    /** The host key is saved in root/host_key and used again in the next runs, 
+     * so known_hosts entries of the hosts stay valid.
+     */
+    HostFarm(std::string root, int port, std::string password);
+    ~HostFarm();
+
+    /** Adds a host. Returns its address.
+     */
+    std::string addHost(const HostProfile &profile);
+    /** Listens on all addresses. Throws SimpleException on error.
+     */
+    void start();
+    void stop();
+
+    inline int getPort() {return port;}
+    /** CPU time used by the server threads in microseconds.
+     */
+    inline uint64_t cpuTime() {return cpu_us;}
+    inline unsigned threads() {return running_threads;}
+    inline uint64_t sessions() {return session_count;}
+    inline uint64_t commands() {return command_count;}
+    inline uint64_t dropped() {return dropped_count;}
+
+  private:
+    friend struct FarmSession;
+    std::string root, password, key_path;
+    // Options of scp relays between hosts
+    std::string scp_options;
+    int port;
+    std::vector<std::unique_ptr<FarmHost> > hosts;
+    BandwidthLimiter limiter;
+    std::atomic<bool> stopping;
+    pthread_t acceptor;
+    bool acceptor_running;
+    pthread_mutex_t mutex;
+    std::vector<pthread_t> session_threads;
+    std::atomic<uint64_t> cpu_us, session_count, command_count, dropped_count;
+    std::atomic<unsigned> running_threads;
+
+    static void *acceptLoop(void *data);
+    static void *sessionLoop(void *data);
+    void addCpuTime();
+};
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "hostfarm.h"
+#include "resourcemonitor.h"
+#include "manager.h"
+#include "sshptr.h"
+#include "configfileparser.h"
+#include "simpleexception.h"
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <filesystem>
+#include <random>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+// User and password of the emulated hosts
+static const char *BENCH_USER = "bench";
+static const char *BENCH_PASSWORD = "bench";
+
+struct BenchOptions
+{
+  unsigned hosts = 10;
+  int port = 2222;
+  std::filesystem::path dir = "/tmp/ssh_helper_bench";
+  HostProfile profile;
+  // Hosts with slow_factor times the latency and command time, and 1/slow_factor of the bandwidth
+  double slow_fraction = 0;
+  unsigned slow_factor = 10;
+  unsigned upload_mb = 16;
+  std::filesystem::path scripts_path;
+  bool clean = false;
+  // Hosts are simulated by SimExecutor instead of the farm
+  bool simulate = false;
+  unsigned seed = 1;
+};
+
+void print_help(const char *command)
+{
+  std::cout << command << " [options]" << std::endl;
+  std::cout << R"(
+Runs ssh_helper_cli Manager against a farm of emulated hosts (local libssh servers
+on 127.0.0.2, 127.0.0.3...) and reports wall time, CPU, peak RSS and threads.
+
+The available options are:
+--hosts n             Number of hosts. The default is 10.
+--port port           Port of the hosts. The default is 2222.
+--dir path            Folder of the farm: host key, known_hosts, hosts folders and the
+                      manager HOME. The default is /tmp/ssh_helper_bench.
+--latency ms          Round trip time of hosts.
+--bandwidth rate      Bandwidth of every host in KB/s, 0 is no limit.
+--failure-rate p      Probability (0..1) of a host dropping its connection on every command.
+--command-ms ms       Time added to every command.
+--slow-fraction f     Fraction (0..1) of hosts which are slower.
+--slow-factor x       How much slower they are. The default is 10.
+--upload-mb size      Size of the uploaded file in MB, 0 is no upload. The default is 16.
+--scripts file        File with the "scripts +" to run instead of the default ones.
+--clean               Removes hosts folders and manager caches before the run.
+--simulate            Hosts are simulated (see --simulate of ssh_helper_cli) with the same
+                      profile, no farm is started. The virtual time of the run is printed.
+--seed n              Seed of the simulation. The default is 1.
+--no-multi, --no-cache, --paranoid, --cleanup=mode, --stats, --trace file, --metrics-file file
+                      As in ssh_helper_cli.
+
+)";
+}
+
+// Default scripts: a command with markers and an upload
+static std::string default_scripts(const BenchOptions &bench)
+{
+  std::string scripts = "scripts +\n"
+    "\tscript -\n"
+    "\t\tname: bench command\n"
+    "\t\tcommand:\n"
+    "\t\t\techo \"##progress: 50\"\n"
+    "\t\t\techo \"##metric: home_files $(ls -A | wc -l) files\"\n"
+    "\t\t\techo \"##progress: 100\"\n";
+  if(bench.upload_mb > 0)
+    scripts += "\tupload -\n"
+      "\t\tname: bench upload\n"
+      "\t\torig: " + (bench.dir / "payload.bin").string() + "\n"
+      "\t\tdest: /home/" + BENCH_USER + "/bench/\n"
+      "\t\tuser: " + BENCH_USER + "\n";
+  return scripts;
+}
+
+// Same content in every run, so caches can be measured with several runs
+static void write_payload(std::filesystem::path path, unsigned mb)
+{
+  std::error_code error;
+  if(std::filesystem::file_size(path, error) == mb * 1024ULL * 1024ULL)
+    return;
+  std::ofstream out(path, std::ios::binary);
+  std::mt19937_64 random(mb);
+  std::vector<uint64_t> block(1024 * 1024 / sizeof(uint64_t));
+  for(unsigned i = 0; i < mb; i++) {
+    for(uint64_t &value : block)
+      value = random();
+    out.write((const char *) block.data(), block.size() * sizeof(uint64_t));
+  }
+  if(!out)
+    throw(SimpleException("Error: " + path.string() + " cannot be written."));
+}
+
+int main(int argn, char* argv[])
+{
+  BenchOptions bench;
+  ManagerOptions options;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  for(int i = 1; i < argn; i++) {
+    // Options with a value
+    static const std::set<std::string> with_value = {"--hosts", "--port", "--dir", "--latency", "--bandwidth", 
+      "--failure-rate", "--command-ms", "--slow-fraction", "--slow-factor", "--upload-mb", "--scripts", "--seed", "--trace", "--metrics-file"};
+    if(with_value.contains(argv[i]) && i + 1 >= argn) {
+      std::cerr << "Error: " << argv[i] << " needs a value" << std::endl;
+      print_help(argv[0]);
+      return 1;
+    }
+    std::string option = argv[i];
+    std::stringstream value(with_value.contains(option) ? argv[++i] : "");
+    if(option == "--help") {
+      print_help(argv[0]);
+      return 0;
+    } else if(option == "--hosts")
+      value >> bench.hosts;
+    else if(option == "--port")
+      value >> bench.port;
+    else if(option == "--dir")
+      bench.dir = value.str();
+    else if(option == "--latency")
+      value >> bench.profile.latency_ms;
+    else if(option == "--bandwidth") {
+      value >> bench.profile.bandwidth;
+      bench.profile.bandwidth *= 1024;
+    } else if(option == "--failure-rate")
+      value >> bench.profile.failure_rate;
+    else if(option == "--command-ms")
+      value >> bench.profile.command_ms;
+    else if(option == "--slow-fraction")
+      value >> bench.slow_fraction;
+    else if(option == "--slow-factor")
+      value >> bench.slow_factor;
+    else if(option == "--upload-mb")
+      value >> bench.upload_mb;
+    else if(option == "--scripts")
+      bench.scripts_path = value.str();
+    else if(option == "--clean")
+      bench.clean = true;
+    else if(option == "--simulate")
+      bench.simulate = true;
+    else if(option == "--seed")
+      value >> bench.seed;
+    else if(option == "--no-multi")
+      options.no_multi = true;
+    else if(option == "--no-cache")
+      options.use_cache = false;
+    else if(option == "--paranoid")
+      options.paranoid = true;
+    else if(option == "--cleanup=async")
+      options.cleanup = CleanupMode::ASYNC;
+    else if(option == "--cleanup=end")
+      options.cleanup = CleanupMode::END;
+    else if(option == "--cleanup=never")
+      options.cleanup = CleanupMode::NEVER;
+    else if(option == "--stats")
+      options.stats = true;
+    else if(option == "--trace")
+      options.trace_path = value.str();
+    else if(option == "--metrics-file")
+      options.metrics_path = value.str();
+    else {
+      std::cerr << "Unknown argument: " << argv[i] << std::endl;
+      print_help(argv[0]);
+      return 1;
+    }
+  }
+  if(bench.hosts == 0 || bench.slow_factor == 0) {
+    std::cerr << "Error: --hosts and --slow-factor must be greater than 0." << std::endl;
+    return 1;
+  }
+
+  // Every host uses some file descriptors (socket and pipes of commands)
+  struct rlimit files;
+  if(getrlimit(RLIMIT_NOFILE, &files) == 0) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+
+  int return_state = 0;
+  ssh_init();
+  try {
+    std::error_code error;
+    if(bench.clean) {
+      std::filesystem::remove_all(bench.dir / "hosts", error);
+      std::filesystem::remove_all(bench.dir / "manager" / ".cache", error);
+    }
+    // The manager has its own HOME (keys, caches, provisioned hosts) and known_hosts
+    std::filesystem::create_directories(bench.dir / "manager" / ".ssh", error);
+    setenv("HOME", (bench.dir / "manager").c_str(), 1);
+    SshPtr::setKnownHostsFile((bench.dir / "known_hosts").string());
+
+    HostFarm farm(bench.dir.string(), bench.port, BENCH_PASSWORD);
+    std::string hosts = "hosts +\n";
+    unsigned slow_hosts = bench.hosts * bench.slow_fraction;
+    if(bench.simulate) {
+      options.simulate = true;
+      options.simulation.rtt_ms = bench.profile.latency_ms;
+      options.simulation.bandwidth = bench.profile.bandwidth;
+      options.simulation.failure_rate = bench.profile.failure_rate;
+      options.simulation.command_ms = bench.profile.command_ms;
+      options.simulation.slow_fraction = bench.slow_fraction;
+      options.simulation.slow_factor = bench.slow_factor;
+      options.simulation.seed = bench.seed;
+    }
+    for(unsigned i = 0; bench.simulate && i < bench.hosts; i++)
+      hosts += std::string("\thost -\n\t\tuser: ") + BENCH_USER + "\n\t\thost: sim-" + std::to_string(i) + "\n";
+    for(unsigned i = 0; !bench.simulate && i < bench.hosts; i++) {
+      HostProfile profile = bench.profile;
+      if(i < slow_hosts) {
+        profile.latency_ms *= bench.slow_factor;
+        profile.command_ms *= bench.slow_factor;
+        profile.bandwidth = profile.bandwidth > 0 ? std::max((uintmax_t) 1, profile.bandwidth / bench.slow_factor) : 0;
+      }
+      std::string address = farm.addHost(profile);
+      hosts += std::string("\thost -\n\t\tuser: ") + BENCH_USER + "\n\t\thost: " + address + "\n\t\tport: " + std::to_string(bench.port) + "\n";
+    }
+    std::string scripts;
+    if(bench.scripts_path.empty()) {
+      if(bench.upload_mb > 0)
+        write_payload(bench.dir / "payload.bin", bench.upload_mb);
+      scripts = default_scripts(bench);
+    } else {
+      std::ifstream in(bench.scripts_path);
+      if(!in.is_open())
+        throw(SimpleException("Error: " + bench.scripts_path.string() + " cannot be opened."));
+      std::stringstream buffer;
+      buffer << in.rdbuf();
+      scripts = buffer.str();
+    }
+    std::filesystem::path scripts_file = bench.dir / "scripts.txt";
+    std::ofstream out(scripts_file);
+    out << hosts << scripts;
+    out.close();
+
+    if(!bench.simulate)
+      farm.start();
+    ResourceMonitor monitor([&farm]() {return farm.threads();});
+    monitor.start();
+    {
+      std::shared_ptr<ConfigItemVector> scripts_and_host = ConfigFileParser::parser(scripts_file.string(), Manager::scriptTags());
+      Manager manager(scripts_and_host, BENCH_PASSWORD, options);
+      manager.checkKeys();
+      manager.run();
+    }
+    monitor.stop();
+    farm.stop();
+
+    // Farm threads run in this process, their CPU is shown apart
+    double farm_cpu = farm.cpuTime() / 1e6;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Benchmark: " << bench.hosts << " hosts (" << slow_hosts << " slow), latency " << bench.profile.latency_ms 
+      << " ms, bandwidth " << bench.profile.bandwidth / 1024 << " KB/s, failure rate " << bench.profile.failure_rate 
+      << ", command " << bench.profile.command_ms << " ms" << std::endl;
+    std::cout << "Wall time:      " << monitor.wallTime() << " s" << std::endl;
+    std::cout << "CPU manager:    " << std::max(0.0, monitor.userTime() + monitor.systemTime() - farm_cpu) << " s (user and system, "
+      << monitor.userTime() << " s + " << monitor.systemTime() << " s with the farm)" << std::endl;
+    std::cout << "CPU farm:       " << farm_cpu << " s" << std::endl;
+    std::cout << "CPU commands:   " << monitor.childrenTime() << " s" << std::endl;
+    std::cout << "Peak RSS:       " << monitor.peakRss() << " MB (manager and farm)" << std::endl;
+    std::cout << "Peak threads:   " << monitor.peakThreads() << " (without farm threads)" << std::endl;
+    if(!bench.simulate)
+      std::cout << "Farm:           " << farm.sessions() << " sessions, " << farm.commands() << " commands, " 
+        << farm.dropped() << " dropped connections" << std::endl;
+  } catch(SshException &error) {
+    std::cerr << error.what() << std::endl;
+    return_state = 3;
+  } catch(SimpleException &error) {
+    std::cerr << error.what() << std::endl;
+    return_state = 3;
+  } catch(std::exception &error) {
+    std::cerr << error.what() << std::endl;
+    return_state = 3;
+  }
+  ssh_finalize();
+  return return_state;
+}
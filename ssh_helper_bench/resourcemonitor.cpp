@@ -0,0 +1,126 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "resourcemonitor.h"
+#include "simpleexception.h"
+#include <fstream>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static const useconds_t SAMPLE_US = 10000;
+
+static double seconds(const struct timeval &time)
+{
+  return time.tv_sec + time.tv_usec / 1e6;
+}
+
+// Threads of this process from /proc/self/status
+static unsigned process_threads()
+{
+  std::ifstream status("/proc/self/status");
+  std::string key;
+  unsigned value;
+  while(status >> key) {
+    if(key == "Threads:" && status >> value)
+      return value;
+    status.ignore(4096, '\n');
+  }
+  return 0;
+}
+
+ResourceMonitor::ResourceMonitor(std::function<unsigned()> excluded_threads)
+  : running(false), peak_threads(0)
+{
+  this->excluded_threads = excluded_threads;
+  user_start = system_start = children_start = 0;
+  user_stop = system_stop = children_stop = 0;
+}
+
+void ResourceMonitor::start()
+{
+  struct rusage self, children;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+  user_start = seconds(self.ru_utime);
+  system_start = seconds(self.ru_stime);
+  children_start = seconds(children.ru_utime) + seconds(children.ru_stime);
+  start_time = std::chrono::steady_clock::now();
+  running = true;
+  if(pthread_create(&sampler, NULL, &ResourceMonitor::sampleLoop, this) != 0)
+    throw(SimpleException("Error: resource monitor cannot be started."));
+}
+
+void ResourceMonitor::stop()
+{
+  if(!running)
+    return;
+  stop_time = std::chrono::steady_clock::now();
+  running = false;
+  pthread_join(sampler, NULL);
+  struct rusage self, children;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+  user_stop = seconds(self.ru_utime);
+  system_stop = seconds(self.ru_stime);
+  children_stop = seconds(children.ru_utime) + seconds(children.ru_stime);
+}
+
+void *ResourceMonitor::sampleLoop(void *data)
+{
+  ResourceMonitor *monitor = (ResourceMonitor *) data;
+  while(monitor->running) {
+    unsigned threads = process_threads();
+    // The sampler is not counted
+    threads = threads > 0 ? threads - 1 : 0;
+    if(monitor->excluded_threads) {
+      unsigned excluded = monitor->excluded_threads();
+      threads = threads > excluded ? threads - excluded : 0;
+    }
+    if(threads > monitor->peak_threads)
+      monitor->peak_threads = threads;
+    usleep(SAMPLE_US);
+  }
+  return nullptr;
+}
+
+double ResourceMonitor::wallTime()
+{
+  return std::chrono::duration<double>(stop_time - start_time).count();
+}
+
+double ResourceMonitor::userTime()
+{
+  return user_stop - user_start;
+}
+
+double ResourceMonitor::systemTime()
+{
+  return system_stop - system_start;
+}
+
+double ResourceMonitor::childrenTime()
+{
+  return children_stop - children_start;
+}
+
+double ResourceMonitor::peakRss()
+{
+  struct rusage self;
+  getrusage(RUSAGE_SELF, &self);
+  return self.ru_maxrss / 1024.0;
+}
@@ -0,0 +1,59 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __RESOURCEMONITOR_H__
+#define __RESOURCEMONITOR_H__
+
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <pthread.h>
+
+/** Wall time, CPU time, peak RSS and peak number of threads of this process
+ * from start() to stop(). Threads are sampled every 10 ms.
+ */
+class ResourceMonitor
+{
+  public:
+    /** excluded_threads returns the threads which are not counted (the host farm).
+     */
+    ResourceMonitor(std::function<unsigned()> excluded_threads = nullptr);
+    void start();
+    void stop();
+
+    double wallTime();
+    // CPU of this process and of its finished children, in seconds
+    double userTime();
+    double systemTime();
+    double childrenTime();
+    // In MB
+    double peakRss();
+    inline unsigned peakThreads() {return peak_threads;}
+
+  private:
+    std::function<unsigned()> excluded_threads;
+    std::chrono::steady_clock::time_point start_time, stop_time;
+    double user_start, system_start, children_start;
+    double user_stop, system_stop, children_stop;
+    std::atomic<bool> running;
+    std::atomic<unsigned> peak_threads;
+    pthread_t sampler;
+
+    static void *sampleLoop(void *data);
+};
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "bandwidthlimiter.h"
+#include "simpleexception.h"
+#include <algorithm>
+#include <time.h>
+
+// Tokens saved while a bucket is not used, in seconds of its rate
+static const double BURST_TIME = 0.25;
+
+BandwidthLimiter::BandwidthLimiter()
+{
+  if(pthread_mutex_init(&mutex, NULL) != 0) 
+    throw(SimpleException("Error: mutex init failed\n"));
+  if(pthread_cond_init(&cond, NULL) != 0) 
+    throw(SimpleException("Error: cond init failed\n"));
+}
+
+BandwidthLimiter::~BandwidthLimiter()
+{
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void BandwidthLimiter::setLimit(uintmax_t bytes_per_second)
+{
+  pthread_mutex_lock(&mutex);
+  global.rate = bytes_per_second;
+  global.tokens = 0;
+  global.last = std::chrono::steady_clock::now();
+  pthread_mutex_unlock(&mutex);
+}
+
+void BandwidthLimiter::setSiteLimit(std::string site, uintmax_t bytes_per_second)
+{
+  pthread_mutex_lock(&mutex);
+  Bucket &bucket = sites[site];
+  bucket.rate = bytes_per_second;
+  bucket.tokens = 0;
+  bucket.last = std::chrono::steady_clock::now();
+  pthread_mutex_unlock(&mutex);
+}
+
+uintmax_t BandwidthLimiter::getLimit(std::string site)
+{
+  pthread_mutex_lock(&mutex);
+  uintmax_t limit = global.rate;
+  if(sites.contains(site) && sites[site].rate > 0)
+    limit = limit > 0 ? std::min(limit, (uintmax_t) sites[site].rate) : (uintmax_t) sites[site].rate;
+  pthread_mutex_unlock(&mutex);
+  return limit;
+}
+
+// Called with mutex locked
+void BandwidthLimiter::take(Bucket &bucket, size_t nbytes)
+{
+  if(bucket.rate <= 0)
+    return;
+  uint64_t ticket = bucket.next_ticket++;
+  while(ticket != bucket.serving)
+    pthread_cond_wait(&cond, &mutex);
+  while(true) {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - bucket.last).count();
+    bucket.last = now;
+    bucket.tokens = std::min(bucket.tokens + elapsed * bucket.rate, bucket.rate * BURST_TIME);
+    if(bucket.tokens >= 0)
+      break;
+    // Wait for the debt of the last transfer. Other buckets can be used meanwhile.
+    double wait = -bucket.tokens / bucket.rate;
+    struct timespec ts;
+    ts.tv_sec = (time_t) wait;
+    ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+    pthread_mutex_unlock(&mutex);
+    nanosleep(&ts, NULL);
+    pthread_mutex_lock(&mutex);
+  }
+  // Tokens can be negative: the next transfer waits for them
+  bucket.tokens -= nbytes;
+  bucket.serving++;
+  pthread_cond_broadcast(&cond);
+}
+
+void BandwidthLimiter::acquire(std::string site, size_t nbytes)
+{
+  pthread_mutex_lock(&mutex);
+  if(!site.empty() && sites.contains(site))
+    take(sites[site], nbytes);
+  take(global, nbytes);
+  pthread_mutex_unlock(&mutex);
+}
+
+uintmax_t BandwidthLimiter::startRelay(std::string site)
+{
+  uintmax_t limit = getLimit(site);
+  pthread_mutex_lock(&mutex);
+  unsigned running = relays[site]++;
+  pthread_mutex_unlock(&mutex);
+  return limit > 0 ? std::max((uintmax_t) 1, limit / (running + 1)) : 0;
+}
+
+void BandwidthLimiter::endRelay(std::string site)
+{
+  pthread_mutex_lock(&mutex);
+  if(relays[site] > 0)
+    relays[site]--;
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,76 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __BANDWIDTHLIMITER_H__
+#define __BANDWIDTHLIMITER_H__
+
+#include <pthread.h>
+#include <cstdint>
+#include <string>
+#include <map>
+#include <chrono>
+
+/** Token bucket shared by all transfers. A global limit and limits per 
+ * site (a group of hosts) can be set, in bytes per second.
+ * Transfers wait for their turn in arrival order, so hosts get the bandwidth
+ * in turns of a buffer (64 KB).
+ *
+ *  limiter->acquire(site, nbytes);
+ *  ssh_channel_write(channel, buffer, nbytes);
+ */
+class BandwidthLimiter
+{
+  public:
+    BandwidthLimiter();
+    ~BandwidthLimiter();
+
+    /** Sets the global limit. 0 is no limit.
+     */
+    void setLimit(uintmax_t bytes_per_second);
+    void setSiteLimit(std::string site, uintmax_t bytes_per_second);
+    /** Limit of site (the lower of the global and the site limits). 0 is no limit.
+     */
+    uintmax_t getLimit(std::string site);
+    /** Waits until nbytes can be sent or received by a host of site.
+     */
+    void acquire(std::string site, size_t nbytes);
+    /** Relays between hosts (scp -l) do not pass through acquire(). A relay 
+     * started in site gets an equal part of the limit with the relays which 
+     * are running, 0 is no limit. Running relays keep their part, so the sum 
+     * can be over the limit until they end. endRelay must be called at the end.
+     */
+    uintmax_t startRelay(std::string site);
+    void endRelay(std::string site);
+
+  private:
+    struct Bucket {
+      double rate = 0; // bytes per second, 0 is no limit
+      double tokens = 0;
+      std::chrono::steady_clock::time_point last;
+      // FIFO turns
+      uint64_t next_ticket = 0, serving = 0;
+    };
+    Bucket global;
+    std::map<std::string, Bucket> sites;
+    std::map<std::string, unsigned> relays;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    void take(Bucket &bucket, size_t nbytes);
+};
+
+#endif
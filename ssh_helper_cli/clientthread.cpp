@@ -17,11 +17,32 @@
 
 #include "clientthread.h"
 #include "simpleexception.h"
+#include "delta.h"
+#include "tar.h"
+#include "compressor.h"
+#include "hash.h"
+#include "timeline.h"
+#include "metrics.h"
+#include "tracing.h"
+#include "scriptmetrics.h"
+#include "remotecommands.h"
 #include <fstream>
 #include <filesystem>
 #include <time.h>
 #include <regex>
+#include <sstream>
+#include <unistd.h>
+#include <cstring>
+#include <fcntl.h>
 
+// Uploads of files of this size or bigger can be resumed
+static const uintmax_t RESUME_MIN_SIZE = 8 * 1024 * 1024;
+// Retries of failed uploads (the connection is opened again)
+static const int UPLOAD_RETRIES = 3;
+// Interrupted uploads older than this are removed from the cache folder
+static const int PARTIAL_MAX_DAYS = 7;
+// Downloaded files of this size or bigger are sent in ranges (see "streams" tag)
+static const uintmax_t RANGE_DOWNLOAD_SIZE = 256 * 1024 * 1024;
 
 const std::string ASKPASS_PY = R"(#!/usr/bin/env python3
 
@@ -124,7 +145,7 @@ if __name__ == '__main__':
 )";
 
 
-ClientThread::ClientThread(std::shared_ptr<ThreadSharedData> threadSharedData, std::string host, int port, std::string user, std::string password, std::ostream *log_output)
+ClientThread::ClientThread(std::shared_ptr<ThreadSharedData> threadSharedData, std::string host, int port, std::string user, std::string password, std::ostream *log_output, std::string site)
 {
   mThreadSharedData = threadSharedData;
   this->host = host;
@@ -132,6 +153,11 @@ ClientThread::ClientThread(std::shared_ptr<ThreadSharedData> threadSharedData, s
   this->password = password;
   this->port = port;
   this->log_output = log_output;
+  this->site = site;
+  remote_compressors = -1;
+  has_seeds = false;
+  cleaned = false;
+  step_failed = false;
   is_connected = false;
   thread = new pthread_t;
   mutex = new pthread_mutex_t;
@@ -158,12 +184,18 @@ pthread_t *ClientThread::getThread()
 
 void *ClientThread::start(void *data)
 {
+  ClientThread *client = (ClientThread *)data;
+  bool failed = true;
+  Metrics::add("ssh_helper_hosts_running", 1);
   try {
-    ClientThread *client = (ClientThread *)data;
+    Timeline::setTrack(client->user + "@" + client->host);
     client->run();
+    failed = !client->is_connected || client->step_failed;
   } catch(SimpleException &error) {
     std::cerr << error.what() << std::endl;
   }
+  Metrics::add("ssh_helper_hosts_running", -1);
+  Metrics::add(failed ? "ssh_helper_hosts_failed_total" : "ssh_helper_hosts_done_total", 1);
   return nullptr;
 }
 
@@ -171,14 +203,25 @@ void *ClientThread::start(void *data)
 bool ClientThread::connect()
 {
   if(! is_connected) {
-    ssh = std::make_shared<SshPtr>(host, port);
-    is_connected = ssh->connect(user, password);
+    TimelineSpan span("session", "ssh");
+    ssh = mThreadSharedData->new_executor(host, port);
+    ssh->setBandwidthLimiter(mThreadSharedData->bandwidth, site);
+    std::string name = user + "@" + host;
+    ssh->setMarkerHandler([name](MarkerType type, const std::string &text) {
+      if(type == MarkerType::METRIC)
+        ScriptMetrics::metric(name, text);
+      else if(type == MarkerType::PROGRESS)
+        ScriptMetrics::progress(name, text);
+    });
+    is_connected = ssh->connect(user, password, mThreadSharedData->isProvisioned(user + "@" + host));
   }
   return is_connected;
 }
 
 void ClientThread::save_log(std::shared_ptr<ConfigItemMap> map, std::string log, const int &rc)
 {
+  if(rc != 0)
+    step_failed = true;
   if(map->getValue().contains("name")) {
     std::shared_ptr<ConfigItem> name_ptr = map->getValue()["name"];
     if(name_ptr->getType() == ConfigItemType::STRING) {
@@ -208,53 +251,535 @@ void ClientThread::save_log(std::shared_ptr<ConfigItemMap> map, std::string log,
   }
 }
 
+std::tuple<int /*status*/, std::string /*log*/> ClientThread::copy_to_dest(std::string src, std::string dest, std::string dest_path, std::string final_user, std::string md5)
+{
+  int rc;
+  std::string log;
+  std::string command;
+  std::string chown = final_user == user ? "" : " && chown " + final_user + " '" + dest_path + "'";
+  if(md5.empty()) {
+    command = RemoteCommands::copy(src, dest, dest_path, chown, false);
+    if(final_user == user)
+      std::tie(rc, log) = ssh->exec(command);
+    else
+      std::tie(rc, log) = ssh->exec_sudo("sh -c \"" + command + "\"");
+  } else {
+    // md5 is computed from the copied stream, dest_path is not read again.
+    std::shared_ptr<char*> output;
+    command = RemoteCommands::copy(src, dest, dest_path, chown, true);
+    if(final_user == user)
+      std::tie(rc, output, log) = ssh->exec_get_output(command);
+    else
+      std::tie(rc, output, log) = ssh->exec_sudo_get_output(command);
+    if(rc == 0) {
+      std::string md5_host = strip(*output);
+      md5_host = md5_host.substr(0, md5_host.find(' '));
+      if(md5_host != md5) {
+        rc = 1;
+        log = "Error: md5 of " + dest_path + " is " + md5_host + ", expected " + md5;
+      }
+    }
+  }
+  return std::make_tuple(rc, log);
+}
+
+void ClientThread::save_remote_file_state(std::string stat_line, std::string path, std::string md5)
+{
+  RemoteFileState state;
+  std::stringstream buffer(stat_line);
+  if(buffer >> state.size >> state.mtime) {
+    state.md5 = md5;
+    mThreadSharedData->setRemoteFileState(user + "@" + host, path, state);
+  }
+}
+
+void ClientThread::update_remote_file_state(std::string path, std::string final_user, std::string md5)
+{
+  int rc;
+  std::shared_ptr<char*> output;
+  std::string log;
+  std::string command = RemoteCommands::stat(path);
+  if(final_user == user)
+    std::tie(rc, output, log) = ssh->exec_get_output(command);
+  else
+    std::tie(rc, output, log) = ssh->exec_sudo_get_output(command);
+  if(rc == 0)
+    save_remote_file_state(*output, path, md5);
+}
+
+// Writes a range of a file in big blocks with pwrite
+class RangeWriter
+{
+  public:
+    RangeWriter(int fd, off_t offset) : fd(fd), offset(offset) {buffer.reserve(RANGE_BUFFER_SIZE);}
+
+    bool write(const char *data, size_t size) {
+      if(buffer.size() + size > RANGE_BUFFER_SIZE && !flush())
+        return false;
+      buffer.insert(buffer.end(), data, data + size);
+      return true;
+    }
+
+    bool flush() {
+      size_t done = 0;
+      while(done < buffer.size()) {
+        ssize_t nbytes = pwrite(fd, buffer.data() + done, buffer.size() - done, offset);
+        if(nbytes <= 0)
+          return false;
+        done += nbytes;
+        offset += nbytes;
+      }
+      buffer.clear();
+      return true;
+    }
+
+    static const size_t RANGE_BUFFER_SIZE = 1024 * 1024;
+
+  private:
+    int fd;
+    off_t offset;
+    std::vector<char> buffer;
+};
+
+std::tuple<int /*status*/, std::string /*log*/> ClientThread::download_ranges(std::string orig, std::string dest_folder, uintmax_t size, int streams, CompressType compress)
+{
+  int rc;
+  std::string log;
+  std::string dest_path = dest_folder + "/" + std::filesystem::path(orig).filename().string();
+  std::string part_path = dest_path + ".part";
+  int fd = open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd < 0)
+    return std::make_tuple(1, "Download failed: " + part_path + " cannot be written.");
+  if(posix_fallocate(fd, 0, size) != 0) {
+    close(fd);
+    unlink(part_path.c_str());
+    return std::make_tuple(1, "Download failed: no space for " + part_path);
+  }
+
+  // Ranges are multiples of 1 MB blocks, so any dd can read them
+  const uintmax_t block = 1024 * 1024;
+  uintmax_t blocks = (size + block - 1) / block;
+  uintmax_t range_blocks = (blocks + streams - 1) / streams;
+  std::vector<std::string> commands;
+  std::vector<std::unique_ptr<RangeWriter>> writers;
+  std::vector<std::unique_ptr<Decompressor>> decompressors;
+  std::vector<SshDataSink> sinks;
+  for(uintmax_t first = 0; first < blocks; first += range_blocks) {
+    std::string command = "dd if='" + orig + "' bs=" + std::to_string(block) + " skip=" + std::to_string(first) 
+      + " count=" + std::to_string(range_blocks) + " 2>/dev/null";
+    if(compress == COMPRESS_ZSTD)
+      command = "bash -c \"set -o pipefail; " + command + " | zstd -q -c -T0\"";
+    else if(compress == COMPRESS_LZ4)
+      command = "bash -c \"set -o pipefail; " + command + " | lz4 -q -c\"";
+    commands.push_back(command);
+    writers.push_back(std::make_unique<RangeWriter>(fd, first * block));
+    RangeWriter *writer = writers.back().get();
+    sinks.push_back([writer](const char *buffer, size_t size) {
+      return writer->write(buffer, size);
+    });
+  }
+  // Remote md5 is computed at the same time
+  std::string remote_md5;
+  commands.push_back("md5sum -b '" + orig + "'");
+  sinks.push_back([&remote_md5](const char *buffer, size_t size) {
+    remote_md5.append(buffer, size);
+    return true;
+  });
+
+  try {
+    if(compress != COMPRESS_NONE) {
+      for(size_t i = 0; i < writers.size(); i++) {
+        decompressors.push_back(std::make_unique<Decompressor>(compress, sinks[i]));
+        Decompressor *decompressor = decompressors.back().get();
+        sinks[i] = [decompressor](const char *buffer, size_t size) {
+          return decompressor->write(buffer, size);
+        };
+      }
+    }
+    std::tie(rc, log) = ssh->exec_read(commands, sinks, true);
+    for(auto& decompressor : decompressors)
+      decompressor->finish();
+    for(auto& writer : writers) {
+      if(!writer->flush()) {
+        rc = 1;
+        log = part_path + " cannot be written.";
+      }
+    }
+  } catch(SshException &error) {
+    rc = 1;
+    log = error.what();
+  } catch(SimpleException &error) {
+    rc = 1;
+    log = error.what();
+  }
+  close(fd);
+
+  if(rc == 0) {
+    remote_md5 = strip(remote_md5);
+    remote_md5 = remote_md5.substr(0, remote_md5.find(' '));
+    std::string local_md5;
+    try {
+      local_md5 = Hash::file(part_path);
+    } catch(SimpleException &error) {
+      rc = 1;
+      log = error.what();
+    }
+    if(rc == 0 && local_md5 != remote_md5) {
+      rc = 1;
+      log = "md5 of downloaded file (" + local_md5 + ") is not " + remote_md5;
+    } else if(rc == 0 && rename(part_path.c_str(), dest_path.c_str()) != 0) {
+      rc = 1;
+      log = dest_path + " cannot be written.";
+    }
+  }
+  if(rc != 0) {
+    unlink(part_path.c_str());
+    log = "Download failed: " + log;
+  }
+  return std::make_tuple(rc, log);
+}
+
+CompressType ClientThread::compress_type(std::shared_ptr<ConfigItemMap> map, std::string sample_path)
+{
+  std::string value = strip(ConfigFileParser::getMapValue(map, "compress"));
+  if(value.empty() || value == "none")
+    return COMPRESS_NONE;
+  if(remote_compressors < 0) {
+    int rc;
+    std::shared_ptr<char*> output;
+    std::string log;
+    std::tie(rc, output, log) = ssh->exec_get_output("command -v zstd >/dev/null && echo zstd; command -v lz4 >/dev/null && echo lz4; true");
+    remote_compressors = 0;
+    if(rc == 0) {
+      std::string tools(*output);
+      if(tools.find("zstd") != std::string::npos)
+        remote_compressors |= 1;
+      if(tools.find("lz4") != std::string::npos)
+        remote_compressors |= 2;
+    }
+  }
+  // Data is sent without compression if the tool is missing on either side
+  bool zstd = (remote_compressors & 1) && Compressor::isLocal(COMPRESS_ZSTD);
+  bool lz4 = (remote_compressors & 2) && Compressor::isLocal(COMPRESS_LZ4);
+  return Compressor::choose(value, sample_path, zstd, lz4);
+}
+
+std::tuple<int /*status*/, std::string /*log*/> ClientThread::delta_upload(std::string orig, std::string dest_path, uintmax_t dest_size, std::string shared_folder, std::string final_user, std::string md5)
+{
+  int rc;
+  std::string log;
+  std::shared_ptr<char*> output;
+  std::string out_path = shared_folder + "/" + dest_path;
+  std::string script_path = shared_folder + "/delta.py";
+  size_t block_size = Delta::blockSize(dest_size);
+  bool sudo = final_user != user;
+
+  std::tie(rc, log) = ssh->exec("mkdir -p '" + std::filesystem::path(out_path).parent_path().string() + "' && head -c " + std::to_string(DELTA_PY.size()) + " - > '" + script_path + "'", DELTA_PY);
+  if(rc != 0)
+    return std::make_tuple(rc, std::string("delta.py cannot be written."));
+
+  // Signatures of the blocks of the file on host
+  std::string command = "python3 '" + script_path + "' signature '" + dest_path + "' " + std::to_string(block_size);
+  try {
+    if(sudo)
+      std::tie(rc, output, log) = ssh->exec_sudo_get_output(command);
+    else
+      std::tie(rc, output, log) = ssh->exec_get_output(command);
+  } catch(SshException &error) {
+    rc = 1;
+  }
+  if(rc != 0)
+    return std::make_tuple(rc, std::string("Signatures of ") + dest_path + " cannot be read.");
+  std::vector<DeltaBlock> blocks = Delta::parseSignatures(*output);
+
+  char delta_path[] = "/tmp/ssh_helper_delta_XXXXXX";
+  int fd = mkstemp(delta_path);
+  if(fd < 0)
+    return std::make_tuple(1, std::string("Delta temp file cannot be created."));
+  close(fd);
+  try {
+    uintmax_t literal = Delta::make(orig, block_size, blocks, delta_path);
+    std::cout << user << "@" << host << " delta of " << orig << ": " << literal << " bytes of " 
+      << std::filesystem::file_size(orig) << " are sent." << std::endl;
+
+    FILE *in = fopen(delta_path, "r");
+    if(in == nullptr)
+      throw(SimpleException(std::string("Delta file ") + delta_path + " cannot be read."));
+    SshDataSource source = [&in](char *buffer, size_t size) {
+      return fread(buffer, sizeof(char), size, in);
+    };
+    command = "python3 '" + script_path + "' patch '" + dest_path + "' '" + out_path + "' " + std::to_string(block_size);
+    if(sudo)
+      command = "bash -c \"" + command + " && chown " + user + " '" + out_path + "'\"";
+    try {
+      std::tie(rc, output, log) = ssh->exec_write_get_output(command, source, sudo);
+    } catch(SshException &error) {
+      rc = 1;
+      log = error.what();
+    }
+    fclose(in);
+  } catch(SimpleException &error) {
+    rc = 1;
+    log = error.what();
+  }
+  unlink(delta_path);
+
+  if(rc == 0 && strip(*output) != md5) {
+    rc = 1;
+    log = "md5 of rebuilt file is " + strip(*output) + ", expected " + md5;
+  }
+  return std::make_tuple(rc, log);
+}
+
+void ClientThread::upload_directory(std::shared_ptr<ConfigItemMap> map, std::string orig, std::string dest, std::string final_user)
+{
+  int rc;
+  std::string log;
+  std::shared_ptr<char*> output;
+  bool sudo = final_user != user;
+  bool delete_files = !strip(ConfigFileParser::getMapValue(map, "delete")).empty();
+  std::filesystem::path orig_path(orig);
+  if(!orig_path.has_filename())
+    orig_path = orig_path.parent_path();
+  std::string target = dest + "/" + orig_path.filename().string();
+
+  // Local manifest, made once by Manager for all hosts
+  std::shared_ptr<const FolderManifest> manifest = mThreadSharedData->getManifest(orig_path.string());
+  if(!manifest->error.empty()) {
+    save_log(map, manifest->error, 1);
+    return;
+  }
+  const std::vector<std::string> &files = manifest->files;
+  const std::vector<std::string> &md5s = manifest->md5s;
+
+  // Remote manifest in one command
+  std::string command = "bash -c \"cd '" + target + "' 2>/dev/null || exit 0; find . -type f -print0 | xargs -0 -r md5sum -b\"";
+  try {
+    if(sudo)
+      std::tie(rc, output, log) = ssh->exec_sudo_get_output(command);
+    else
+      std::tie(rc, output, log) = ssh->exec_get_output(command);
+  } catch(SshException &error) {
+    rc = 1;
+    log = error.what();
+  }
+  if(rc != 0) {
+    save_log(map, log.empty() ? "Error: remote files of " + target + " cannot be read." : log, rc);
+    return;
+  }
+  std::map<std::string, std::string> remote;
+  std::stringstream lines(*output);
+  std::string line;
+  while(std::getline(lines, line)) {
+    // "md5 *./path". Escaped names start with '\\' and are sent again.
+    std::string::size_type pos = line.find(" *./");
+    if(line.starts_with("\\") || pos == std::string::npos)
+      continue;
+    remote[line.substr(pos + 4)] = line.substr(0, pos);
+  }
+
+  std::vector<std::string> changed;
+  for(size_t i = 0; i < files.size(); i++) {
+    auto it = remote.find(files[i]);
+    if(it == remote.end() || it->second != md5s[i])
+      changed.push_back(files[i]);
+    if(it != remote.end())
+      remote.erase(it);
+  }
+  std::cout << user << "@" << host << " " << target << ": " << changed.size() << " of " << files.size() << " files changed." << std::endl;
+
+  // Changed files are sent as one tar stream
+  if(!changed.empty()) {
+    TarWriter tar(orig_path.string(), changed);
+    SshDataSource source = [&tar](char *buffer, size_t size) {
+      return tar.read(buffer, size);
+    };
+    CompressType compress = compress_type(map, "");
+    command = "mkdir -p '" + target + "' && " + Compressor::decompressCommand(compress) + " | tar -xf - -C '" + target + "' --no-same-owner";
+    command = "bash -c \"set -o pipefail; " + command + (sudo ? " && chown -R " + final_user + " '" + target + "'" : "") + "\"";
+    try {
+      if(compress != COMPRESS_NONE) {
+        Compressor compressor(compress, source);
+        SshDataSource compressed = [&compressor](char *buffer, size_t size) {
+          return compressor.read(buffer, size);
+        };
+        std::tie(rc, output, log) = ssh->exec_write_get_output(command, compressed, sudo);
+      } else {
+        std::tie(rc, output, log) = ssh->exec_write_get_output(command, source, sudo);
+      }
+    } catch(SshException &error) {
+      rc = 1;
+      log = error.what();
+    } catch(SimpleException &error) {
+      rc = 1;
+      log = error.what();
+    }
+    if(rc != 0) {
+      save_log(map, log.empty() ? std::string("Error: files cannot be sent.") : log, rc);
+      return;
+    }
+  }
+
+  // Files removed from orig are deleted on host
+  size_t deleted = 0;
+  if(delete_files && !remote.empty()) {
+    std::string list;
+    for(const auto& [name, md5] : remote)
+      list += name + '\0';
+    size_t pos = 0;
+    SshDataSource source = [&list, &pos](char *buffer, size_t size) {
+      size_t n = std::min(size, list.size() - pos);
+      memcpy(buffer, list.c_str() + pos, n);
+      pos += n;
+      return n;
+    };
+    command = "bash -c \"cd '" + target + "' && xargs -0 -r rm -f --\"";
+    try {
+      std::tie(rc, output, log) = ssh->exec_write_get_output(command, source, sudo);
+    } catch(SshException &error) {
+      rc = 1;
+      log = error.what();
+    }
+    if(rc == 0)
+      deleted = remote.size();
+  }
+
+  if(log.empty() && rc == 0)
+    log = std::to_string(changed.size()) + " files sent, " + std::to_string(deleted) + " files deleted.";
+  save_log(map, log, rc);
+}
+
+// Prepares a host in one command: shared folder, manager public key in 
+// authorized_keys and available tools. The last line is a status line:
+// ##bootstrap: ok key=present|added|skipped zstd=yes|no lz4=yes|no home=$HOME
+// or "##bootstrap: error=step" if a step fails.
+void ClientThread::bootstrap(std::string shared_folder)
+{
+  TimelineSpan span("bootstrap", "setup");
+  // The key is installed again on provisioned hosts if it was not accepted
+  std::string provisioned_host = user + "@" + host;
+  bool install_key = !mThreadSharedData->isProvisioned(provisioned_host) || !ssh->isPublicKeyAuth();
+  std::string public_key = install_key ? mThreadSharedData->public_key : "";
+
+  int rc;
+  std::shared_ptr<char*> output;
+  std::string log;
+  std::tie(rc, output, log) = ssh->exec_get_output("sh -s", RemoteCommands::bootstrap(shared_folder, public_key));
+  std::string status;
+  std::stringstream lines(*output);
+  std::string line;
+  while(std::getline(lines, line)) {
+    if(line.starts_with("##bootstrap: "))
+      status = line.substr(13);
+  }
+  if(rc != 0 || !status.starts_with("ok"))
+    throw(SimpleException("Error: " + user + "@" + host + " cannot be prepared: " + (status.empty() ? std::string("no status") : status)));
+  remote_compressors = 0;
+  if(status.find("zstd=yes") != std::string::npos)
+    remote_compressors |= 1;
+  if(status.find("lz4=yes") != std::string::npos)
+    remote_compressors |= 2;
+  // Home of the user on the host ("/root", "/var/lib/user"...), it is the last value
+  std::string::size_type home = status.find(" home=");
+  std::string home_folder = home != std::string::npos ? strip(status.substr(home + 6)) : "";
+  if(home_folder.empty())
+    home_folder = "/home/" + user;
+  cache_folder = home_folder + "/.local/share/ssh_helper_cache";
+  if(install_key)
+    mThreadSharedData->setProvisioned(provisioned_host, true);
+}
+
+void ClientThread::disconnect()
+{
+  is_connected = false;
+  ssh = nullptr;
+}
+
+bool ClientThread::reconnect()
+{
+  TRACE_INSTANT("reconnect", "ssh", host);
+  is_connected = false;
+  ssh = nullptr;
+  return connect();
+}
+
+std::tuple<std::string /*local md5*/, std::string /*remote md5*/> ClientThread::resumable_write(std::string orig, std::string dest, std::string md5, CompressType compress)
+{
+  std::error_code error;
+  uintmax_t size = std::filesystem::file_size(orig, error);
+  // Big files are written to partial/md5 in the cache folder, so an interrupted
+  // transfer can go on from the last received byte in this run or in the next one.
+  bool resumable = !error && size >= RESUME_MIN_SIZE;
+  std::string partial = cache_folder + "/partial/" + md5;
+  std::string local_md5, remote_md5;
+  for(int attempt = 0; ; attempt++) {
+    try {
+      if(!resumable) {
+        std::tie(local_md5, remote_md5) = ssh->stream_write(orig, dest, compress);
+        return std::make_tuple(local_md5, remote_md5);
+      }
+      // The size of the partial file is the offset and its md5 checks the prefix
+      int rc;
+      std::shared_ptr<char*> output;
+      std::string log;
+      std::tie(rc, output, log) = ssh->exec_get_output(RemoteCommands::partialProbe(partial));
+      uintmax_t offset = 0;
+      std::string prefix_md5;
+      if(rc == 0) {
+        std::stringstream buff(*output);
+        buff >> offset >> prefix_md5;
+      }
+      std::tie(local_md5, remote_md5) = ssh->stream_write(orig, partial, compress, offset, prefix_md5);
+      if(local_md5 == md5 && remote_md5 == md5) {
+        std::tie(rc, log) = ssh->exec(RemoteCommands::movePartial(partial, dest));
+        if(rc != 0)
+          throw(SshException("[ClientThread::resumable_write]: " + partial + " cannot be moved to " + dest));
+      } else {
+        std::tie(rc, log) = ssh->exec(RemoteCommands::remove(partial));
+      }
+      return std::make_tuple(local_md5, remote_md5);
+    } catch(SshException &error) {
+      if(attempt >= UPLOAD_RETRIES)
+        throw(error);
+      std::cout << user << "@" << host << " upload of " << orig << " failed: " << error.what() << " Retrying..." << std::endl;
+      TRACE_INSTANT("upload retry", "transfer", orig);
+      ssh->delay(2 << attempt);
+      if(!reconnect())
+        throw(error);
+    }
+  }
+}
+
+void ClientThread::add_to_cache(std::string path, std::string md5)
+{
+  if(! mThreadSharedData->use_cache)
+    return;
+  int rc;
+  std::string log;
+  std::string cache_path = cache_folder + "/" + md5;
+  // The file is hard linked (copied if it is not possible) to the cache.
+  std::tie(rc, log) = ssh->exec(RemoteCommands::addToCache(path, cache_folder, cache_path));
+  if(rc != 0)
+    return;
+  // Remove the least recently used files until the cache fits in cache_size
+  std::tie(rc, log) = ssh->exec("cd '" + cache_folder + "' && total=0 && ls -t | while read f; do "
+    "[ -f \"$f\" ] || continue; "
+    "total=$((total + $(stat -c %s \"$f\"))); "
+    "[ $total -gt " + std::to_string(mThreadSharedData->cache_size) + " ] && rm -f \"$f\"; "
+    "done; true");
+}
+
 void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
 {
   std::string log;
   std::cout << "Client " << host << std::endl; 
   std::string shared_folder = "/home/" + user + "/.local/share/ssh_helper_temp/" + mThreadSharedData->id_session;
   
+  // Monitor scripts run again with their own scripts
+  bool top_level = scripts == nullptr;
   if(connect()) {
-    if(scripts == nullptr) {
-      // Set shared folder
-      {
-        int rc;
-        std::string log;
-        std::tie(rc, log) = ssh->exec("mkdir -p " + shared_folder); 
-        std::tie(rc, log) = ssh->exec("chmod 700 " + shared_folder);
-      }
-
-      // Send manager public keys
-      {
-        int rc;
-        std::string log;
-        char *local_user = getenv("USER");
-        if(local_user == NULL)
-          throw("Error: USER environmet variable cannot be read.");
-        std::string public_key_file("/home/" + std::string(local_user) + "/.ssh/id_rsa.pub");
-        std::string public_key;
-        std::ifstream public_key_stream;
-        public_key_stream.open(public_key_file);
-        if(!public_key_stream.is_open())
-          throw("Error: " + public_key_file + " cannot be opened.");
-        getline(public_key_stream, public_key);
-        public_key_stream.close();
-
-        std::tie(rc, log) = ssh->exec("mkdir -p ~/.ssh"); 
-        std::tie(rc, log) = ssh->exec("chmod 700 ~/.ssh");
-
-        // Public key is added to authorized_keys
-        // Check if key is not in authorized_keys:
-        std::tie(rc, log) = ssh->exec("grep -e '" + public_key + "' ~/.ssh/authorized_keys");
-        if(rc != 0) {
-          // Add key to authorized_keys
-          std::tie(rc, log) = ssh->exec("echo '' >> ~/.ssh/authorized_keys"); // Add a \n to authorized_keys
-          std::tie(rc, log) = ssh->exec("echo '" + public_key + "' >> ~/.ssh/authorized_keys");
-          if(rc != 0)
-            throw("Error: public keys cannot be added to " + user + "@" + host);
-        }
-      }
-    }
+    if(top_level)
+      bootstrap(shared_folder);
     // Run scripts
     if(scripts == nullptr)
       scripts = mThreadSharedData->getScripts();
@@ -262,6 +787,10 @@ void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
       std::string tag;
       std::shared_ptr<ConfigItem> value;
       std::tie(tag, value) = script;
+      std::string step_name;
+      if(value->getType() == ConfigItemType::MAP)
+        step_name = strip(ConfigFileParser::getMapValue(ConfigFileParser::getMap(value), "name"));
+      TimelineSpan step(tag, "script", step_name);
       if(tag == "script" && value->getType() == ConfigItemType::MAP) {
         std::shared_ptr<ConfigItemMap> map = static_pointer_cast<ConfigItemMap>(value);
         if(map->getValue().contains("command")) {
@@ -298,16 +827,27 @@ void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
         final_user = strip(ConfigFileParser::getMapValue(map, "user"));
         if(final_user.empty())
           final_user = user;
+        if(dest.starts_with("~"))
+          dest = std::regex_replace(dest, std::regex("^~"), "/home/" + final_user);
+
+        if(std::filesystem::is_directory(orig)) {
+          upload_directory(map, orig, dest, final_user);
+          continue;
+        }
+
+        std::string md5_error = ConfigFileParser::getMapValue(map, "md5_error");
+        if(!md5_error.empty()) {
+          save_log(map, md5_error, 1);
+          continue;
+        }
         std::string md5 = strip(ConfigFileParser::getMapValue(map, "md5"));
         if(md5.empty())
           throw(SimpleException("SCP Error: md5 tag is missing."));
 
-        if(dest.starts_with("~"))
-          dest = std::regex_replace(dest, std::regex("^~"), "/home/" + final_user);
-
         std::filesystem::path orig_path(orig);
         std::filesystem::path orig_filename = orig_path.filename();
         std::string dest_path = dest + "/" + orig_filename.string();
+        std::string cache_path = cache_folder + "/" + md5;
 
         std::cout << user << "@" << host << " scp file " << dest_path  << std::endl;
 
@@ -315,20 +855,93 @@ void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
         std::string log;
         std::shared_ptr<char*> output;
         bool file_on_remote_host = false;
+        bool delta = !strip(ConfigFileParser::getMapValue(map, "delta")).empty();
+        uintmax_t dest_size = 0;
+        bool dest_exists = false;
+        // Size and mtime of dest_path are checked first. md5sum is only run 
+        // if they are not the ones saved after the last upload.
+        std::string known_stat = "-";
+        RemoteFileState state;
+        bool known;
+        std::tie(known, state) = mThreadSharedData->getRemoteFileState(user + "@" + host, dest_path);
+        if(known && state.md5 == md5 && !mThreadSharedData->paranoid)
+          known_stat = std::to_string(state.size) + " " + state.mtime;
+        std::string command = RemoteCommands::statMd5(dest_path, known_stat);
         if(final_user == user)
-          std::tie(rc, output, log) = ssh->exec_get_output("md5sum -b '" + dest_path + "' | awk '{print $1}'");
+          std::tie(rc, output, log) = ssh->exec_get_output(command);
         else
-          std::tie(rc, output, log) = ssh->exec_sudo_get_output("md5sum -b '" + dest_path + "' | awk '{print $1}'");
+          std::tie(rc, output, log) = ssh->exec_sudo_get_output(command);
         if(rc != -1) { // If rc == -1, user is not a sudoer. md5sum command fails.
 
           if(rc == 0) {
             // The file "dest" exists on host.
-            std::string md5_host(*output);
-            if(md5 == strip(md5_host)) {
+            std::stringstream lines(*output);
+            std::string stat_line, md5_host;
+            std::getline(lines, stat_line);
+            std::getline(lines, md5_host);
+            std::stringstream(stat_line) >> dest_size;
+            dest_exists = true;
+            md5_host = strip(md5_host);
+            if(md5_host.empty()) // Size and mtime haven't changed
+              md5_host = md5;
+            else
+              md5_host = md5_host.substr(0, md5_host.find(' '));
+            if(md5 == md5_host) {
               // The file is already on remote host, do nothing
               std::cout << user << "@" << host << " file " + dest_path + " is on remote host." << std::endl;
               save_log(map, log, rc);
+              save_remote_file_state(stat_line, dest_path, md5);
+              file_on_remote_host = true;
+            }
+          }
+          if(! file_on_remote_host && mThreadSharedData->use_cache) {
+            // Look for the file in the remote cache. The modification time is
+            // updated on hits, so the cache is pruned in LRU order.
+            std::tie(rc, log) = ssh->exec(RemoteCommands::cacheHit(cache_path));
+            if(rc == 0) {
+              std::cout << user << "@" << host << " file " + dest_path + " is in remote cache." << std::endl;
+              std::tie(rc, log) = copy_to_dest(cache_path, dest, dest_path, final_user);
+              if(rc == 0) {
+                save_log(map, log, rc);
+                update_remote_file_state(dest_path, final_user, md5);
+                file_on_remote_host = true;
+                // Cached file is available as seed for other hosts
+                std::shared_ptr<P2PData> seeds;
+                bool ok;
+                std::tie(ok, seeds)  = mThreadSharedData->getSeeds(md5);
+                P2PSeed seed = std::make_shared<_P2PSeed>();
+                seed->user = user;
+                seed->host = host;
+                seed->password = password;
+                seed->path = cache_path;
+                seed->clock_us = ssh->clock();
+                seeds->addSeed(seed);
+              }
+            }
+          }
+          if(! file_on_remote_host && dest_exists && delta) {
+            // Only the differences with the file on host are sent
+            std::tie(rc, log) = delta_upload(orig, dest_path, dest_size, shared_folder, final_user, md5);
+            if(rc == 0) {
+              std::shared_ptr<P2PData> seeds;
+              bool ok;
+              std::tie(ok, seeds)  = mThreadSharedData->getSeeds(md5);
+              P2PSeed seed = std::make_shared<_P2PSeed>();
+              seed->user = user;
+              seed->host = host;
+              seed->password = password;
+              seed->path = shared_folder + "/" + dest_path;
+              seed->clock_us = ssh->clock();
+              seeds->addSeed(seed);
+              has_seeds = true;
+              add_to_cache(shared_folder + "/" + dest_path, md5);
+              std::tie(rc, log) = copy_to_dest(shared_folder + "/" + dest_path, dest, dest_path, final_user);
+              save_log(map, log, rc);
+              if(rc == 0)
+                update_remote_file_state(dest_path, final_user, md5);
               file_on_remote_host = true;
+            } else {
+              std::cout << user << "@" << host << " delta upload failed: " << log << std::endl;
             }
           }
           if(! file_on_remote_host) {
@@ -347,26 +960,28 @@ void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
               }
               std::cout << user << "@" << host << " uploading file " << orig << " to " << shared_folder + "/" + dest_path << std::endl;
               try {
-                ssh->scp_write(orig, shared_folder + "/" + dest_path);
-                // File uploaded to shared folder. Add as seed
-                P2PSeed seed = std::make_shared<_P2PSeed>();
-                seed->user = user;
-                seed->host = host;
-                seed->password = password;
-                seed->path = shared_folder + "/" + dest_path;
-                seeds->addSeed(seed);
-                // Copy file to destination
-                if(final_user == user) {
-                  std::tie(rc, log) = ssh->exec("mkdir -p \"/" + dest + "\"");
-                  std::tie(rc, log) = ssh->exec("cp "+ shared_folder + "/\"" + dest_path + "\" '"+ dest + "'");
-                  std::tie(rc, log) = ssh->exec("chmod 600 '" + dest_path + "'");
+                std::string local_md5, remote_md5;
+                std::tie(local_md5, remote_md5) = resumable_write(orig, shared_folder + "/" + dest_path, md5, compress_type(map, orig));
+                if(local_md5 != md5 || remote_md5 != md5) {
+                  log = "Error: md5 of sent file (" + local_md5 + ") or received file (" + remote_md5 + ") is not " + md5;
+                  save_log(map, log, 1);
                 } else {
-                  std::tie(rc, log) = ssh->exec_sudo(" -u " + final_user + "mkdir -p \"/" + dest + "\"");
-                  std::tie(rc, log) = ssh->exec_sudo("cp '"+ shared_folder + "/" + dest_path + "' '"+ dest + "'");
-                  std::tie(rc, log) = ssh->exec_sudo("chmod 600 '" + dest_path + "'");
-                  std::tie(rc, log) = ssh->exec_sudo("chown " + final_user + " '" + dest_path + "'");
+                  // File uploaded to shared folder. Add as seed
+                  P2PSeed seed = std::make_shared<_P2PSeed>();
+                  seed->user = user;
+                  seed->host = host;
+                  seed->password = password;
+                  seed->path = shared_folder + "/" + dest_path;
+                  seed->clock_us = ssh->clock();
+                  seeds->addSeed(seed);
+                  has_seeds = true;
+                  add_to_cache(shared_folder + "/" + dest_path, md5);
+                  // Copy file to destination
+                  std::tie(rc, log) = copy_to_dest(shared_folder + "/" + dest_path, dest, dest_path, final_user);
+                  save_log(map, log, rc);
+                  if(rc == 0)
+                    update_remote_file_state(dest_path, final_user, md5);
                 }
-                save_log(map, log, rc);
               } catch (SshException &error) {
                 log = error.what();
                 save_log(map, log, 1);
@@ -379,46 +994,48 @@ void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
                 std::cerr << "seed == null. No seeds available." << std::endl;
                 exit(1);
               }
+              // Simulated hosts: the seed is free when its host has finished with it
+              ssh->waitUntil(seed->clock_us);
               // mkdir shared folder
               std::tie(rc, log) = ssh->exec("mkdir -p \"/" + shared_folder + "/" + dest + "\"");
               // Seed available. Copy from file from seed.
               // Upload askpass.py to run scp
               std::tie(rc, log) = ssh->exec("head -c " + std::to_string(ASKPASS_PY.size()) + " - > " + shared_folder + "/askpass.py", ASKPASS_PY);
               std::string seed_uri = seed->user + "@" + seed->host + ":" + seed->path;
-              std::string command = "python3 " + shared_folder + "/askpass.py"+ " scp '" + seed_uri + "' '" + shared_folder + "/" + dest_path + "'";
-              std::tie(rc, log) = ssh->exec(command, seed->password + "\n");
+              // Relays between hosts are limited with "scp -l" (Kbit/s), the site limit is shared by its relays
+              uintmax_t limit = mThreadSharedData->bandwidth->startRelay(site);
+              std::string limit_option = limit > 0 ? " -l " + std::to_string(std::max((uintmax_t) 1, limit * 8 / 1000)) : "";
+              std::string command = RemoteCommands::relay(shared_folder + "/askpass.py", limit_option, seed_uri, shared_folder + "/" + dest_path);
+              try {
+                std::tie(rc, log) = ssh->exec(command, seed->password + "\n");
+              } catch(SshException &error) {
+                mThreadSharedData->bandwidth->endRelay(site);
+                throw(error);
+              }
+              mThreadSharedData->bandwidth->endRelay(site);
               if(rc == 0) {
-                // File uploaded. Add seeds
-                P2PSeed nseed = std::make_shared<_P2PSeed>();
-                nseed->user = user;
-                nseed->host = host;
-                nseed->password = password;
-                nseed->path = shared_folder + "/" + dest_path;
-                seeds->addSeed(nseed);
-                seeds->addSeed(seed);
-                // Copy file to destination
-                if(final_user == user) {
-                  std::tie(rc, log) = ssh->exec("mkdir -p \"/" + dest + "\"");
-                  std::tie(rc, log) = ssh->exec("cp "+ shared_folder + "/\"" + dest_path + "\" '"+ dest + "'");
-                  std::tie(rc, log) = ssh->exec("chmod 600 '" + dest_path + "'");
-                } else {
-                  std::tie(rc, log) = ssh->exec_sudo(" -u " + final_user + "mkdir -p \"/" + dest + "\"");
-                  std::tie(rc, log) = ssh->exec_sudo("cp '"+ shared_folder + "/" + dest_path + "' '"+ dest + "'");
-                  std::tie(rc, log) = ssh->exec_sudo("chmod 600 '" + dest_path + "'");
-                  std::tie(rc, log) = ssh->exec_sudo("chown " + final_user + " '" + dest_path + "'");
+                // Copy file to destination. md5 is checked while the file is copied.
+                std::tie(rc, log) = copy_to_dest(shared_folder + "/" + dest_path, dest, dest_path, final_user, md5);
+                if(rc == 0) {
+                  // File uploaded. Add seeds
+                  P2PSeed nseed = std::make_shared<_P2PSeed>();
+                  nseed->user = user;
+                  nseed->host = host;
+                  nseed->password = password;
+                  nseed->path = shared_folder + "/" + dest_path;
+                  nseed->clock_us = ssh->clock();
+                  seeds->addSeed(nseed);
+                  has_seeds = true;
                 }
-              } else {
-                seeds->addSeed(seed); 
               }
-              if(final_user == user)
-                std::tie(rc, output, log) = ssh->exec_get_output("md5sum -b '" + dest_path + "' | awk '{print $1}'");
-              else
-                std::tie(rc, output, log) = ssh->exec_sudo_get_output("md5sum -b '" + dest_path + "' | awk '{print $1}'");
-              std::string md5_host(*output);
-              if(md5 == strip(md5_host))
+              seed->clock_us = ssh->clock();
+              seeds->addSeed(seed); 
+              if(rc == 0) {
+                add_to_cache(shared_folder + "/" + dest_path, md5);
+                update_remote_file_state(dest_path, final_user, md5);
                 save_log(map, log, 0);
-              else
-                save_log(map, std::string("Error."), 1);
+              } else
+                save_log(map, log.empty() ? std::string("Error.") : log, 1);
             }
           }
         } else { // User is not a sudoer
@@ -438,34 +1055,107 @@ void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
         if(orig.starts_with("~"))
           orig = std::regex_replace(orig, std::regex("^~"), std::string("/home/") + user);
 
-        bool download_ok = false;
+        // Remote files are sent as a tar stream and extracted to dest/user@host while they are received
         int rc;
         std::string log;
-        std::string command = "mkdir -p '" + dest + "'";
-        rc = system(command.c_str());
-        if(rc == 0) {
-          std::tie(rc, log) = ssh->exec("mkdir -p '" + shared_folder + "/" + orig + "'");
-          if(rc == 0) {
-            std::tie(rc, log) = ssh->exec_sudo("cp -Rf '" + orig + "' '" + shared_folder + "/" + orig + "'");
+        std::string dest_path = dest + "/" + user + "@" + host;
+        std::error_code error;
+        std::filesystem::create_directories(dest_path, error);
+        if(error) {
+          rc = 1;
+          log = "Download failed: " + dest_path + " cannot be made.";
+        } else {
+          std::filesystem::path orig_path(orig);
+          CompressType compress = compress_type(map, "");
+          // Big files are sent in ranges at the same time
+          int streams = 4;
+          std::string streams_value = strip(ConfigFileParser::getMapValue(map, "streams"));
+          if(!streams_value.empty()) {
+            std::stringstream buff(streams_value);
+            buff >> streams;
+            streams = std::max(1, std::min(streams, 32));
+          }
+          // Size is only asked for files which can be big: a saved state says so
+          // or streams is set in the step. Else no round trip is added.
+          uintmax_t size = 0;
+          RemoteFileState state;
+          bool known;
+          std::tie(known, state) = mThreadSharedData->getRemoteFileState(user + "@" + host, orig);
+          bool probe = (known && state.size >= RANGE_DOWNLOAD_SIZE) || !streams_value.empty();
+          if(streams > 1 && probe) {
+            std::shared_ptr<char*> output;
+            std::tie(rc, output, log) = ssh->exec_sudo_get_output(RemoteCommands::fileSize(orig));
             if(rc == 0) {
-              std::tie(rc, log) = ssh->exec_sudo("chown -R " + user + " '" + shared_folder + "/" + orig + "'");
-              if(rc == 0) {
-                std::string orig_path = user + "@" + host + ":" + shared_folder + "/" + orig;
-                std::string dest_path = dest + "/" + user + "@" + host;
-                std::string command = "scp -r '" + orig_path + "' '" + dest_path + "'";
-                std::cout << command << std::endl;
-                rc = system(command.c_str());
-                download_ok = rc == 0;
+              std::stringstream buff(*output);
+              buff >> size;
+            }
+          }
+          if(size >= RANGE_DOWNLOAD_SIZE) {
+            std::tie(rc, log) = download_ranges(orig, dest_path, size, streams, compress);
+            save_log(map, log, rc);
+            continue;
+          }
+          // Files of a folder can be sent in several tar streams at the same time
+          int parallel = 1;
+          std::string parallel_value = strip(ConfigFileParser::getMapValue(map, "parallel"));
+          if(!parallel_value.empty()) {
+            std::stringstream buff(parallel_value);
+            buff >> parallel;
+            parallel = std::max(1, std::min(parallel, 32));
+          }
+          std::vector<std::string> commands;
+          std::vector<std::unique_ptr<TarReader>> tars;
+          std::vector<std::unique_ptr<Decompressor>> decompressors;
+          std::vector<SshDataSink> sinks;
+          // Folders are extracted with their name, dest/user@host/folder, as scp -r did
+          if(!orig_path.has_filename())
+            orig_path = orig_path.parent_path();
+          std::string parent = orig_path.has_parent_path() ? orig_path.parent_path().string() : ".";
+          std::string name = orig_path.filename().string();
+          for(int i = 1; i <= parallel; i++) {
+            std::string command = parallel == 1 ? std::string("tar -C '" + parent + "' -cf - '" + name + "'") 
+              : "cd '" + parent + "' && find '" + name + "' -print0 | split -t '\\0' -n r/" + std::to_string(i) + "/" + std::to_string(parallel) 
+                + " | tar --null --no-recursion -T - -cf -";
+            command = "set -o pipefail; " + command;
+            if(compress == COMPRESS_ZSTD)
+              command += " | zstd -q -c -T0";
+            else if(compress == COMPRESS_LZ4)
+              command += " | lz4 -q -c";
+            commands.push_back("bash -c \"" + command + "\"");
+            tars.push_back(std::make_unique<TarReader>(dest_path));
+            TarReader *tar = tars.back().get();
+            sinks.push_back([tar](const char *buffer, size_t size) {
+              tar->write(buffer, size);
+              return true;
+            });
+          }
+          try {
+            if(compress != COMPRESS_NONE) {
+              // Every stream is decompressed in its own thread
+              for(size_t i = 0; i < sinks.size(); i++) {
+                decompressors.push_back(std::make_unique<Decompressor>(compress, sinks[i]));
+                Decompressor *decompressor = decompressors.back().get();
+                sinks[i] = [decompressor](const char *buffer, size_t size) {
+                  return decompressor->write(buffer, size);
+                };
               }
             }
-            std::tie(rc, log) = ssh->exec("rm -Rf '" + shared_folder + "/" + orig + "'");
+            std::tie(rc, log) = ssh->exec_read(commands, sinks, true);
+            for(auto& decompressor : decompressors)
+              decompressor->finish();
+            if(rc == 0) {
+              for(auto& tar : tars)
+                tar->finish();
+            }
+          } catch(SshException &error) {
+            rc = 1;
+            log = error.what();
+          } catch(SimpleException &error) {
+            rc = 1;
+            log = error.what();
           }
-        }
-        if(download_ok) {
-          rc = 0;
-        } else {
-          rc = 1;
-          log = "Download failed";
+          if(rc != 0)
+            log = "Download failed: " + log;
         }
         save_log(map, log, rc);
       } else if(tag == "monitor" && value->getType() == ConfigItemType::MAP) {
@@ -500,17 +1190,24 @@ void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
           }
         }
 
-        sem_t *sem = mThreadSharedData->getSemaphore(reinterpret_cast<intptr_t>(map.get()), nThreads);
+        intptr_t monitor = reinterpret_cast<intptr_t>(map.get());
+        sem_t *sem = mThreadSharedData->getSemaphore(monitor, nThreads);
+        // Simulated hosts: the clock of the host which releases the lock is passed to the next one
+        auto release = [this, sem, monitor]() {
+          mThreadSharedData->setMonitorClock(monitor, ssh->clock());
+          sem_post(sem);
+        };
+        std::string waiters = "ssh_helper_monitor_waiters{monitor=\"" + Metrics::label(step_name.empty() ? "monitor" : step_name) + "\"}";
         if(sem_trywait(sem) == 0) {
           // The thread is the monitor.
           // Run lock scripts
           try {
           run(scripts_lock_ptr);
           } catch(SimpleException &error) {
-            sem_post(sem);
+            release();
             throw(error);
           }
-          sem_post(sem);
+          release();
           // Run no lock scripts
           if(scripts_ptr != nullptr)
             run(scripts_ptr);
@@ -519,15 +1216,23 @@ void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
           // Run no lock scripts
           if(scripts_ptr != nullptr)
             run(scripts_ptr);
-          if(sem_wait(sem) == 0) {
+          Metrics::add(waiters, 1);
+          int rc;
+          {
+            TRACE_ZONE("monitor wait", "script", step_name);
+            rc = sem_wait(sem);
+          }
+          Metrics::add(waiters, -1);
+          if(rc == 0) {
+            ssh->waitUntil(mThreadSharedData->getMonitorClock(monitor));
             // Run lock scripts
             try {
               run(scripts_lock_ptr);
             } catch(SimpleException &error) {
-              sem_post(sem);
+              release();
               throw(error);
             }
-            sem_post(sem);
+            release();
           } else {
             throw(SimpleException("Monitor Error: Semaphore is in wrong state."));
           }
@@ -535,37 +1240,50 @@ void ClientThread::run(std::shared_ptr<ConfigItemVector> scripts)
 
       }
     }
+    // Temp folders are cleaned as soon as scripts finish. Shared folder is kept 
+    // if its files are seeds of other hosts, it is removed at the end.
+    if(top_level && mThreadSharedData->cleanup == CleanupMode::ASYNC) {
+      try {
+        clean_temp(has_seeds);
+        cleaned = !has_seeds;
+      } catch(SshException &error) {
+        std::cerr << user << "@" << host << " temp folders cannot be cleaned: " << error.what() << std::endl;
+      }
+    }
   }
 }
 
-
-void ClientThread::clean_temp()
+void ClientThread::clean_temp(bool keep_session)
 {
+  TimelineSpan span("cleanup", "setup");
   if(is_connected) {
-    std::string shared_folder = "~/.local/share/ssh_helper_temp/" + mThreadSharedData->id_session;
+    // Folders of sessions older than 5 days are removed
+    std::string temp_folder = "~/.local/share/ssh_helper_temp";
+    // Partial uploads are kept for the next runs, also with --no-cache, until they are old
+    std::string command;
+    if(!cache_folder.empty())
+      command = "find '" + cache_folder + "/partial' -type f -mtime +" + std::to_string(PARTIAL_MAX_DAYS) + " -delete 2>/dev/null; ";
+    command += "cd " + temp_folder + " 2>/dev/null || exit 0; ";
+    if(!keep_session)
+      command += "rm -Rf '" + mThreadSharedData->id_session + "'; ";
+    command += "find . -mindepth 1 -maxdepth 1 -type d ! -name '" + mThreadSharedData->id_session + "' -mtime +5 -exec rm -Rf {} +; true";
     int rc;
     std::string log;
-    std::shared_ptr<char*> output;
-    std::tie(rc, log) = ssh->exec("rm -Rf " + shared_folder); 
-    // Clean old temp folders
-    std::tie(rc, output, log) = ssh->exec_get_output("ls ~/.local/share/ssh_helper_temp");
-    std::stringstream buffer(*output);
-    std::string path;
-    time_t now = time(NULL);
-    while(std::getline(buffer, path)) {
-      struct tm t;
-      localtime_r(&now, &t);
-      char *ok = strptime(path.substr(0, 10).c_str(), "%Y-%m-%d", &t);
-      if(ok != NULL) {
-        time_t tp = mktime(&t);
-        double diff = difftime(now, tp);
-        std::cout << path << " " << path.substr(0, 10).c_str() << " tp=" << tp << " now=" << now << " diff=" << diff << " > " << 3600*24*5 << std::endl;
-        if(diff > 3600 * 24 * 5) {
-          // 5 days old folders will be erased
-          std::tie(rc, output, log) = ssh->exec_get_output("rm -Rf ~/.local/share/ssh_helper_temp/" + path);
-        }
-      }
-    }
+    std::tie(rc, log) = ssh->exec(command);
   }
 }
 
+void *ClientThread::start_clean_temp(void *data)
+{
+  try {
+    ClientThread *client = (ClientThread *)data;
+    Timeline::setTrack(client->user + "@" + client->host);
+    client->clean_temp();
+  } catch(SshException &error) {
+    std::cerr << error.what() << std::endl;
+  } catch(SimpleException &error) {
+    std::cerr << error.what() << std::endl;
+  }
+  return nullptr;
+}
+
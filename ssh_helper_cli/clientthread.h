@@ -25,28 +25,93 @@
 
 class ClientThread {
   public:
-    ClientThread(std::shared_ptr<ThreadSharedData> threadSharedData, std::string host, int port, std::string user, std::string password, std::ostream *log_output);
+    ClientThread(std::shared_ptr<ThreadSharedData> threadSharedData, std::string host, int port, std::string user, std::string password, std::ostream *log_output, std::string site = "");
     ~ClientThread();
 
     bool connect();
+    /** Closes the SSH session. Its counters are recorded in SessionStats.
+     */
+    void disconnect();
     
     void run(std::shared_ptr<ConfigItemVector> scripts = nullptr);
-    void clean_temp();
+    /** Removes shared folder of this session (unless keep_session is true) and 
+     * old temp folders with one command.
+     */
+    void clean_temp(bool keep_session = false);
+    /** True if clean_temp has removed the shared folder.
+     */
+    inline bool isCleaned() {return cleaned;}
 
     pthread_t *getThread();
     
     static void *start(void *data);
+    static void *start_clean_temp(void *data);
   private:
     std::shared_ptr<ThreadSharedData> mThreadSharedData;
     std::string host, user, password;
+    // Hosts of a site share its bandwidth limit
+    std::string site;
     int port;
-    std::shared_ptr<SshPtr> ssh;
+    std::shared_ptr<Executor> ssh;
     bool is_connected;
     pthread_t *thread;
     pthread_mutex_t *mutex;
     std::ostream *log_output;
+    // Remote cache in $HOME of user, it is set by bootstrap
+    std::string cache_folder;
+    // Compressors available on host: -1 not checked yet, else bits 1 zstd, 2 lz4
+    int remote_compressors;
+    // Files of shared folder are seeds of other hosts
+    bool has_seeds;
+    bool cleaned;
+    // A step has failed (save_log with rc != 0)
+    bool step_failed;
 
     void save_log(std::shared_ptr<ConfigItemMap> map, std::string log, const int &rc);
+    /** Makes shared_folder and adds manager public key to authorized_keys 
+     * with a single command. Throws SimpleException on errors.
+     */
+    void bootstrap(std::string shared_folder);
+    /** Opens a new session after a connection error.
+     */
+    bool reconnect();
+    /** Sends orig to dest with Executor::stream_write. Big files are resumed from 
+     * partial uploads with the same md5, and failed transfers are retried.
+     */
+    std::tuple<std::string /*local md5*/, std::string /*remote md5*/> 
+      resumable_write(std::string orig, std::string dest, std::string md5, CompressType compress);
+    /** Copies src to dest_path (dest is the folder) on remote host and sets final_user as owner.
+     * If md5 is not empty, the copied data is checked against it.
+     */
+    std::tuple<int /*status*/, std::string /*log*/> 
+      copy_to_dest(std::string src, std::string dest, std::string dest_path, std::string final_user, std::string md5 = "");
+    /** Adds remote file path to remote cache using md5 as key. 
+     * The cache is pruned to ThreadSharedData::cache_size.
+     */
+    void add_to_cache(std::string path, std::string md5);
+    /** Uploads a folder. Only new or changed files (by md5) are sent, as a tar stream.
+     * With "delete" tag, files removed from orig are deleted on host.
+     */
+    void upload_directory(std::shared_ptr<ConfigItemMap> map, std::string orig, std::string dest, std::string final_user);
+    /** Builds shared_folder/dest_path on host from dest_path and the differences with orig. 
+     * The rebuilt file is checked against md5.
+     */
+    std::tuple<int /*status*/, std::string /*log*/> 
+      delta_upload(std::string orig, std::string dest_path, uintmax_t dest_size, std::string shared_folder, std::string final_user, std::string md5);
+    /** Saves size and mtime ("size mtime" in stat_line) of remote path in ThreadSharedData.
+     */
+    void save_remote_file_state(std::string stat_line, std::string path, std::string md5);
+    /** Reads size and mtime of remote path and saves them in ThreadSharedData.
+     */
+    void update_remote_file_state(std::string path, std::string final_user, std::string md5);
+    /** Downloads orig (a regular file of size bytes) to dest_folder in ranges sent 
+     * at the same time over streams channels. The file is checked with md5 at the end.
+     */
+    std::tuple<int /*status*/, std::string /*log*/> 
+      download_ranges(std::string orig, std::string dest_folder, uintmax_t size, int streams, CompressType compress);
+    /** Compression to use for "compress" tag of map. sample_path is used by "auto".
+     */
+    CompressType compress_type(std::shared_ptr<ConfigItemMap> map, std::string sample_path);
 };
 
 #endif
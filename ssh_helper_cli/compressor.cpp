@@ -0,0 +1,317 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "compressor.h"
+#include "simpleexception.h"
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <cstdlib>
+
+// Sample size used by "compress: auto"
+static const size_t SAMPLE_SIZE = 1024 * 1024;
+// Data with more entropy (bits per byte) is taken as already compressed
+static const double MAX_ENTROPY = 7.5;
+
+// Starts a compressor (or decompressor) process connected to in_fd (stdin) 
+// and out_fd (stdout). Returns -1 on error.
+static pid_t start_process(CompressType type, bool decompress, int &in_fd, int &out_fd)
+{
+  int in_pipe[2], out_pipe[2];
+  // O_CLOEXEC: pipes must not be inherited by compressors of other threads
+  if(pipe2(in_pipe, O_CLOEXEC) != 0)
+    return -1;
+  if(pipe2(out_pipe, O_CLOEXEC) != 0) {
+    close(in_pipe[0]);
+    close(in_pipe[1]);
+    return -1;
+  }
+  pid_t pid = fork();
+  if(pid == 0) {
+    dup2(in_pipe[0], 0);
+    dup2(out_pipe[1], 1);
+    // Sockets and files of other hosts (libssh, logs) are not O_CLOEXEC. A
+    // compressor keeping them open would stop other pipes from reaching EOF.
+    if(close_range(3, ~0U, 0) != 0) {
+      long max_fd = sysconf(_SC_OPEN_MAX);
+      for(long fd = 3; fd < max_fd; fd++)
+        close(fd);
+    }
+    if(type == COMPRESS_LZ4)
+      execlp("lz4", "lz4", decompress ? "-d" : "-q", "-q", "-c", (char *) NULL);
+    else
+      execlp("zstd", "zstd", decompress ? "-d" : "-T0", "-q", "-c", (char *) NULL);
+    _exit(127);
+  }
+  close(in_pipe[0]);
+  close(out_pipe[1]);
+  in_fd = in_pipe[1];
+  out_fd = out_pipe[0];
+  if(pid < 0) {
+    close(in_fd);
+    close(out_fd);
+  }
+  return pid;
+}
+
+Compressor::Compressor(CompressType type, SshDataSource source)
+{
+  this->source = source;
+  thread_running = false;
+  pid = start_process(type, false, in_fd, out_fd);
+  if(pid < 0)
+    throw(SimpleException("[Compressor] Process cannot be started."));
+  if(pthread_create(&thread, NULL, &Compressor::writeThread, this) != 0) {
+    close(in_fd);
+    close(out_fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    throw(SimpleException("[Compressor] Thread cannot be started."));
+  }
+  thread_running = true;
+}
+
+Compressor::~Compressor()
+{
+  close(out_fd);
+  if(thread_running)
+    pthread_join(thread, NULL);
+  if(pid > 0)
+    waitpid(pid, NULL, 0);
+}
+
+void *Compressor::writeThread(void *data)
+{
+  Compressor *compressor = (Compressor *) data;
+  std::unique_ptr<char[]> buffer(new char[64 * 1024]);
+  try {
+    size_t nbytes;
+    while((nbytes = compressor->source(buffer.get(), 64 * 1024)) > 0) {
+      size_t done = 0;
+      while(done < nbytes) {
+        ssize_t n = write(compressor->in_fd, buffer.get() + done, nbytes - done);
+        if(n <= 0) {
+          compressor->error = "[Compressor] Data cannot be written to compressor.";
+          close(compressor->in_fd);
+          return nullptr;
+        }
+        done += n;
+      }
+    }
+  } catch(SimpleException &error) {
+    compressor->error = error.what();
+  }
+  close(compressor->in_fd);
+  return nullptr;
+}
+
+size_t Compressor::read(char *buffer, size_t size)
+{
+  size_t done = 0;
+  while(done < size) {
+    ssize_t n = ::read(out_fd, buffer + done, size - done);
+    if(n < 0)
+      throw(SimpleException("[Compressor] Compressed data cannot be read."));
+    if(n == 0)
+      break;
+    done += n;
+  }
+  if(done == 0) {
+    // End of data. Check errors.
+    if(thread_running) {
+      pthread_join(thread, NULL);
+      thread_running = false;
+    }
+    if(!error.empty())
+      throw(SimpleException(error));
+    int status = 0;
+    if(waitpid(pid, &status, 0) == pid) {
+      pid = -1;
+      if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw(SimpleException("[Compressor] Compressor process failed."));
+    }
+  }
+  return done;
+}
+
+Decompressor::Decompressor(CompressType type, SshDataSink sink)
+{
+  this->sink = sink;
+  thread_running = false;
+  pid = start_process(type, true, in_fd, out_fd);
+  if(pid < 0)
+    throw(SimpleException("[Decompressor] Process cannot be started."));
+  if(pthread_create(&thread, NULL, &Decompressor::readThread, this) != 0) {
+    close(in_fd);
+    close(out_fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    throw(SimpleException("[Decompressor] Thread cannot be started."));
+  }
+  thread_running = true;
+}
+
+Decompressor::~Decompressor()
+{
+  if(in_fd >= 0)
+    close(in_fd);
+  if(thread_running)
+    pthread_join(thread, NULL);
+  if(pid > 0)
+    waitpid(pid, NULL, 0);
+}
+
+void *Decompressor::readThread(void *data)
+{
+  Decompressor *decompressor = (Decompressor *) data;
+  std::unique_ptr<char[]> buffer(new char[64 * 1024]);
+  ssize_t nbytes;
+  try {
+    while((nbytes = read(decompressor->out_fd, buffer.get(), 64 * 1024)) > 0) {
+      if(!decompressor->sink(buffer.get(), nbytes)) {
+        decompressor->error = "[Decompressor] Data cannot be saved.";
+        break;
+      }
+    }
+    if(nbytes < 0)
+      decompressor->error = "[Decompressor] Decompressed data cannot be read.";
+  } catch(SimpleException &error) {
+    decompressor->error = error.what();
+  }
+  // Closing stdout stops the process if data is not read any more
+  close(decompressor->out_fd);
+  return nullptr;
+}
+
+bool Decompressor::write(const char *buffer, size_t size)
+{
+  size_t done = 0;
+  while(done < size) {
+    ssize_t n = ::write(in_fd, buffer + done, size - done);
+    if(n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+void Decompressor::finish()
+{
+  close(in_fd);
+  in_fd = -1;
+  if(thread_running) {
+    pthread_join(thread, NULL);
+    thread_running = false;
+  }
+  int status = 0;
+  if(pid > 0 && waitpid(pid, &status, 0) == pid) {
+    pid = -1;
+    if(error.empty() && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+      error = "[Decompressor] Decompressor process failed.";
+  }
+  if(!error.empty())
+    throw(SimpleException(error));
+}
+
+static double entropy(const std::string &path)
+{
+  FILE *in = fopen(path.c_str(), "r");
+  if(in == nullptr)
+    return 8.0;
+  std::unique_ptr<unsigned char[]> buffer(new unsigned char[SAMPLE_SIZE]);
+  size_t nbytes = fread(buffer.get(), 1, SAMPLE_SIZE, in);
+  fclose(in);
+  if(nbytes == 0)
+    return 8.0;
+  size_t count[256] = {0};
+  for(size_t i = 0; i < nbytes; i++)
+    count[buffer[i]]++;
+  double bits = 0;
+  for(size_t c : count) {
+    if(c > 0) {
+      double p = (double) c / nbytes;
+      bits -= p * std::log2(p);
+    }
+  }
+  return bits;
+}
+
+CompressType Compressor::choose(std::string value, std::string sample_path, bool zstd, bool lz4)
+{
+  if(value == "zstd" && zstd)
+    return COMPRESS_ZSTD;
+  if(value == "lz4" && lz4)
+    return COMPRESS_LZ4;
+  if(value == "auto" && (zstd || lz4)) {
+    if(!sample_path.empty() && entropy(sample_path) > MAX_ENTROPY)
+      return COMPRESS_NONE;
+    return zstd ? COMPRESS_ZSTD : COMPRESS_LZ4;
+  }
+  return COMPRESS_NONE;
+}
+
+// True if name is an executable file of a folder of PATH, as execlp finds it
+static bool in_path(const std::string &name)
+{
+  const char *path = getenv("PATH");
+  std::string folders = path != nullptr ? path : "/usr/bin:/bin";
+  std::string::size_type start = 0;
+  while(start <= folders.size()) {
+    std::string::size_type end = folders.find(':', start);
+    if(end == std::string::npos)
+      end = folders.size();
+    std::string folder = folders.substr(start, end - start);
+    if(folder.empty())
+      folder = ".";
+    if(access((folder + "/" + name).c_str(), X_OK) == 0)
+      return true;
+    start = end + 1;
+  }
+  return false;
+}
+
+bool Compressor::isLocal(CompressType type)
+{
+  static const bool zstd = in_path("zstd");
+  static const bool lz4 = in_path("lz4");
+  switch(type) {
+    case COMPRESS_ZSTD:
+      return zstd;
+    case COMPRESS_LZ4:
+      return lz4;
+    case COMPRESS_NONE:
+      break;
+  }
+  return true;
+}
+
+std::string Compressor::decompressCommand(CompressType type)
+{
+  switch(type) {
+    case COMPRESS_ZSTD:
+      return "zstd -d -q -c";
+    case COMPRESS_LZ4:
+      return "lz4 -d -q -c";
+    case COMPRESS_NONE:
+      break;
+  }
+  return "cat";
+}
@@ -0,0 +1,104 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __COMPRESSOR_H__
+#define __COMPRESSOR_H__
+
+#include "sshptr.h"
+#include <pthread.h>
+#include <string>
+
+/** Compresses data of a SshDataSource with a local "zstd -T0" (multi-threaded)
+ * or "lz4" process. The source is read in a thread and written to the stdin of
+ * the process, compressed data is got with read().
+ *
+ *  Compressor compressor(COMPRESS_ZSTD, source);
+ *  SshDataSource compressed = [&compressor](char *buffer, size_t size) {
+ *    return compressor.read(buffer, size);
+ *  };
+ */
+class Compressor
+{
+  public:
+    Compressor(CompressType type, SshDataSource source);
+    ~Compressor();
+
+    /** Reads compressed data. Returns 0 at the end. 
+     * Throws SimpleException if the source or the process fails.
+     */
+    size_t read(char *buffer, size_t size);
+
+    /** Parses the "compress" tag: zstd, lz4, none or auto.
+     * auto samples the first MB of sample_path and uses zstd (or lz4 if only lz4 
+     * is available) if data seems compressible. 
+     * zstd and lz4 tell if the tool is available on both hosts, local and remote.
+     * Types not available are not used.
+     */
+    static CompressType choose(std::string value, std::string sample_path, bool zstd, bool lz4);
+    /** True if the tool of type is in the local PATH. It is looked up once.
+     */
+    static bool isLocal(CompressType type);
+    /** Remote command that decompresses stdin to stdout.
+     */
+    static std::string decompressCommand(CompressType type);
+
+  private:
+    SshDataSource source;
+    pid_t pid;
+    int in_fd, out_fd;
+    pthread_t thread;
+    bool thread_running;
+    std::string error;
+
+    static void *writeThread(void *data);
+};
+
+/** Decompresses data with a local "zstd -d" or "lz4 -d" process. Data is 
+ * given with write() and decompressed data is sent to sink from a thread.
+ *
+ *  Decompressor decompressor(COMPRESS_ZSTD, sink);
+ *  ssh->exec_read(command, [&decompressor](const char *buffer, size_t size) {
+ *    return decompressor.write(buffer, size);
+ *  });
+ *  decompressor.finish();
+ */
+class Decompressor
+{
+  public:
+    Decompressor(CompressType type, SshDataSink sink);
+    ~Decompressor();
+
+    /** Writes compressed data. Returns false if the process has been finished.
+     */
+    bool write(const char *buffer, size_t size);
+    /** Ends data and waits for sink. Throws SimpleException if the sink 
+     * or the process fails.
+     */
+    void finish();
+
+  private:
+    SshDataSink sink;
+    pid_t pid;
+    int in_fd, out_fd;
+    pthread_t thread;
+    bool thread_running;
+    std::string error;
+
+    static void *readThread(void *data);
+};
+
+#endif
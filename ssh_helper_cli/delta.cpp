@@ -0,0 +1,273 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "delta.h"
+#include "hash.h"
+#include "simpleexception.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <unordered_map>
+#include <algorithm>
+
+const std::string DELTA_PY = R"(#!/usr/bin/env python3
+
+import hashlib
+import struct
+import sys
+import zlib
+
+# Copies from the basis file are read in chunks of this size
+COPY_CHUNK = 8 * 1024 * 1024
+
+def read_exact(f, n):
+    data = f.read(n)
+    while len(data) < n:
+        more = f.read(n - len(data))
+        if not more:
+            raise EOFError('Truncated delta')
+        data += more
+    return data
+
+def signature(path, block_size):
+    out = sys.stdout
+    with open(path, 'rb') as f:
+        while True:
+            block = f.read(block_size)
+            if len(block) < block_size:
+                break
+            out.write('%08x %s\n' % (zlib.adler32(block), hashlib.md5(block).hexdigest()))
+
+def patch(basis_path, out_path, block_size):
+    md5 = hashlib.md5()
+    delta = sys.stdin.buffer
+    with open(basis_path, 'rb') as basis, open(out_path, 'wb') as out:
+        while True:
+            op = delta.read(1)
+            if op == b'C':
+                first, count = struct.unpack('>QI', read_exact(delta, 12))
+                basis.seek(first * block_size)
+                remaining = count * block_size
+                while remaining > 0:
+                    data = read_exact(basis, min(remaining, COPY_CHUNK))
+                    out.write(data)
+                    md5.update(data)
+                    remaining -= len(data)
+                continue
+            elif op == b'L':
+                (length,) = struct.unpack('>I', read_exact(delta, 4))
+                data = read_exact(delta, length)
+            elif op == b'E':
+                break
+            else:
+                raise ValueError('Wrong delta')
+            out.write(data)
+            md5.update(data)
+    print(md5.hexdigest())
+
+if __name__ == '__main__':
+    if sys.argv[1] == 'signature':
+        signature(sys.argv[2], int(sys.argv[3]))
+    elif sys.argv[1] == 'patch':
+        patch(sys.argv[2], sys.argv[3], int(sys.argv[4]))
+    else:
+        exit(2)
+)";
+
+// Largest literal run written in one 'L' entry
+static const uint32_t MAX_LITERAL = 1024 * 1024;
+// Largest run of blocks (in bytes) written in one 'C' entry
+static const uintmax_t MAX_COPY = 8 * 1024 * 1024;
+static const uint32_t ADLER_MOD = 65521;
+
+size_t Delta::blockSize(uintmax_t file_size)
+{
+  // Like rsync: about sqrt(size), multiple of 1024 and in [4 KB, 1 MB]
+  size_t size = ((size_t) std::sqrt((double) file_size)) & ~((size_t) 1023);
+  if(size < 4096)
+    size = 4096;
+  if(size > 1024 * 1024)
+    size = 1024 * 1024;
+  return size;
+}
+
+std::vector<DeltaBlock> Delta::parseSignatures(const std::string &signatures)
+{
+  std::vector<DeltaBlock> blocks;
+  std::stringstream lines(signatures);
+  std::string weak, strong;
+  while(lines >> weak >> strong) {
+    DeltaBlock block;
+    block.weak = std::stoul(weak, nullptr, 16);
+    block.strong = strong;
+    blocks.push_back(block);
+  }
+  return blocks;
+}
+
+static void write_be(FILE *out, uint64_t value, int bytes)
+{
+  for(int i = bytes - 1; i >= 0; i--)
+    fputc((value >> (i * 8)) & 0xff, out);
+}
+
+static void write_literal(FILE *out, const unsigned char *data, uintmax_t size)
+{
+  while(size > 0) {
+    uint32_t n = size > MAX_LITERAL ? MAX_LITERAL : size;
+    fputc('L', out);
+    write_be(out, n, 4);
+    fwrite(data, 1, n, out);
+    data += n;
+    size -= n;
+  }
+}
+
+static void write_copy(FILE *out, uint64_t first, uint32_t count, size_t block_size)
+{
+  uint32_t max_count = std::max((uintmax_t) 1, MAX_COPY / block_size);
+  while(count > 0) {
+    uint32_t n = count > max_count ? max_count : count;
+    fputc('C', out);
+    write_be(out, first, 8);
+    write_be(out, n, 4);
+    first += n;
+    count -= n;
+  }
+}
+
+// Returns a and b parts of adler32 of data
+static void adler32(const unsigned char *data, size_t size, uint32_t &a, uint32_t &b)
+{
+  a = 1;
+  b = 0;
+  for(size_t i = 0; i < size; i++) {
+    a = (a + data[i]) % ADLER_MOD;
+    b = (b + a) % ADLER_MOD;
+  }
+}
+
+uintmax_t Delta::make(const std::string &filepath, size_t block_size, const std::vector<DeltaBlock> &blocks, const std::string &delta_path)
+{
+  int fd = open(filepath.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw(SimpleException("[Delta::make] File " + filepath + " cannot be opened."));
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    close(fd);
+    throw(SimpleException("[Delta::make] File " + filepath + " cannot be read."));
+  }
+  size_t size = st.st_size;
+  const unsigned char *data = nullptr;
+  if(size > 0) {
+    void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(ptr == MAP_FAILED) {
+      close(fd);
+      throw(SimpleException("[Delta::make] File " + filepath + " cannot be mapped."));
+    }
+    data = (const unsigned char *) ptr;
+    madvise(ptr, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  FILE *out = fopen(delta_path.c_str(), "w");
+  if(out == nullptr) {
+    if(data)
+      munmap((void *) data, size);
+    throw(SimpleException("[Delta::make] File " + delta_path + " cannot be written."));
+  }
+  setvbuf(out, nullptr, _IOFBF, 1024 * 1024);
+
+  std::unordered_map<uint32_t, std::vector<uint64_t> > table;
+  for(uint64_t i = 0; i < blocks.size(); i++)
+    table[blocks[i].weak].push_back(i);
+
+  uintmax_t literal = 0;
+  size_t literal_start = 0, pos = 0;
+  uint64_t copy_first = 0;
+  uint32_t copy_count = 0;
+  uint32_t a = 0, b = 0;
+  bool fresh = true;
+  while(!blocks.empty() && pos + block_size <= size) {
+    if(fresh) {
+      adler32(data + pos, block_size, a, b);
+      fresh = false;
+    }
+    int64_t match = -1;
+    auto it = table.find((b << 16) | a);
+    if(it != table.end()) {
+      Hash md5;
+      md5.update(data + pos, block_size);
+      std::string strong = md5.final();
+      for(uint64_t index : it->second) {
+        if(blocks[index].strong == strong) {
+          match = index;
+          break;
+        }
+      }
+    }
+    if(match >= 0) {
+      if(literal_start < pos) {
+        if(copy_count > 0) {
+          write_copy(out, copy_first, copy_count, block_size);
+          copy_count = 0;
+        }
+        write_literal(out, data + literal_start, pos - literal_start);
+        literal += pos - literal_start;
+      }
+      if(copy_count > 0 && copy_first + copy_count == (uint64_t) match) {
+        copy_count++;
+      } else {
+        if(copy_count > 0)
+          write_copy(out, copy_first, copy_count, block_size);
+        copy_first = match;
+        copy_count = 1;
+      }
+      pos += block_size;
+      literal_start = pos;
+      fresh = true;
+    } else {
+      // Roll the checksum one byte
+      if(pos + block_size < size) {
+        uint32_t out_byte = data[pos], in_byte = data[pos + block_size];
+        a = (a + ADLER_MOD - out_byte + in_byte) % ADLER_MOD;
+        b = (b + ADLER_MOD - (uint32_t)((block_size * out_byte) % ADLER_MOD) + a + ADLER_MOD - 1) % ADLER_MOD;
+      }
+      pos++;
+    }
+  }
+  if(copy_count > 0)
+    write_copy(out, copy_first, copy_count, block_size);
+  if(literal_start < size) {
+    write_literal(out, data + literal_start, size - literal_start);
+    literal += size - literal_start;
+  }
+  fputc('E', out);
+
+  bool error = ferror(out);
+  if(fclose(out) != 0)
+    error = true;
+  if(data)
+    munmap((void *) data, size);
+  if(error)
+    throw(SimpleException("[Delta::make] File " + delta_path + " cannot be written."));
+  return literal;
+}
@@ -0,0 +1,66 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/** Python script run on remote hosts:
+ *   python3 delta.py signature file block_size
+ *     Prints "adler32 md5" of every full block of file.
+ *   python3 delta.py patch basis out block_size
+ *     Builds out from basis and the delta read from stdin. Prints md5 of out.
+ */
+extern const std::string DELTA_PY;
+
+/** Signature of a block of the remote file.
+ */
+struct DeltaBlock
+{
+  uint32_t weak;      // adler32
+  std::string strong; // md5
+};
+
+/** rsync-like delta transfer. The remote host sends the signatures of the blocks
+ * of its copy, the local file is scanned with a rolling checksum and only
+ * the data not found in the remote blocks is sent.
+ *
+ * Delta format: 
+ *   'C' uint64 first_block uint32 count   Copy blocks from basis.
+ *   'L' uint32 length data                Literal data.
+ *   'E'                                   End.
+ * Integers are big endian.
+ */
+class Delta
+{
+  public:
+    /** Block size used for a remote file of file_size bytes.
+     */
+    static size_t blockSize(uintmax_t file_size);
+    /** Parses the output of "delta.py signature".
+     */
+    static std::vector<DeltaBlock> parseSignatures(const std::string &signatures);
+    /** Writes the delta of filepath against blocks to delta_path.
+     * @return number of literal bytes. Throws SimpleException on errors.
+     */
+    static uintmax_t make(const std::string &filepath, size_t block_size, const std::vector<DeltaBlock> &blocks, const std::string &delta_path);
+};
+
+#endif
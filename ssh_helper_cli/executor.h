@@ -0,0 +1,106 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __EXECUTOR_H__
+#define __EXECUTOR_H__
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <exception>
+#include <functional>
+#include <vector>
+#include "bandwidthlimiter.h"
+#include "markerparser.h"
+
+/** Source of data written to stdin of remote commands. Fills buffer and 
+ * returns the number of bytes written to it, 0 at the end of data.
+ */
+typedef std::function<size_t(char *buffer, size_t size)> SshDataSource;
+
+/** Receives data read from stdout of remote commands. 
+ * Returns false to stop reading.
+ */
+typedef std::function<bool(const char *buffer, size_t size)> SshDataSink;
+
+/** Compression of transfers. See Compressor.
+ */
+enum CompressType {
+  COMPRESS_NONE, COMPRESS_ZSTD, COMPRESS_LZ4
+};
+
+/** Runs commands and transfers files on a host. ClientThread only uses this
+ * interface, so hosts can be reached by SshPtr (a real ssh session) or by 
+ * SimExecutor (a simulated host with virtual time).
+ *
+ * Errors of the transport are thrown as SshException.
+ * See SshPtr for the documentation of each method.
+ */
+class Executor {
+  public:
+    virtual ~Executor() {}
+
+    [[nodiscard]] virtual bool connect(std::string user, std::string password, bool public_key = false) = 0;
+    virtual bool isPublicKeyAuth() = 0;
+    [[nodiscard]] virtual std::tuple<int /*status*/, std::string /*log*/> 
+      exec(std::string command) = 0;
+    [[nodiscard]] virtual std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
+      exec_get_output(std::string command) = 0;
+    [[nodiscard]] virtual std::tuple<int /*status*/, std::string /*log*/> 
+      exec(std::string command, std::string stdin_string) = 0;
+    [[nodiscard]] virtual std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
+      exec_get_output(std::string command, std::string stdin_string) = 0;
+    [[nodiscard]] virtual std::tuple<int /*status*/, std::string /*log*/> 
+      exec_sudo(std::string command) = 0;
+    [[nodiscard]] virtual std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
+      exec_sudo_get_output(std::string command) = 0;
+    [[nodiscard]] virtual std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
+      exec_write_get_output(std::string command, SshDataSource source, bool sudo = false) = 0;
+    /** Download: stdout of command is sent to sink.*/
+    [[nodiscard]] virtual std::tuple<int /*status*/, std::string /*log*/> 
+      exec_read(std::string command, SshDataSink sink, bool sudo = false) = 0;
+    [[nodiscard]] virtual std::tuple<int /*status*/, std::string /*log*/> 
+      exec_read(std::vector<std::string> commands, std::vector<SshDataSink> sinks, bool sudo = false) = 0;
+    virtual void scp_write(std::string filepath, std::string dest) = 0;
+    /** Upload of filepath to dest.*/
+    [[nodiscard]] virtual std::tuple<std::string /*local md5*/, std::string /*remote md5*/> 
+      stream_write(std::string filepath, std::string dest, CompressType compress = COMPRESS_NONE, uintmax_t offset = 0, std::string prefix_md5 = "") = 0;
+    /** Writes content to the file dest.*/
+    virtual void ssh_write_to_file(std::string content, std::string dest) = 0;
+    virtual void setBandwidthLimiter(std::shared_ptr<BandwidthLimiter> limiter, std::string site) = 0;
+    virtual void setMarkerHandler(MarkerHandler handler) = 0;
+    /** Waits seconds before a retry. The session may be lost.*/
+    virtual void delay(unsigned seconds) = 0;
+    /** Virtual time of the host in microseconds (SimExecutor), 0 on real hosts.
+     * When a host waits for another one (monitor lock, P2P seed), its clock is 
+     * moved with waitUntil to the clock of the host which released it.
+     */
+    virtual uint64_t clock() = 0;
+    virtual void waitUntil(uint64_t clock_us) = 0;
+};
+
+
+class SshException : public std::exception
+{
+  public:
+    SshException(std::string error);
+    virtual const char *what();
+  private:
+    std::string error;
+};
+
+#endif
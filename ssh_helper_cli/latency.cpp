@@ -0,0 +1,165 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "latency.h"
+#include <pthread.h>
+#include <atomic>
+#include <map>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+
+// Buckets per power of two
+static const int SUB_BUCKET_BITS = 5;
+static const uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+// Slowest hosts shown for every step
+static const size_t SLOWEST_HOSTS = 3;
+
+static size_t bucket_index(uint64_t value)
+{
+  if(value < SUB_BUCKETS)
+    return value;
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - SUB_BUCKET_BITS;
+  return SUB_BUCKETS + shift * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+}
+
+static uint64_t bucket_value(size_t index)
+{
+  if(index < SUB_BUCKETS)
+    return index;
+  int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+  uint64_t sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+  return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+  size_t index = bucket_index(value);
+  if(index >= counts.size())
+    counts.resize(index + 1, 0);
+  counts[index]++;
+  total++;
+  maximum = std::max(maximum, value);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+  if(total == 0)
+    return 0;
+  uint64_t rank = std::max((uint64_t) 1, (uint64_t) (p * total + 0.5));
+  uint64_t seen = 0;
+  for(size_t i = 0; i < counts.size(); i++) {
+    seen += counts[i];
+    if(seen >= rank)
+      return std::min(bucket_value(i), maximum);
+  }
+  return maximum;
+}
+
+struct StepStats {
+  LatencyHistogram histogram;
+  std::map<std::string /*host*/, uint64_t /*max*/> hosts;
+};
+
+static std::atomic<bool> enabled(false);
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, StepStats> steps;
+
+void LatencyStats::enable()
+{
+  enabled = true;
+}
+
+bool LatencyStats::isEnabled()
+{
+  return enabled;
+}
+
+void LatencyStats::record(std::string step, std::string host, uint64_t microseconds)
+{
+  if(!enabled)
+    return;
+  pthread_mutex_lock(&mutex);
+  StepStats &stats = steps[step];
+  stats.histogram.record(microseconds);
+  uint64_t &host_max = stats.hosts[host];
+  host_max = std::max(host_max, microseconds);
+  pthread_mutex_unlock(&mutex);
+}
+
+static std::string slowest_hosts(const StepStats &stats)
+{
+  std::vector<std::pair<uint64_t, std::string> > hosts;
+  for(const auto& [host, max] : stats.hosts)
+    hosts.push_back(std::make_pair(max, host));
+  size_t n = std::min(SLOWEST_HOSTS, hosts.size());
+  std::partial_sort(hosts.begin(), hosts.begin() + n, hosts.end(), std::greater<>());
+  std::stringstream out;
+  out << std::fixed << std::setprecision(1);
+  for(size_t i = 0; i < n; i++)
+    out << (i > 0 ? " " : "") << hosts[i].second << "(" << hosts[i].first / 1000.0 << ")";
+  return out.str();
+}
+
+void LatencyStats::report(std::ostream &out)
+{
+  pthread_mutex_lock(&mutex);
+  if(!steps.empty()) {
+    out << "Latency of steps (ms):" << std::endl;
+    out << std::left << std::setw(32) << "step" << std::right << std::setw(8) << "count" << std::setw(10) << "p50" 
+      << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max" << "  slowest hosts" << std::endl;
+    out << std::fixed << std::setprecision(1);
+    for(const auto& [step, stats] : steps) {
+      const LatencyHistogram &h = stats.histogram;
+      out << std::left << std::setw(32) << step.substr(0, 31) << std::right << std::setw(8) << h.count()
+        << std::setw(10) << h.percentile(0.5) / 1000.0 << std::setw(10) << h.percentile(0.9) / 1000.0
+        << std::setw(10) << h.percentile(0.99) / 1000.0 << std::setw(10) << h.max() / 1000.0
+        << "  " << slowest_hosts(stats) << std::endl;
+    }
+    out << std::defaultfloat;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+// Quotes a CSV field
+static std::string csv(const std::string &value)
+{
+  std::string out = "\"";
+  for(char ch : value)
+    out += ch == '"' ? std::string("\"\"") : std::string(1, ch);
+  return out + "\"";
+}
+
+bool LatencyStats::saveCsv(std::string path)
+{
+  std::ofstream out(path);
+  if(!out.is_open())
+    return false;
+  pthread_mutex_lock(&mutex);
+  out << "step,count,p50_ms,p90_ms,p99_ms,max_ms,slowest_hosts\n";
+  out << std::fixed << std::setprecision(3);
+  for(const auto& [step, stats] : steps) {
+    const LatencyHistogram &h = stats.histogram;
+    out << csv(step) << "," << h.count() << "," << h.percentile(0.5) / 1000.0 << "," << h.percentile(0.9) / 1000.0 
+      << "," << h.percentile(0.99) / 1000.0 << "," << h.max() / 1000.0 << "," << csv(slowest_hosts(stats)) << "\n";
+  }
+  pthread_mutex_unlock(&mutex);
+  out.close();
+  return !out.fail();
+}
@@ -0,0 +1,64 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <ostream>
+
+/** Histogram of latencies (HDR-like): log-linear buckets with 32 buckets 
+ * per power of two, so percentiles have an error below 3%.
+ */
+class LatencyHistogram
+{
+  public:
+    void record(uint64_t value);
+    /** Value (upper bound of its bucket) under which there are p (0..1) of values.
+     */
+    uint64_t percentile(double p) const;
+    inline uint64_t count() const {return total;}
+    inline uint64_t max() const {return maximum;}
+
+  private:
+    std::vector<uint64_t> counts;
+    uint64_t total = 0, maximum = 0;
+};
+
+/** Latencies of every step (scripts, connect, auth, transfers...) on every host.
+ * At the end of a run, a report with p50/p90/p99/max and the slowest hosts of 
+ * every step can be printed. Nothing is recorded until enable() is called.
+ *
+ *  LatencyStats::enable();
+ *  LatencyStats::record("connect", "user@host", microseconds);
+ *  LatencyStats::report(std::cout);
+ */
+class LatencyStats
+{
+  public:
+    static void enable();
+    static bool isEnabled();
+    static void record(std::string step, std::string host, uint64_t microseconds);
+    static void report(std::ostream &out);
+    /** Saves the report as CSV. Returns false on error.
+     */
+    static bool saveCsv(std::string path);
+};
+
+#endif
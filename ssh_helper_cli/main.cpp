@@ -20,7 +20,9 @@
 #include "simpleexception.h"
 #include "manager.h"
 #include <cstring>
+#include <sstream>
 #include <unistd.h>
+#include <signal.h>
 
 
 void print_help(const char *command)
@@ -34,6 +36,30 @@ The available options are:
 --password password   Sets password
 --no-multi            SSH scripts are run one by one, no multi-process.
 --log_path path       Log files will be saved on "path". The default path is ".".
+--no-cache            Don't use the remote files cache (~/.local/share/ssh_helper_cache).
+--cache_size size     Size limit of the remote files cache in MB. The default size is 2048.
+--paranoid            Always check uploaded files with md5sum on hosts. By default, md5sum
+                      is skipped if size and modification time are the same as in the last
+                      upload.
+--cleanup=mode        When temp folders are removed from hosts: "async" (as soon as a host
+                      finishes, the default), "end" (when all hosts have finished) or "never".
+--trace file          Saves the time of every step on every host in file, in Chrome trace
+                      event format. It can be opened with https://ui.perfetto.dev
+--stats               Prints a latency report (p50, p90, p99 and max of every step) and the
+                      SSH sessions with the most blocked time at the end.
+--stats-csv file      Saves the latency report in file.
+--metrics-file file   Writes counters of the run (hosts running, done and failed, transferred
+                      bytes, open channels...) in file every second, in OpenMetrics format.
+--metrics-port port   Serves the same counters on http://127.0.0.1:port/metrics
+--reprovision         Check the manager public key in authorized_keys of all hosts. By default,
+                      hosts where the key was installed in previous runs are not checked.
+--bwlimit rate        Bandwidth limit of all transfers in KB/s. Limits per site can be set
+                      with "bandwidth" tag in scripts_file.
+--simulate spec       Hosts are simulated, nothing is sent. spec is a list of values, like
+                      "rtt=50,bw=10240,fail=0.01,cmd=20,slow=0.1,factor=10,seed=1": round
+                      trip time in ms, bandwidth in KB/s, probability of losing a connection
+                      on every operation, time of commands in ms, fraction of slow hosts and
+                      how much slower they are. The virtual time of the run is printed.
 
 )";
 }
@@ -71,8 +97,11 @@ int main(int argn, char* argv[])
   }*/
   std::string password;
   std::string scripts_file;
-  std::string log_path;
-  bool no_multi = false;
+  ManagerOptions options;
+  std::string simulate_spec;
+
+  // Compressor processes can be closed while data is being written
+  signal(SIGPIPE, SIG_IGN);
 
   for(int i = 0; i < argn; i++) {
     if(!strcmp(argv[i], "--help") || argn == 1) {
@@ -82,7 +111,80 @@ int main(int argn, char* argv[])
     } else if(!strcmp(argv[i], "--stdin")) {
       std::cin >> password;
     } else if(!strcmp(argv[i], "--no-multi")) {
-      no_multi = true;
+      options.no_multi = true;
+    } else if(!strcmp(argv[i], "--paranoid")) {
+      options.paranoid = true;
+    } else if(!strncmp(argv[i], "--cleanup=", 10)) {
+      std::string mode(argv[i] + 10);
+      if(mode == "async")
+        options.cleanup = CleanupMode::ASYNC;
+      else if(mode == "end")
+        options.cleanup = CleanupMode::END;
+      else if(mode == "never")
+        options.cleanup = CleanupMode::NEVER;
+      else {
+        std::cerr << "Error: --cleanup must be async, end or never" << std::endl;
+        print_help(argv[0]);
+      }
+    } else if(!strcmp(argv[i], "--trace")) {
+      if(++i < argn)
+        options.trace_path = argv[i];
+      else {
+        std::cerr << "Error: --trace needs a file" << std::endl;
+        print_help(argv[0]);
+      }
+    } else if(!strcmp(argv[i], "--stats")) {
+      options.stats = true;
+    } else if(!strcmp(argv[i], "--stats-csv")) {
+      if(++i < argn)
+        options.stats_csv_path = argv[i];
+      else {
+        std::cerr << "Error: --stats-csv needs a file" << std::endl;
+        print_help(argv[0]);
+      }
+    } else if(!strcmp(argv[i], "--metrics-file")) {
+      if(++i < argn)
+        options.metrics_path = argv[i];
+      else {
+        std::cerr << "Error: --metrics-file needs a file" << std::endl;
+        print_help(argv[0]);
+      }
+    } else if(!strcmp(argv[i], "--metrics-port")) {
+      if(++i < argn) {
+        std::stringstream buf(argv[i]);
+        buf >> options.metrics_port;
+      } else {
+        std::cerr << "Error: --metrics-port needs port" << std::endl;
+        print_help(argv[0]);
+      }
+    } else if(!strcmp(argv[i], "--simulate")) {
+      if(++i < argn) {
+        options.simulate = true;
+        simulate_spec = argv[i];
+      } else {
+        std::cerr << "Error: --simulate needs spec" << std::endl;
+        print_help(argv[0]);
+      }
+    } else if(!strcmp(argv[i], "--reprovision")) {
+      options.reprovision = true;
+    } else if(!strcmp(argv[i], "--no-cache")) {
+      options.use_cache = false;
+    } else if(!strcmp(argv[i], "--cache_size")) {
+      if(++i < argn) {
+        std::stringstream buf(argv[i]);
+        buf >> options.cache_size;
+      } else {
+        std::cerr << "Error: --cache_size needs size" << std::endl;
+        print_help(argv[0]);
+      }
+    } else if(!strcmp(argv[i], "--bwlimit")) {
+      if(++i < argn) {
+        std::stringstream buf(argv[i]);
+        buf >> options.bwlimit;
+      } else {
+        std::cerr << "Error: --bwlimit needs rate" << std::endl;
+        print_help(argv[0]);
+      }
     } else if(!strcmp(argv[i], "--password")) {
       if(++i < argn)
         password = argv[i];
@@ -92,7 +194,7 @@ int main(int argn, char* argv[])
       }
     } else if(!strcmp(argv[i], "--log_path")) {
       if(++i < argn) {
-        log_path = argv[i];
+        options.log_path = argv[i];
       } else {
         std::cerr << "Error: --log_path needs path" << std::endl;
         print_help(argv[0]);
@@ -110,7 +212,7 @@ int main(int argn, char* argv[])
     return 2;
   }
 
-  if(password.empty()) {
+  if(password.empty() && !options.simulate) {
     char *p = getpass("Password: ");
     if(p == NULL) {
       std::cerr << "No password has been read." << std::endl;
@@ -124,12 +226,12 @@ int main(int argn, char* argv[])
   //ssh_set_log_level(SSH_LOG_PACKET);
   ssh_init();
   try {
-    const std::set<std::string> tags = {"hosts", "scripts", "user", "host", "password", "script", "name", "command", "sudo", "stop_on_error", "args", "orig", "dest", "md5", "threads", "scripts_lock", "type", "upload", "download", "monitor"};
-    std::shared_ptr<ConfigItemVector> scripts_and_host = ConfigFileParser::parser(scripts_file, tags);
+    if(options.simulate)
+      options.simulation.parse(simulate_spec);
+    std::shared_ptr<ConfigItemVector> scripts_and_host = ConfigFileParser::parser(scripts_file, Manager::scriptTags());
     ConfigFileParser::print_tree(std::cout, scripts_and_host); 
-    std::filesystem::path log_folder_path(log_path);
     
-    Manager manager(scripts_and_host, password, no_multi, log_folder_path);
+    Manager manager(scripts_and_host, password, options);
     manager.checkKeys();
     manager.run();
   } catch(SshException &error) {
@@ -17,20 +17,33 @@
 
 #include "manager.h"
 #include "simpleexception.h"
+#include "hash.h"
+#include "hashcache.h"
+#include "scripttags.h"
+#include "timeline.h"
+#include "latency.h"
+#include "metrics.h"
+#include "sessionstats.h"
+#include "scriptmetrics.h"
 #include <sstream>
 #include <fstream>
 #include <stdlib.h>
 #include <time.h>
+#include <algorithm>
 
-Manager::Manager(std::shared_ptr<ConfigItemVector> scripts_and_host, std::string password, bool no_multi, std::filesystem::path &log_path)
+Manager::Manager(std::shared_ptr<ConfigItemVector> scripts_and_host, std::string password, const ManagerOptions &options)
 {
   this->mScripts_and_host = scripts_and_host;
   this->password = password;
-  this->no_multi = no_multi;
-  this->log_path = log_path;
+  this->options = options;
 }
 
 
+const std::set<std::string> &Manager::scriptTags()
+{
+  return ::scriptTags();
+}
+
 void Manager::checkKeys()
 {
   // Check public and private keys
@@ -55,6 +68,27 @@ void Manager::checkKeys()
 }
 
 
+void Manager::readPublicKey()
+{
+  // Same key as checkKeys
+  char *home = getenv("HOME");
+  if(home == NULL)
+    throw(SimpleException("$HOME environment variable is not defined."));
+  std::string public_key_file(std::string(home) + "/.ssh/id_rsa.pub");
+  std::string public_key;
+  std::ifstream public_key_stream;
+  public_key_stream.open(public_key_file);
+  if(!public_key_stream.is_open())
+    throw(SimpleException("Error: " + public_key_file + " cannot be opened."));
+  getline(public_key_stream, public_key);
+  public_key_stream.close();
+
+  Hash fingerprint(HashType::BLAKE2);
+  fingerprint.update(public_key.c_str(), public_key.size());
+  mThreadSharedData->public_key = public_key;
+  mThreadSharedData->key_fingerprint = fingerprint.final();
+}
+
 void Manager::makeIdSession()
 {
   std::string id;
@@ -91,9 +125,115 @@ void Manager::makeIdSession()
 }
 
 
+static void find_uploads(std::shared_ptr<ConfigItemVector> scripts, std::vector<std::shared_ptr<ConfigItemMap> > &uploads)
+{
+  if(scripts == nullptr)
+    return;
+  for(auto item : scripts->getValue()) {
+    std::string tag;
+    std::shared_ptr<ConfigItem> value;
+    std::tie(tag, value) = item;
+    if(value->getType() != ConfigItemType::MAP)
+      continue;
+    std::shared_ptr<ConfigItemMap> map = std::static_pointer_cast<ConfigItemMap>(value);
+    if(tag == "upload") {
+      uploads.push_back(map);
+    } else if(tag == "monitor") {
+      for(std::string key : {"scripts", "scripts_lock"}) {
+        if(map->contains(key) && map->getValue()[key]->getType() == ConfigItemType::VECTOR)
+          find_uploads(std::static_pointer_cast<ConfigItemVector>(map->getValue()[key]), uploads);
+      }
+    }
+  }
+}
+
+
+void Manager::hashUploads(std::shared_ptr<ConfigItemVector> scripts)
+{
+  std::vector<std::shared_ptr<ConfigItemMap> > uploads;
+  find_uploads(scripts, uploads);
+
+  std::vector<std::string> paths, folders;
+  for(std::shared_ptr<ConfigItemMap> map : uploads) {
+    std::string orig = strip(map->getKeyValue("orig"));
+    // Folders are compared file by file when they are uploaded
+    if(std::filesystem::is_directory(orig)) {
+      if(std::find(folders.begin(), folders.end(), orig) == folders.end())
+        folders.push_back(orig);
+      continue;
+    }
+    if(!orig.empty() && std::find(paths.begin(), paths.end(), orig) == paths.end())
+      paths.push_back(orig);
+  }
+  if(!folders.empty()) {
+    std::cout << "Computing md5 of files in " << folders.size() << " folders..." << std::endl;
+    mThreadSharedData->hashFolders(folders);
+  }
+  if(paths.empty())
+    return;
+
+  std::cout << "Computing md5 of " << paths.size() << " files..." << std::endl;
+  std::vector<std::string> digests = Hash::files(paths);
+  std::map<std::string, std::string> md5s;
+  for(size_t i = 0; i < paths.size(); i++)
+    md5s[paths[i]] = digests[i];
+
+  for(std::shared_ptr<ConfigItemMap> map : uploads) {
+    std::string orig = strip(map->getKeyValue("orig"));
+    if(orig.empty() || std::filesystem::is_directory(orig))
+      continue;
+    std::string md5 = strip(map->getKeyValue("md5"));
+    if(md5.empty())
+      map->setKey("md5", md5s[orig]);
+    else if(md5 != md5s[orig]) {
+      // Only this step fails, on every host
+      std::string error = "Error: md5 of " + orig + " is " + md5s[orig] + ", but md5 tag is " + md5 + ".";
+      std::cerr << error << std::endl;
+      map->setKey("md5_error", error);
+    }
+  }
+}
+
+
+// Reads a limit in KB/s and returns it in bytes/s
+static uintmax_t read_limit(std::shared_ptr<ConfigItemMap> map)
+{
+  uintmax_t limit = 0;
+  std::stringstream buff(strip(ConfigFileParser::getMapValue(map, "limit")));
+  buff >> limit;
+  return limit * 1024;
+}
+
+void Manager::setBandwidth(std::shared_ptr<ConfigItemMap> bandwidth)
+{
+  if(bandwidth != nullptr) {
+    mThreadSharedData->bandwidth->setLimit(read_limit(bandwidth));
+    if(bandwidth->getValue().contains("sites")) {
+      std::shared_ptr<ConfigItem> sites = bandwidth->getValue()["sites"];
+      if(sites->getType() != ConfigItemType::VECTOR)
+        throw(SimpleException("Error: \"sites\" must be a vector (sites +)."));
+      for(auto item : std::static_pointer_cast<ConfigItemVector>(sites)->getValue()) {
+        std::string tag;
+        std::shared_ptr<ConfigItem> value;
+        std::tie(tag, value) = item;
+        if(tag != "site" || value->getType() != ConfigItemType::MAP)
+          throw(SimpleException("Error: \"sites\" items must be \"site -\" maps."));
+        std::shared_ptr<ConfigItemMap> site = ConfigFileParser::getMap(value);
+        std::string name = strip(ConfigFileParser::getMapValue(site, "name"));
+        if(name.empty())
+          throw(SimpleException("Error: \"site\" name tag is missing."));
+        mThreadSharedData->bandwidth->setSiteLimit(name, read_limit(site));
+      }
+    }
+  }
+  if(options.bwlimit > 0)
+    mThreadSharedData->bandwidth->setLimit(options.bwlimit * 1024);
+}
+
 void Manager::run()
 {
   std::shared_ptr<ConfigItemVector> scripts, hosts;
+  std::shared_ptr<ConfigItemMap> bandwidth;
   for(auto item : mScripts_and_host->getValue()) {
     std::string tag;
     std::shared_ptr<ConfigItem> value;
@@ -108,12 +248,50 @@ void Manager::run()
         hosts = std::static_pointer_cast<ConfigItemVector>(value);
       else
         throw(SimpleException("Error: \"hosts\" must be a vector (hosts +)."));
+    } else if(tag == "bandwidth") {
+      if(value->getType() == ConfigItemType::MAP)
+        bandwidth = ConfigFileParser::getMap(value);
+      else
+        throw(SimpleException("Error: \"bandwidth\" must be a map (bandwidth -)."));
     } else {
       throw(SimpleException("Error: Tag " + tag + " doesn't be at root."));
     }
   }
 
+  if(!options.trace_path.empty())
+    Timeline::enable();
+  if(options.stats || !options.stats_csv_path.empty())
+    LatencyStats::enable();
+  std::unique_ptr<MetricsExporter> metrics;
+  if(!options.metrics_path.empty() || options.metrics_port > 0)
+    metrics = std::make_unique<MetricsExporter>(options.metrics_path.string(), options.metrics_port);
   mThreadSharedData = std::make_shared<ThreadSharedData>(scripts);
+  {
+    TimelineSpan span("hash uploads", "setup");
+    hashUploads(scripts);
+  }
+  mThreadSharedData->use_cache = options.use_cache;
+  mThreadSharedData->cache_size = options.cache_size * 1024 * 1024;
+  mThreadSharedData->paranoid = options.paranoid;
+  setBandwidth(bandwidth);
+  readPublicKey();
+  mThreadSharedData->reprovision = options.reprovision;
+  mThreadSharedData->cleanup = options.cleanup;
+  std::string remote_files_path = options.simulate ? "" : HashCache::cacheFolder();
+  std::string provisioned_path = remote_files_path;
+  if(options.simulate) {
+    SimExecutor::checkCommands();
+    SimProfile profile = options.simulation;
+    mThreadSharedData->new_executor = [profile](std::string host, int port) -> std::shared_ptr<Executor> {
+      return std::make_shared<SimExecutor>(host, port, profile);
+    };
+  }
+  if(!remote_files_path.empty()) {
+    remote_files_path += "/remote_files";
+    mThreadSharedData->loadRemoteFileStates(remote_files_path);
+    provisioned_path += "/provisioned";
+    mThreadSharedData->loadProvisioned(provisioned_path);
+  }
   makeIdSession();
 
   // Launch clients
@@ -124,7 +302,7 @@ void Manager::run()
     if(tag == "host" && value->getType() == ConfigItemType::MAP) {
       std::shared_ptr<ConfigItemMap> map_ptr = std::static_pointer_cast<ConfigItemMap>(value);
       std::map<std::string, std::shared_ptr<ConfigItem> > map = map_ptr->getValue();
-      std::string host, user, password;
+      std::string host, user, password, site;
       int port = 22;
       if(map.contains("host")) {
         std::shared_ptr<ConfigItem> ptr = map["host"];
@@ -147,6 +325,13 @@ void Manager::run()
           password = str->getValue();
         }
       }
+      if(map.contains("site")) {
+        std::shared_ptr<ConfigItem> ptr = map["site"];
+        if(ptr->getType() == ConfigItemType::STRING) {
+          std::shared_ptr<ConfigItemString> str = static_pointer_cast<ConfigItemString>(ptr);
+          site = str->getValue();
+        }
+      }
       if(map.contains("port")) {
         std::shared_ptr<ConfigItem> ptr = map["port"];
         if(ptr->getType() == ConfigItemType::STRING) {
@@ -169,34 +354,67 @@ void Manager::run()
       }
 
       // Open file log: user@host.txt
-      std::filesystem::path path(log_path);
+      std::filesystem::path path(options.log_path);
       std::filesystem::path log_file(user + "@" + host + ".txt");
       path /= log_file;
       std::ofstream *log_stream = new std::ofstream;
       log_stream->open(path);
       if(!log_stream->is_open())
         throw(SimpleException(std::string("Log file ") + path.c_str() + std::string(" cannot be opened.")));
-      ClientThread *client_ptr = new ClientThread(mThreadSharedData, host, port, user, password, log_stream);
+      ClientThread *client_ptr = new ClientThread(mThreadSharedData, host, port, user, password, log_stream, site);
       std::shared_ptr<ClientThread> client(client_ptr);
 
       clients.push_back(client);      
 
       pthread_create(client->getThread(), NULL, &ClientThread::start, (void*)client_ptr);
-      if(no_multi)
+      if(options.no_multi)
         pthread_join(*client->getThread(), NULL);
     }
   }
 
-  if(!no_multi) {
+  if(!options.no_multi) {
     for(std::shared_ptr<ClientThread> client : clients) {
       pthread_join(*client->getThread(), NULL);
     }
   }
 
-  std::cout << "Cleaning temp folder..." << std::endl;
-  for(std::shared_ptr<ClientThread> client : clients) {
-    client->clean_temp();
+  if(!remote_files_path.empty()) {
+    mThreadSharedData->saveRemoteFileStates(remote_files_path);
+    mThreadSharedData->saveProvisioned(provisioned_path);
   }
-  std::cout << "done." << std::endl;
 
+  // Hosts not cleaned by their threads are cleaned at the same time
+  if(options.cleanup != CleanupMode::NEVER) {
+    TimelineSpan span("cleanup", "setup");
+    std::cout << "Cleaning temp folder..." << std::endl;
+    std::vector<std::shared_ptr<ClientThread> > cleaning;
+    for(std::shared_ptr<ClientThread> client : clients) {
+      if(!client->isCleaned() && pthread_create(client->getThread(), NULL, &ClientThread::start_clean_temp, (void*)client.get()) == 0)
+        cleaning.push_back(client);
+    }
+    for(std::shared_ptr<ClientThread> client : cleaning)
+      pthread_join(*client->getThread(), NULL);
+    std::cout << "done." << std::endl;
+  }
+  // Sessions are closed, so their stats are recorded
+  for(std::shared_ptr<ClientThread> client : clients)
+    client->disconnect();
+  // Last values are written
+  metrics.reset();
+
+  if(options.stats) {
+    LatencyStats::report(std::cout);
+    SessionStats::report(std::cout);
+  }
+  ScriptMetrics::report(std::cout);
+  if(options.simulate)
+    SimExecutor::report(std::cout);
+  if(!options.stats_csv_path.empty() && !LatencyStats::saveCsv(options.stats_csv_path))
+    std::cerr << "Error: latency report cannot be saved in " << options.stats_csv_path.string() << std::endl;
+  if(!options.trace_path.empty()) {
+    if(Timeline::save(options.trace_path))
+      std::cout << "Trace saved in " << options.trace_path.string() << std::endl;
+    else
+      std::cerr << "Error: trace cannot be saved in " << options.trace_path.string() << std::endl;
+  }
 }
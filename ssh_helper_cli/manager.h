@@ -21,27 +21,78 @@
 #include "configfileparser.h"
 #include "threadshareddata.h"
 #include "clientthread.h"
+#include "simexecutor.h"
 #include <filesystem>
 
+/** Command line options of the manager.
+ */
+struct ManagerOptions
+{
+  bool no_multi = false;
+  std::filesystem::path log_path;
+  // Remote content-addressed cache (~/.local/share/ssh_helper_cache)
+  bool use_cache = true;
+  uintmax_t cache_size = 2048; // MB
+  // Always check remote files with md5sum, saved size and mtime are not used.
+  bool paranoid = false;
+  // Global bandwidth limit in KB/s, 0 is no limit. Overrides "bandwidth" tag.
+  uintmax_t bwlimit = 0;
+  // Check manager public key on all hosts, also on the provisioned ones
+  bool reprovision = false;
+  CleanupMode cleanup = CleanupMode::ASYNC;
+  // Chrome trace event file of the run (see Timeline)
+  std::filesystem::path trace_path;
+  // Latency and SSH session reports printed at the end of the run, CSV file of latencies
+  bool stats = false;
+  std::filesystem::path stats_csv_path;
+  // OpenMetrics file rewritten every second and localhost HTTP port, 0 is disabled
+  std::filesystem::path metrics_path;
+  int metrics_port = 0;
+  // Hosts are simulated by SimExecutor, no connection is opened. 
+  // Saved remote file states and provisioned hosts are not used.
+  bool simulate = false;
+  SimProfile simulation;
+};
+
 class Manager
 {
   public:
-    Manager(std::shared_ptr<ConfigItemVector> scripts_and_host, std::string password, bool no_multi, std::filesystem::path &log_path);
+    Manager(std::shared_ptr<ConfigItemVector> scripts_and_host, std::string password, const ManagerOptions &options);
 
     void run();
+    /** Tags allowed in scripts files.
+     */
+    static const std::set<std::string> &scriptTags();
     /** Checks ssh public and private keys located at "~/.ssh/id_rsa"
      */
     void checkKeys();
+    /** Reads manager public key ("~/.ssh/id_rsa.pub") and saves it in ThreadSharedData.
+     */
+    void readPublicKey();
     /** Build ID session and saves in ThreadSharedData.
      */
     void makeIdSession();
+    /** Computes md5 of "upload" files. Missing md5 tags are filled and 
+     * the given ones are checked. A wrong md5 tag is saved as "md5_error" 
+     * of the upload, which fails. Files of uploaded folders are hashed in 
+     * ThreadSharedData::hashFolders.
+     */
+    void hashUploads(std::shared_ptr<ConfigItemVector> scripts);
+    /** Reads bandwidth limits (KB/s) from "bandwidth" tag:
+     *  bandwidth -
+     *  	limit: 10240
+     *  	sites +
+     *  		site -
+     *  			name: office
+     *  			limit: 2048
+     */
+    void setBandwidth(std::shared_ptr<ConfigItemMap> bandwidth);
   private:
     std::shared_ptr<ConfigItemVector> mScripts_and_host;
     std::string password;
-    bool no_multi;
+    ManagerOptions options;
     std::shared_ptr<ThreadSharedData> mThreadSharedData;
     std::vector<std::shared_ptr<ClientThread> > clients;
-    std::filesystem::path log_path;
 };
 
 #endif
@@ -0,0 +1,79 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "markerparser.h"
+
+// Longest marker name
+static const size_t MAX_NAME = 8;
+
+MarkerParser::MarkerParser(MarkerHandler handler)
+{
+  this->handler = handler;
+  state = NONE;
+  type = MarkerType::LOG;
+}
+
+void MarkerParser::parse(const char *buffer, size_t size)
+{
+  for(size_t i = 0; i < size; i++) {
+    char ch = buffer[i];
+    switch(state) {
+      case NONE:
+        if(ch == '#')
+          state = SHARP1;
+        break;
+      case SHARP1:
+        if(ch == '#') {
+          state = NAME;
+          name.clear();
+        } else
+          state = NONE;
+        break;
+      case NAME:
+        if(ch == ':') {
+          state = TEXT;
+          if(name == "log")
+            type = MarkerType::LOG;
+          else if(name == "metric")
+            type = MarkerType::METRIC;
+          else if(name == "progress")
+            type = MarkerType::PROGRESS;
+          else
+            state = NONE;
+          text.clear();
+        } else if(ch >= 'a' && ch <= 'z' && name.size() < MAX_NAME)
+          name += ch;
+        else
+          state = NONE;
+        break;
+      case TEXT:
+        text += ch;
+        if(ch == '\n') {
+          handler(type, text);
+          state = NONE;
+        }
+        break;
+    }
+  }
+}
+
+void MarkerParser::finish()
+{
+  if(state == TEXT && !text.empty())
+    handler(type, text);
+  state = NONE;
+}
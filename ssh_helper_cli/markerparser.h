@@ -0,0 +1,60 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __MARKERPARSER_H__
+#define __MARKERPARSER_H__
+
+#include <string>
+#include <functional>
+
+/** Markers written by remote scripts in their output:
+ *
+ *  echo "##log: Error: deleting Path"
+ *  echo "##metric: disk_free 1024 MB"
+ *  echo "##progress: 45"
+ */
+enum class MarkerType {
+  LOG, METRIC, PROGRESS
+};
+
+/** Receives the text of a marker after ':' and before the end of line.
+ */
+typedef std::function<void(MarkerType type, const std::string &text)> MarkerHandler;
+
+/** Finds markers in output while it is read. Only the name and the text 
+ * of the current marker are kept, output is not buffered.
+ */
+class MarkerParser
+{
+  public:
+    MarkerParser(MarkerHandler handler);
+    void parse(const char *buffer, size_t size);
+    /** Sends a marker without end of line at the end of output.
+     */
+    void finish();
+
+  private:
+    enum State {
+      NONE, SHARP1, NAME, TEXT
+    };
+    MarkerHandler handler;
+    State state;
+    MarkerType type;
+    std::string name, text;
+};
+
+#endif
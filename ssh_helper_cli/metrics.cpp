@@ -0,0 +1,236 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "metrics.h"
+#include "simpleexception.h"
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <limits>
+#include <cmath>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+
+struct MetricFamily {
+  const char *type, *help;
+};
+
+// Known metrics. Samples are named as "family", "family_total" (counters) or "family{labels}".
+static const std::map<std::string, MetricFamily> FAMILIES = {
+  {"ssh_helper_hosts_connected", {"gauge", "Hosts with an open SSH session."}},
+  {"ssh_helper_hosts_running", {"gauge", "Hosts running scripts."}},
+  {"ssh_helper_hosts_done", {"counter", "Hosts which have run all scripts."}},
+  {"ssh_helper_hosts_failed", {"counter", "Hosts which could not connect or have a failed step."}},
+  {"ssh_helper_uploaded_bytes", {"counter", "Bytes sent to hosts."}},
+  {"ssh_helper_downloaded_bytes", {"counter", "Bytes received from hosts."}},
+  {"ssh_helper_active_channels", {"gauge", "Open SSH channels."}},
+  {"ssh_helper_p2p_seeds_available", {"gauge", "Hosts available as seeds of uploaded files."}},
+  {"ssh_helper_monitor_waiters", {"gauge", "Hosts waiting to enter a monitor."}},
+  {"ssh_helper_script_metric", {"gauge", "Last value of a ##metric: marker of scripts."}},
+  {"ssh_helper_script_progress", {"gauge", "Last ##progress: marker of scripts (0-100)."}},
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, double> samples;
+
+void Metrics::add(std::string sample, double value)
+{
+  pthread_mutex_lock(&mutex);
+  samples[sample] += value;
+  pthread_mutex_unlock(&mutex);
+}
+
+void Metrics::set(std::string sample, double value)
+{
+  pthread_mutex_lock(&mutex);
+  samples[sample] = value;
+  pthread_mutex_unlock(&mutex);
+}
+
+std::string Metrics::label(std::string value)
+{
+  std::string escaped;
+  for(char ch : value) {
+    if(ch == '\\' || ch == '"')
+      escaped += '\\';
+    if(ch == '\n')
+      escaped += "\\n";
+    else
+      escaped += ch;
+  }
+  return escaped;
+}
+
+// Family of a sample: its name without labels and "_total"
+static std::string family_name(const std::string &sample)
+{
+  std::string name = sample.substr(0, sample.find('{'));
+  if(name.ends_with("_total"))
+    name.resize(name.size() - 6);
+  return name;
+}
+
+std::string Metrics::text()
+{
+  std::stringstream out;
+  // Counters are printed as integers, marker values keep their decimals
+  out.precision(std::numeric_limits<double>::digits10);
+  pthread_mutex_lock(&mutex);
+  // Samples are sorted by name, so samples of a family are together
+  std::string last_family;
+  for(const auto& [sample, value] : samples) {
+    std::string family = family_name(sample);
+    if(family != last_family) {
+      auto it = FAMILIES.find(family);
+      out << "# TYPE " << family << " " << (it != FAMILIES.end() ? it->second.type : "unknown") << "\n";
+      if(it != FAMILIES.end())
+        out << "# HELP " << family << " " << it->second.help << "\n";
+      last_family = family;
+    }
+    out << sample << " ";
+    if(std::isnan(value))
+      out << "NaN";
+    else if(std::isinf(value))
+      out << (value > 0 ? "+Inf" : "-Inf");
+    else
+      out << value;
+    out << "\n";
+  }
+  pthread_mutex_unlock(&mutex);
+  out << "# EOF\n";
+  return out.str();
+}
+
+MetricsExporter::MetricsExporter(std::string file, int port)
+{
+  this->file = file;
+  server_fd = -1;
+  running = true;
+  file_thread_running = http_thread_running = false;
+  if(pthread_mutex_init(&mutex, NULL) != 0)
+    throw(SimpleException("Error: mutex init failed\n"));
+  if(pthread_cond_init(&cond, NULL) != 0)
+    throw(SimpleException("Error: cond init failed\n"));
+
+  if(port > 0) {
+    // Only local clients can connect
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(server_fd < 0 || bind(server_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(server_fd, 16) != 0) {
+      if(server_fd >= 0)
+        close(server_fd);
+      throw(SimpleException("Error: metrics port " + std::to_string(port) + " cannot be opened."));
+    }
+    http_thread_running = pthread_create(&http_thread, NULL, &MetricsExporter::httpLoop, this) == 0;
+  }
+  if(!file.empty())
+    file_thread_running = pthread_create(&file_thread, NULL, &MetricsExporter::fileLoop, this) == 0;
+}
+
+MetricsExporter::~MetricsExporter()
+{
+  pthread_mutex_lock(&mutex);
+  running = false;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  if(file_thread_running)
+    pthread_join(file_thread, NULL);
+  if(http_thread_running)
+    pthread_join(http_thread, NULL);
+  if(server_fd >= 0)
+    close(server_fd);
+  if(!file.empty())
+    writeFile();
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void MetricsExporter::writeFile()
+{
+  // Readers never see a half written file
+  std::string tmp = file + ".tmp";
+  std::ofstream out(tmp);
+  if(!out.is_open())
+    return;
+  out << Metrics::text();
+  out.close();
+  std::error_code error;
+  std::filesystem::rename(tmp, file, error);
+}
+
+void *MetricsExporter::fileLoop(void *data)
+{
+  MetricsExporter *exporter = (MetricsExporter *) data;
+  pthread_mutex_lock(&exporter->mutex);
+  while(exporter->running) {
+    pthread_mutex_unlock(&exporter->mutex);
+    exporter->writeFile();
+    pthread_mutex_lock(&exporter->mutex);
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += 1;
+    pthread_cond_timedwait(&exporter->cond, &exporter->mutex, &timeout);
+  }
+  pthread_mutex_unlock(&exporter->mutex);
+  return nullptr;
+}
+
+void *MetricsExporter::httpLoop(void *data)
+{
+  MetricsExporter *exporter = (MetricsExporter *) data;
+  while(true) {
+    pthread_mutex_lock(&exporter->mutex);
+    bool running = exporter->running;
+    pthread_mutex_unlock(&exporter->mutex);
+    if(!running)
+      break;
+    struct pollfd fd = {exporter->server_fd, POLLIN, 0};
+    if(poll(&fd, 1, 200) <= 0)
+      continue;
+    int client = accept4(exporter->server_fd, NULL, NULL, SOCK_CLOEXEC);
+    if(client < 0)
+      continue;
+    // Any request gets the metrics. The request is read to avoid connection resets.
+    struct timeval timeout = {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[4096];
+    ssize_t nbytes = recv(client, request, sizeof(request), 0);
+    (void) nbytes;
+    std::string body = Metrics::text();
+    std::string response = "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+      "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    size_t done = 0;
+    while(done < response.size()) {
+      ssize_t n = send(client, response.c_str() + done, response.size() - done, MSG_NOSIGNAL);
+      if(n <= 0)
+        break;
+      done += n;
+    }
+    close(client);
+  }
+  return nullptr;
+}
@@ -0,0 +1,69 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <string>
+#include <pthread.h>
+
+/** Counters and gauges of a run (hosts, bytes, channels, seeds...) in 
+ * OpenMetrics text format. A sample name can have labels:
+ *
+ *  Metrics::add("ssh_helper_uploaded_bytes_total", nbytes);
+ *  Metrics::add("ssh_helper_monitor_waiters{monitor=\"backup\"}", 1);
+ *  std::string text = Metrics::text();
+ */
+class Metrics
+{
+  public:
+    static void add(std::string sample, double value);
+    static void set(std::string sample, double value);
+    /** Escapes a label value.
+     */
+    static std::string label(std::string value);
+    /** All samples in OpenMetrics text format.
+     */
+    static std::string text();
+};
+
+/** Exposes Metrics while a run is going on: file is rewritten every second 
+ * and, if port > 0, served over HTTP on localhost.
+ */
+class MetricsExporter
+{
+  public:
+    MetricsExporter(std::string file, int port);
+    /** Stops the threads. The file is written again with the last values.
+     */
+    ~MetricsExporter();
+
+  private:
+    std::string file;
+    int server_fd;
+    bool running;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t file_thread, http_thread;
+    bool file_thread_running, http_thread_running;
+
+    void writeFile();
+    static void *fileLoop(void *data);
+    static void *httpLoop(void *data);
+};
+
+#endif
@@ -17,6 +17,8 @@
 
 #include "p2pdata.h"
 #include "simpleexception.h"
+#include "metrics.h"
+#include "tracing.h"
 
 P2PData::P2PData()
 {
@@ -35,7 +37,10 @@ P2PData::~P2PData()
 
 P2PSeed P2PData::getSeed()
 {
-  sem_wait(&semaphore);
+  {
+    TRACE_ZONE("wait seed", "p2p");
+    sem_wait(&semaphore);
+  }
   P2PSeed client = nullptr;
   int rc = pthread_mutex_lock(&mutex);
   if(rc)
@@ -43,7 +48,9 @@ P2PSeed P2PData::getSeed()
   if(seeds.size() > 0) {
     client = seeds[0];
     seeds.pop_front();
+    Metrics::add("ssh_helper_p2p_seeds_available", -1);
   }
+  TRACE_COUNTER("p2p seeds", seeds.size());
   rc = pthread_mutex_unlock(&mutex);
   if(rc)
     throw(SimpleException("Error: Mutex cannot be unlocked."));
@@ -57,6 +64,8 @@ void P2PData::addSeed(P2PSeed client)
   if(rc)
     throw(SimpleException("Error: Mutex cannot be locked."));
   seeds.push_back(client);
+  Metrics::add("ssh_helper_p2p_seeds_available", 1);
+  TRACE_COUNTER("p2p seeds", seeds.size());
   rc = pthread_mutex_unlock(&mutex);
   if(rc)
     throw(SimpleException("Error: Mutex cannot be unlocked."));
@@ -24,10 +24,13 @@
 #include <semaphore.h>
 #include <memory>
 #include <string>
+#include <cstdint>
 
 struct _P2PSeed
 {
   std::string user, host, password, path;
+  // Executor::clock() of the host which made the seed available
+  uint64_t clock_us = 0;
 };
 
 typedef std::shared_ptr<_P2PSeed> P2PSeed ;
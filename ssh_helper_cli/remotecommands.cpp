@@ -0,0 +1,105 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "remotecommands.h"
+#include <regex>
+#include <filesystem>
+
+static const std::string BOOTSTRAP_SH = R"SH(umask 077
+mkdir -p "$shared" && chmod 700 "$shared" || { echo '##bootstrap: error=shared_folder'; exit 1; }
+k=skipped
+if [ -n "$key" ]; then
+  mkdir -p ~/.ssh && chmod 700 ~/.ssh || { echo '##bootstrap: error=ssh_folder'; exit 1; }
+  k=present
+  if ! grep -qxF "$key" ~/.ssh/authorized_keys 2>/dev/null; then
+    if [ -s ~/.ssh/authorized_keys ] && [ -n "$(tail -c 1 ~/.ssh/authorized_keys)" ]; then echo >> ~/.ssh/authorized_keys; fi
+    echo "$key" >> ~/.ssh/authorized_keys || { echo '##bootstrap: error=authorized_keys'; exit 1; }
+    k=added
+  fi
+fi
+z=no; command -v zstd >/dev/null 2>&1 && z=yes
+l=no; command -v lz4 >/dev/null 2>&1 && l=yes
+echo "##bootstrap: ok key=$k zstd=$z lz4=$l home=$HOME"
+exit 0
+)SH";
+
+// Quotes value for sh
+static std::string sh_quote(std::string value)
+{
+  return "'" + std::regex_replace(value, std::regex("'"), "'\\''") + "'";
+}
+
+std::string RemoteCommands::bootstrap(std::string shared_folder, std::string public_key)
+{
+  return "shared=" + sh_quote(shared_folder) + "\nkey=" + sh_quote(public_key) + "\n" + BOOTSTRAP_SH;
+}
+
+std::string RemoteCommands::stat(std::string path)
+{
+  return "stat -c '%s %.Y' '" + path + "'";
+}
+
+std::string RemoteCommands::statMd5(std::string path, std::string known_stat)
+{
+  return "bash -c \"s=\\$(stat -c '%s %.Y' '" + path + "') || exit 1; echo \\$s; "
+    "[ \\\"\\$s\\\" = '" + known_stat + "' ] || md5sum -b '" + path + "'\"";
+}
+
+std::string RemoteCommands::fileSize(std::string path)
+{
+  return "bash -c \"test -f '" + path + "' && stat -L -c %s '" + path + "'\"";
+}
+
+std::string RemoteCommands::partialProbe(std::string partial)
+{
+  return "f='" + partial + "'; [ -f \"$f\" ] && stat -c %s \"$f\" && md5sum -b \"$f\"";
+}
+
+std::string RemoteCommands::movePartial(std::string partial, std::string dest)
+{
+  return "mkdir -p '" + std::filesystem::path(dest).parent_path().string() + "' && mv -f '" + partial + "' '" + dest + "'";
+}
+
+std::string RemoteCommands::remove(std::string path)
+{
+  return "rm -f '" + path + "'";
+}
+
+std::string RemoteCommands::cacheHit(std::string cache_path)
+{
+  return "test -f '" + cache_path + "' && touch '" + cache_path + "'";
+}
+
+std::string RemoteCommands::addToCache(std::string path, std::string cache_folder, std::string cache_path)
+{
+  return "mkdir -p '" + cache_folder + "' && chmod 700 '" + cache_folder + "' && "
+    "(ln -f '" + path + "' '" + cache_path + "' || cp '" + path + "' '" + cache_path + "') && touch '" + cache_path + "'";
+}
+
+std::string RemoteCommands::copy(std::string src, std::string dest, std::string dest_path, std::string chown, bool check_md5)
+{
+  // Reflinks make the copy free on CoW file systems (btrfs, xfs).
+  if(!check_md5)
+    return "mkdir -p '" + dest + "' && cp --reflink=auto '" + src + "' '" + dest_path + "' && chmod 600 '" + dest_path + "'" + chown;
+  // md5 is computed from the copied stream, dest_path is not read again.
+  return "bash -c \"set -o pipefail; mkdir -p '" + dest + "' && cat '" + src + "' | tee '" + dest_path + "' | md5sum -b && chmod 600 '" + dest_path + "'" + chown + "\"";
+}
+
+std::string RemoteCommands::relay(std::string askpass, std::string limit_option, std::string seed_uri, std::string dest)
+{
+  return "python3 " + askpass + " scp" + limit_option + " '" + seed_uri + "' '" + dest + "'";
+}
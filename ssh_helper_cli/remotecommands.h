@@ -0,0 +1,67 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __REMOTECOMMANDS_H__
+#define __REMOTECOMMANDS_H__
+
+#include <string>
+
+/** Commands run by ClientThread whose output or effect on the files of the
+ * host is used later. SimExecutor runs them on the files table of simulated
+ * hosts, so they are built only here. SimExecutor::checkCommands() verifies
+ * that the simulator recognizes every one of them.
+ */
+class RemoteCommands {
+  public:
+    /** Script of ClientThread::bootstrap, it is run by "sh -s". public_key is
+     * not installed if it is empty.
+     */
+    static std::string bootstrap(std::string shared_folder, std::string public_key);
+    /** Prints "size mtime" of path. mtime has fractional seconds.
+     */
+    static std::string stat(std::string path);
+    /** Prints "size mtime" of path and then its md5sum if they are not known_stat.
+     */
+    static std::string statMd5(std::string path, std::string known_stat);
+    /** Prints the size of path if it is a regular file. Links are followed.
+     */
+    static std::string fileSize(std::string path);
+    /** Prints size and md5sum of the partial file of an interrupted upload.
+     * It fails if there is no partial file.
+     */
+    static std::string partialProbe(std::string partial);
+    /** Moves a complete partial file to dest.
+     */
+    static std::string movePartial(std::string partial, std::string dest);
+    static std::string remove(std::string path);
+    /** Fails if cache_path is not in the cache, else its time is updated (LRU).
+     */
+    static std::string cacheHit(std::string cache_path);
+    /** Hard links (or copies) path to cache_path.
+     */
+    static std::string addToCache(std::string path, std::string cache_folder, std::string cache_path);
+    /** Copies src to dest_path (in the folder dest). chown is appended to the command.
+     * If check_md5 is true, md5sum of the copied stream is printed.
+     */
+    static std::string copy(std::string src, std::string dest, std::string dest_path, std::string chown, bool check_md5);
+    /** Copies seed_uri ("user@host:path") to dest with scp. askpass is the askpass.py
+     * script, it reads the password of the seed from stdin.
+     */
+    static std::string relay(std::string askpass, std::string limit_option, std::string seed_uri, std::string dest);
+};
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "scriptmetrics.h"
+#include "metrics.h"
+#include "string_utils.h"
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+
+struct ScriptMetric {
+  std::string unit;
+  std::map<std::string, double> hosts;
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, ScriptMetric> metrics;
+static std::map<std::string, double> progress_hosts;
+static std::chrono::steady_clock::time_point last_progress;
+
+// Progress is printed at most once per PROGRESS_INTERVAL
+static const std::chrono::seconds PROGRESS_INTERVAL(1);
+
+void ScriptMetrics::metric(std::string host, const std::string &text)
+{
+  std::stringstream buff(text);
+  std::string name, unit;
+  double value;
+  if(!(buff >> name >> value)) {
+    std::cerr << host << ": wrong metric \"" << strip(text) << "\". It must be \"##metric: name value [unit]\"." << std::endl;
+    return;
+  }
+  buff >> unit;
+  pthread_mutex_lock(&mutex);
+  ScriptMetric &metric = metrics[name];
+  metric.hosts[host] = value;
+  if(!unit.empty())
+    metric.unit = unit;
+  pthread_mutex_unlock(&mutex);
+  Metrics::set("ssh_helper_script_metric{metric=\"" + Metrics::label(name) + "\",host=\"" + Metrics::label(host) + "\"}", value);
+}
+
+void ScriptMetrics::progress(std::string host, const std::string &text)
+{
+  std::stringstream buff(text);
+  double value;
+  if(!(buff >> value) || value < 0 || value > 100) {
+    std::cerr << host << ": wrong progress \"" << strip(text) << "\". It must be \"##progress: 0-100\"." << std::endl;
+    return;
+  }
+  Metrics::set("ssh_helper_script_progress{host=\"" + Metrics::label(host) + "\"}", value);
+  pthread_mutex_lock(&mutex);
+  progress_hosts[host] = value;
+  auto now = std::chrono::steady_clock::now();
+  if(now - last_progress >= PROGRESS_INTERVAL || value == 100) {
+    last_progress = now;
+    double sum = 0, min = 100;
+    size_t done = 0;
+    for(const auto& [name, percent] : progress_hosts) {
+      sum += percent;
+      min = std::min(min, percent);
+      if(percent >= 100)
+        done++;
+    }
+    std::cout << "\033[1mProgress: " << (int) (sum / progress_hosts.size()) << "% (" << done << "/" 
+      << progress_hosts.size() << " hosts done, slowest " << (int) min << "%)\033[0m" << std::endl;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+// Value under which there are p (0..1) of sorted values
+static double percentile(const std::vector<double> &sorted, double p)
+{
+  size_t index = std::min(sorted.size() - 1, (size_t) (p * sorted.size()));
+  return sorted[index];
+}
+
+void ScriptMetrics::report(std::ostream &out)
+{
+  pthread_mutex_lock(&mutex);
+  if(!metrics.empty()) {
+    out << "Metrics from scripts:" << std::endl;
+    out << std::left << std::setw(24) << "metric" << std::setw(8) << "unit" << std::right << std::setw(7) << "hosts" 
+      << std::setw(14) << "sum" << std::setw(12) << "min" << std::setw(12) << "p50" << std::setw(12) << "p90" 
+      << std::setw(12) << "max" << std::endl;
+    // Big counters (rows, bytes...) are shown without exponent
+    std::streamsize precision = out.precision(12);
+    for(const auto& [name, metric] : metrics) {
+      std::vector<double> values;
+      double sum = 0;
+      for(const auto& [host, value] : metric.hosts) {
+        values.push_back(value);
+        sum += value;
+      }
+      std::sort(values.begin(), values.end());
+      out << std::left << std::setw(24) << name.substr(0, 23) << std::setw(8) << metric.unit.substr(0, 7) << std::right 
+        << std::setw(7) << values.size() << std::setw(14) << sum << std::setw(12) << values.front()
+        << std::setw(12) << percentile(values, 0.5) << std::setw(12) << percentile(values, 0.9) 
+        << std::setw(12) << values.back() << std::endl;
+    }
+    out.precision(precision);
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,46 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __SCRIPTMETRICS_H__
+#define __SCRIPTMETRICS_H__
+
+#include <string>
+#include <ostream>
+
+/** Values sent by remote scripts with markers (see MarkerParser):
+ *
+ *  echo "##metric: rows_migrated 12000 rows"
+ *  echo "##progress: 45"
+ *
+ * The last value of every metric on every host is kept. At the end of a run, 
+ * the sum, min, p50, p90 and max of every metric over all hosts are printed.
+ * Progress of hosts is shown while the run goes on. Both are also exported 
+ * by Metrics.
+ */
+class ScriptMetrics
+{
+  public:
+    /** Reads "name value [unit]".
+     */
+    static void metric(std::string host, const std::string &text);
+    /** Reads a percentage (0-100).
+     */
+    static void progress(std::string host, const std::string &text);
+    static void report(std::ostream &out);
+};
+
+#endif
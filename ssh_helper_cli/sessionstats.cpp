@@ -0,0 +1,116 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "sessionstats.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+
+// Hosts with the most blocked time shown in the report
+static const size_t REPORT_HOSTS = 10;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, SshStats> hosts;
+
+void SshStats::readTcpInfo(int fd)
+{
+  struct tcp_info info = {};
+  socklen_t size = sizeof(info);
+  if(fd < 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) != 0)
+    return;
+  tcp_bytes_in = info.tcpi_bytes_received;
+  tcp_bytes_out = info.tcpi_bytes_acked;
+  packets_in = info.tcpi_segs_in;
+  packets_out = info.tcpi_segs_out;
+  retransmits = info.tcpi_total_retrans;
+  rtt_us = info.tcpi_rtt;
+}
+
+// Adds counters of stats to total. RTT is not added.
+static void add(SshStats &total, const SshStats &stats)
+{
+  total.channel_bytes_in += stats.channel_bytes_in;
+  total.channel_bytes_out += stats.channel_bytes_out;
+  total.tcp_bytes_in += stats.tcp_bytes_in;
+  total.tcp_bytes_out += stats.tcp_bytes_out;
+  total.packets_in += stats.packets_in;
+  total.packets_out += stats.packets_out;
+  total.retransmits += stats.retransmits;
+  total.channels += stats.channels;
+  total.execs += stats.execs;
+  total.read_blocked_us += stats.read_blocked_us;
+  total.write_blocked_us += stats.write_blocked_us;
+  total.connect_us += stats.connect_us;
+  total.auth_us += stats.auth_us;
+}
+
+void SessionStats::record(std::string host, const SshStats &stats)
+{
+  pthread_mutex_lock(&mutex);
+  // Sessions of the same host (reconnections) are added. RTT is the last one.
+  SshStats &total = hosts[host];
+  add(total, stats);
+  total.rtt_us = stats.rtt_us;
+  pthread_mutex_unlock(&mutex);
+}
+
+static void print_row(std::ostream &out, const std::string &host, const SshStats &stats)
+{
+  const double MB = 1024.0 * 1024.0;
+  out << std::left << std::setw(32) << host.substr(0, 31) << std::right
+    << std::setw(9) << stats.channel_bytes_in / MB << std::setw(9) << stats.channel_bytes_out / MB
+    << std::setw(9) << stats.tcp_bytes_in / MB << std::setw(9) << stats.tcp_bytes_out / MB
+    << std::setw(10) << stats.packets_in + stats.packets_out << std::setw(8) << stats.retransmits
+    << std::setw(7) << stats.execs << std::setw(9) << stats.channels
+    << std::setw(10) << stats.read_blocked_us / 1e6 << std::setw(10) << stats.write_blocked_us / 1e6
+    << std::setw(9) << stats.connect_us / 1e3 << std::setw(9) << stats.auth_us / 1e3 << std::setw(8) << stats.rtt_us / 1e3 << std::endl;
+}
+
+void SessionStats::report(std::ostream &out)
+{
+  pthread_mutex_lock(&mutex);
+  if(!hosts.empty()) {
+    std::vector<std::pair<std::string, SshStats> > sorted(hosts.begin(), hosts.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+      return a.second.read_blocked_us + a.second.write_blocked_us > b.second.read_blocked_us + b.second.write_blocked_us;
+    });
+    SshStats total;
+    for(const auto& [host, stats] : sorted) {
+      add(total, stats);
+      total.rtt_us = std::max(total.rtt_us, stats.rtt_us);
+    }
+    out << "SSH sessions (MB, blocked time in s, connect/auth/rtt in ms):" << std::endl;
+    out << std::left << std::setw(32) << "host" << std::right << std::setw(9) << "ch in" << std::setw(9) << "ch out"
+      << std::setw(9) << "tcp in" << std::setw(9) << "tcp out" << std::setw(10) << "packets" << std::setw(8) << "retrans"
+      << std::setw(7) << "execs" << std::setw(9) << "channels" << std::setw(10) << "read blk" << std::setw(10) << "write blk"
+      << std::setw(9) << "connect" << std::setw(9) << "auth" << std::setw(8) << "rtt" << std::endl;
+    out << std::fixed << std::setprecision(1);
+    for(size_t i = 0; i < sorted.size() && i < REPORT_HOSTS; i++)
+      print_row(out, sorted[i].first, sorted[i].second);
+    if(sorted.size() > REPORT_HOSTS)
+      out << "... " << sorted.size() - REPORT_HOSTS << " hosts more" << std::endl;
+    // RTT of the total is the highest one
+    print_row(out, "total (" + std::to_string(sorted.size()) + " hosts)", total);
+    out << std::defaultfloat;
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,62 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __SESSIONSTATS_H__
+#define __SESSIONSTATS_H__
+
+#include <cstdint>
+#include <string>
+#include <ostream>
+
+/** Counters of a SSH session. Channel counters are the payload of commands,
+ * transport counters are read from the kernel (TCP_INFO) and include SSH 
+ * framing, encryption and TCP retransmissions.
+ */
+struct SshStats
+{
+  uint64_t channel_bytes_in = 0, channel_bytes_out = 0;
+  uint64_t tcp_bytes_in = 0, tcp_bytes_out = 0;
+  uint64_t packets_in = 0, packets_out = 0, retransmits = 0;
+  uint64_t channels = 0, execs = 0;
+  // Time waiting for remote output and for the remote side to accept input
+  uint64_t read_blocked_us = 0, write_blocked_us = 0;
+  // ssh_connect (name resolution, TCP handshake and key exchange), authentication
+  uint64_t connect_us = 0, auth_us = 0;
+  // Smoothed RTT estimated by the kernel from the acknowledgements
+  uint64_t rtt_us = 0;
+
+  /** Reads transport counters of the socket fd.
+   */
+  void readTcpInfo(int fd);
+};
+
+/** Stats of all SSH sessions of a run, added per host. At the end of a run, 
+ * a summary is printed. A host which spends its time blocked on reads with 
+ * a low RTT is usually slow on the remote side (CPU or disk). High RTT, 
+ * retransmissions or write blocked time point to the network.
+ *
+ *  SessionStats::record("user@host", stats);
+ *  SessionStats::report(std::cout);
+ */
+class SessionStats
+{
+  public:
+    static void record(std::string host, const SshStats &stats);
+    static void report(std::ostream &out);
+};
+
+#endif
@@ -0,0 +1,523 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "simexecutor.h"
+#include "hashcache.h"
+#include "simpleexception.h"
+#include "string_utils.h"
+#include "remotecommands.h"
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <map>
+#include <regex>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+
+struct SimFile
+{
+  uintmax_t size;
+  std::string md5;
+  // Virtual time when the file was completed
+  uint64_t ready_us;
+};
+
+struct SimHost
+{
+  uint64_t clock_us = 0;
+  std::mt19937_64 random;
+  bool slow = false;
+  uint64_t operations = 0, failures = 0, bytes_sent = 0;
+  std::map<std::string /*path*/, SimFile> files;
+};
+
+// Hosts live for the whole run, so files and clock are kept when a host is reconnected
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, SimHost> hosts;
+
+// Time of the files reported by "stat"
+static const long long SIM_EPOCH = 1700000000;
+
+// "stat %.Y" output of a file written at clock_us
+static std::string sim_mtime(uintmax_t clock_us)
+{
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%lld.%06ju000", SIM_EPOCH + (long long)(clock_us / 1000000), clock_us % 1000000);
+  return std::string(buffer);
+}
+
+void SimProfile::parse(std::string spec)
+{
+  std::stringstream items(spec);
+  std::string item;
+  while(std::getline(items, item, ',')) {
+    std::string::size_type pos = item.find('=');
+    if(pos == std::string::npos)
+      throw(SimpleException("Error: wrong simulation value \"" + item + "\". It must be name=value."));
+    std::string name = strip(item.substr(0, pos));
+    std::stringstream value(item.substr(pos + 1));
+    bool ok;
+    if(name == "rtt")
+      ok = (bool) (value >> rtt_ms);
+    else if(name == "bw") {
+      ok = (bool) (value >> bandwidth);
+      bandwidth *= 1024;
+    } else if(name == "fail")
+      ok = (bool) (value >> failure_rate);
+    else if(name == "cmd")
+      ok = (bool) (value >> command_ms);
+    else if(name == "slow")
+      ok = (bool) (value >> slow_fraction);
+    else if(name == "factor")
+      ok = (bool) (value >> slow_factor) && slow_factor > 0;
+    else if(name == "seed")
+      ok = (bool) (value >> seed);
+    else
+      throw(SimpleException("Error: unknown simulation value \"" + name + "\"."));
+    if(!ok)
+      throw(SimpleException("Error: wrong simulation value \"" + item + "\"."));
+  }
+}
+
+// Output of commands is returned as a malloc'ed string, like SshPtr does
+static std::shared_ptr<char*> make_output(const std::string &text)
+{
+  return std::shared_ptr<char*>(new char*(strdup(text.c_str())), [](char **output) {
+    free(*output);
+    delete output;
+  });
+}
+
+SimExecutor::SimExecutor(std::string host, int port, const SimProfile &profile)
+{
+  (void) port;
+  this->host = host;
+  this->profile = profile;
+  connected = false;
+  public_key_auth = false;
+  pthread_mutex_lock(&mutex);
+  auto [it, added] = hosts.try_emplace(host);
+  SimHost &state = it->second;
+  if(added) {
+    state.random.seed(std::hash<std::string>()(host) ^ profile.seed);
+    state.slow = std::uniform_real_distribution<double>(0, 1)(state.random) < profile.slow_fraction;
+  }
+  if(state.slow) {
+    this->profile.rtt_ms *= profile.slow_factor;
+    this->profile.command_ms *= profile.slow_factor;
+    this->profile.bandwidth = profile.bandwidth > 0 ? std::max((uintmax_t) 1, profile.bandwidth / profile.slow_factor) : 0;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+uint64_t SimExecutor::rtt_us()
+{
+  return profile.rtt_ms * 1000;
+}
+
+uint64_t SimExecutor::transfer_us(uintmax_t size)
+{
+  if(profile.bandwidth == 0)
+    return 0;
+  return size * 1000000 / profile.bandwidth;
+}
+
+void SimExecutor::spend(uint64_t us)
+{
+  if(!connected)
+    throw(SshException("[SimExecutor]: " + host + " is not connected."));
+  pthread_mutex_lock(&mutex);
+  SimHost &state = hosts[host];
+  state.clock_us += us;
+  state.operations++;
+  bool failed = profile.failure_rate > 0 && std::uniform_real_distribution<double>(0, 1)(state.random) < profile.failure_rate;
+  if(failed)
+    state.failures++;
+  pthread_mutex_unlock(&mutex);
+  if(failed) {
+    connected = false;
+    throw(SshException("[SimExecutor]: " + host + " simulated connection loss."));
+  }
+}
+
+bool SimExecutor::connect(std::string user, std::string password, bool public_key)
+{
+  (void) password;
+  this->user = user;
+  // TCP handshake, key exchange and authentication
+  connected = true;
+  try {
+    spend(3 * rtt_us());
+  } catch(SshException &) {
+    return false;
+  }
+  public_key_auth = public_key;
+  return true;
+}
+
+// Commands of RemoteCommands run on the files table of the host
+enum SimCommand {
+  SIM_OTHER, SIM_PROBE, SIM_COPY, SIM_RELAY, SIM_STAT_MD5, SIM_STAT, SIM_TEST, SIM_RM
+};
+
+static const std::regex probe_regex("f='([^']*)'; \\[ -f");
+static const std::regex copy_regex("(?:cp --reflink=auto|cat|ln -f|mv -f) '([^']*)'(?: \\| tee)? '([^']*)'");
+static const std::regex relay_regex("scp[^']* '[^@']*@([^:']*):([^']*)' '([^']*)'");
+static const std::regex stat_md5_regex("stat -c '%s %\\.Y' '([^']*)'.* = '([^']*)' \\] \\|\\| md5sum -b");
+static const std::regex stat_regex("stat (?:-L )?-c (%s|'%s %\\.Y') '([^']*)'");
+static const std::regex test_regex("test -f '([^']*)'");
+static const std::regex rm_regex("rm -f '([^']*)'");
+
+// Finds the RemoteCommands command. match has its paths.
+static SimCommand sim_command(const std::string &command, std::smatch &match)
+{
+  if(std::regex_search(command, match, probe_regex))
+    return SIM_PROBE;
+  if(std::regex_search(command, match, copy_regex))
+    return SIM_COPY;
+  if(std::regex_search(command, match, relay_regex))
+    return SIM_RELAY;
+  if(std::regex_search(command, match, stat_md5_regex))
+    return SIM_STAT_MD5;
+  if(std::regex_search(command, match, stat_regex))
+    return SIM_STAT;
+  if(std::regex_search(command, match, test_regex))
+    return SIM_TEST;
+  if(std::regex_search(command, match, rm_regex))
+    return SIM_RM;
+  return SIM_OTHER;
+}
+
+// Output of the bootstrap script on a simulated host: its status line with the
+// values of the host. Compressors are not used, every byte is sent.
+static std::string sim_bootstrap(const std::string &script, const std::string &user)
+{
+  std::stringstream lines(script);
+  std::string line, key, status;
+  while(std::getline(lines, line)) {
+    if(line.starts_with("key="))
+      key = line.substr(4);
+    else if(line.starts_with("echo \"##bootstrap: ok ") && line.ends_with("\""))
+      status = line.substr(6, line.size() - 7);
+  }
+  if(status.empty())
+    return "";
+  std::vector<std::tuple<std::string, std::string>> values = {
+    {"$k", key.empty() || key == "''" ? "skipped" : "added"}, {"$z", "no"}, {"$l", "no"}, {"$HOME", "/home/" + user}
+  };
+  for(const auto& [name, value] : values) {
+    std::string::size_type pos = status.find(name);
+    if(pos != std::string::npos)
+      status.replace(pos, name.size(), value);
+  }
+  return status + "\n";
+}
+
+void SimExecutor::checkCommands()
+{
+  const std::string path = "/home/user/.local/share/ssh_helper_temp/id/etc/file.conf";
+  const std::string dest = "/etc/file.conf";
+  const std::string known_stat = "1024 1700000000.250000000";
+  std::vector<std::tuple<std::string /*command*/, SimCommand, std::vector<std::string> /*matches*/>> checks = {
+    {RemoteCommands::partialProbe(path), SIM_PROBE, {path}},
+    {RemoteCommands::movePartial(path, dest), SIM_COPY, {path, dest}},
+    {RemoteCommands::copy(path, "/etc", dest, "", false), SIM_COPY, {path, dest}},
+    {RemoteCommands::copy(path, "/etc", dest, " && chown root '" + dest + "'", true), SIM_COPY, {path, dest}},
+    {RemoteCommands::addToCache(path, "/home/user/cache", "/home/user/cache/md5"), SIM_COPY, {path, "/home/user/cache/md5"}},
+    {RemoteCommands::relay("/tmp/askpass.py", " -l 80", "user@seed:" + path, dest), SIM_RELAY, {"seed", path, dest}},
+    {RemoteCommands::statMd5(dest, known_stat), SIM_STAT_MD5, {dest, known_stat}},
+    {RemoteCommands::stat(dest), SIM_STAT, {"'%s %.Y'", dest}},
+    {RemoteCommands::fileSize(dest), SIM_STAT, {"%s", dest}},
+    {RemoteCommands::cacheHit(path), SIM_TEST, {path}},
+    {RemoteCommands::remove(path), SIM_RM, {path}}
+  };
+  for(const auto& [command, type, values] : checks) {
+    std::smatch match;
+    bool ok = sim_command(command, match) == type && match.size() == values.size() + 1;
+    for(size_t i = 0; ok && i < values.size(); i++)
+      ok = match[i + 1] == values[i];
+    if(!ok)
+      throw(SimpleException("Error: SimExecutor does not recognize the command: " + command));
+  }
+  if(!sim_bootstrap(RemoteCommands::bootstrap(path, "ssh-rsa AAAA user@manager"), "user").starts_with("##bootstrap: ok key=added "))
+    throw(SimpleException("Error: SimExecutor does not recognize the bootstrap script."));
+}
+
+std::tuple<int /*status*/, std::string /*output*/> SimExecutor::run(std::string command, uintmax_t stdin_size)
+{
+  spend(rtt_us() + profile.command_ms * 1000 + transfer_us(stdin_size));
+
+  std::smatch match;
+  int rc = 0;
+  std::string output;
+
+  pthread_mutex_lock(&mutex);
+  SimHost &state = hosts[host];
+  std::map<std::string, SimFile> &files = state.files;
+  switch(sim_command(command, match)) {
+    case SIM_PROBE: {
+      auto it = files.find(match[1]);
+      if(it != files.end())
+        output = std::to_string(it->second.size) + "\n" + it->second.md5 + " *" + it->first + "\n";
+      else
+        rc = 1;
+      break;
+    }
+    case SIM_COPY: {
+      auto it = files.find(match[1]);
+      if(it != files.end()) {
+        SimFile file = it->second;
+        file.ready_us = state.clock_us;
+        if(command.find("mv -f") != std::string::npos)
+          files.erase(it);
+        files[match[2]] = file;
+        if(command.find("md5sum -b") != std::string::npos)
+          output = file.md5 + " *-\n";
+      } else
+        rc = 1;
+      break;
+    }
+    case SIM_RELAY: {
+      // The file is copied from the seed host as soon as both have it
+      auto seed = hosts.find(match[1]);
+      if(seed != hosts.end() && seed->second.files.contains(match[2])) {
+        SimFile file = seed->second.files[match[2]];
+        state.clock_us = std::max(state.clock_us, file.ready_us) + rtt_us() + transfer_us(file.size);
+        state.bytes_sent += file.size;
+        file.ready_us = state.clock_us;
+        files[match[3]] = file;
+      } else
+        rc = 1;
+      break;
+    }
+    case SIM_STAT_MD5: {
+      // md5sum is only run if size and mtime are not the known ones
+      auto it = files.find(match[1]);
+      if(it != files.end()) {
+        std::string stat = std::to_string(it->second.size) + " " + sim_mtime(it->second.ready_us);
+        output = stat + "\n";
+        if(stat != match[2])
+          output += it->second.md5 + " *" + it->first + "\n";
+      } else
+        rc = 1;
+      break;
+    }
+    case SIM_STAT: {
+      auto it = files.find(match[2]);
+      if(it != files.end()) {
+        output = std::to_string(it->second.size);
+        if(match[1] != "%s")
+          output += " " + sim_mtime(it->second.ready_us);
+        output += "\n";
+      } else
+        rc = 1;
+      break;
+    }
+    case SIM_TEST:
+      rc = files.contains(match[1]) ? 0 : 1;
+      break;
+    case SIM_RM:
+      files.erase(match[1]);
+      break;
+    case SIM_OTHER:
+      break;
+  }
+  pthread_mutex_unlock(&mutex);
+  return std::make_tuple(rc, output);
+}
+
+std::tuple<int /*status*/, std::string /*log*/> SimExecutor::exec(std::string command)
+{
+  int rc;
+  std::string output;
+  std::tie(rc, output) = run(command, 0);
+  return std::make_tuple(rc, std::string());
+}
+
+std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> SimExecutor::exec_get_output(std::string command)
+{
+  int rc;
+  std::string output;
+  std::tie(rc, output) = run(command, 0);
+  return std::make_tuple(rc, make_output(output), std::string());
+}
+
+std::tuple<int /*status*/, std::string /*log*/> SimExecutor::exec(std::string command, std::string stdin_string)
+{
+  int rc;
+  std::string output;
+  std::tie(rc, output) = run(command, stdin_string.size());
+  return std::make_tuple(rc, std::string());
+}
+
+std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> SimExecutor::exec_get_output(std::string command, std::string stdin_string)
+{
+  int rc;
+  std::string output;
+  std::tie(rc, output) = run(command, stdin_string.size());
+  if(command == "sh -s") {
+    // ClientThread::bootstrap
+    output = sim_bootstrap(stdin_string, user);
+    rc = output.empty() ? 1 : 0;
+  }
+  return std::make_tuple(rc, make_output(output), std::string());
+}
+
+std::tuple<int /*status*/, std::string /*log*/> SimExecutor::exec_sudo(std::string command)
+{
+  return exec(command);
+}
+
+std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> SimExecutor::exec_sudo_get_output(std::string command)
+{
+  return exec_get_output(command);
+}
+
+std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> SimExecutor::exec_write_get_output(std::string command, SshDataSource source, bool sudo)
+{
+  (void) sudo;
+  // Data is read to know its size
+  std::vector<char> buffer(64 * 1024);
+  uintmax_t size = 0;
+  size_t nbytes;
+  while((nbytes = source(buffer.data(), buffer.size())) > 0)
+    size += nbytes;
+  int rc;
+  std::string output;
+  std::tie(rc, output) = run(command, size);
+  return std::make_tuple(rc, make_output(output), std::string());
+}
+
+std::tuple<int /*status*/, std::string /*log*/> SimExecutor::exec_read(std::string command, SshDataSink sink, bool sudo)
+{
+  (void) sink;
+  (void) sudo;
+  spend(rtt_us());
+  return std::make_tuple(1, "[SimExecutor]: downloads are not simulated (" + command + ").");
+}
+
+std::tuple<int /*status*/, std::string /*log*/> SimExecutor::exec_read(std::vector<std::string> commands, std::vector<SshDataSink> sinks, bool sudo)
+{
+  (void) sinks;
+  (void) sudo;
+  spend(rtt_us());
+  return std::make_tuple(1, "[SimExecutor]: downloads are not simulated (" + std::to_string(commands.size()) + " commands).");
+}
+
+void SimExecutor::scp_write(std::string filepath, std::string dest)
+{
+  std::tuple<std::string, std::string> md5s = stream_write(filepath, dest);
+  (void) md5s;
+}
+
+std::tuple<std::string /*local md5*/, std::string /*remote md5*/> SimExecutor::stream_write(std::string filepath, std::string dest, CompressType compress, uintmax_t offset, std::string prefix_md5)
+{
+  (void) compress;
+  std::error_code error;
+  uintmax_t size = std::filesystem::file_size(filepath, error);
+  if(error)
+    throw(SshException("[SimExecutor::stream_write]: " + filepath + " cannot be read."));
+  // Digests of unchanged files are not computed again
+  std::string md5 = HashCache::file(filepath);
+  // A resumed transfer only sends the rest of the file. The prefix is not 
+  // checked: files of the simulated hosts are always complete.
+  if(offset > size || prefix_md5.empty())
+    offset = 0;
+  spend(rtt_us() + profile.command_ms * 1000 + transfer_us(size - offset));
+  pthread_mutex_lock(&mutex);
+  SimHost &state = hosts[host];
+  state.bytes_sent += size - offset;
+  state.files[dest] = SimFile{size, md5, state.clock_us};
+  pthread_mutex_unlock(&mutex);
+  return std::make_tuple(md5, md5);
+}
+
+void SimExecutor::delay(unsigned seconds)
+{
+  // The session may be lost, so failures are not injected
+  pthread_mutex_lock(&mutex);
+  hosts[host].clock_us += seconds * (uint64_t) 1000000;
+  pthread_mutex_unlock(&mutex);
+}
+
+uint64_t SimExecutor::clock()
+{
+  pthread_mutex_lock(&mutex);
+  uint64_t clock_us = hosts[host].clock_us;
+  pthread_mutex_unlock(&mutex);
+  return clock_us;
+}
+
+void SimExecutor::waitUntil(uint64_t clock_us)
+{
+  pthread_mutex_lock(&mutex);
+  SimHost &state = hosts[host];
+  state.clock_us = std::max(state.clock_us, clock_us);
+  pthread_mutex_unlock(&mutex);
+}
+
+void SimExecutor::ssh_write_to_file(std::string content, std::string dest)
+{
+  spend(rtt_us() + transfer_us(content.size()));
+  Hash md5;
+  md5.update(content.data(), content.size());
+  pthread_mutex_lock(&mutex);
+  SimHost &state = hosts[host];
+  state.bytes_sent += content.size();
+  state.files[dest] = SimFile{content.size(), md5.final(), state.clock_us};
+  pthread_mutex_unlock(&mutex);
+}
+
+// Value under which there are p (0..1) of sorted values
+static double percentile(const std::vector<double> &sorted, double p)
+{
+  size_t index = std::min(sorted.size() - 1, (size_t) (p * sorted.size()));
+  return sorted[index];
+}
+
+void SimExecutor::report(std::ostream &out)
+{
+  pthread_mutex_lock(&mutex);
+  if(!hosts.empty()) {
+    std::vector<double> times;
+    uint64_t operations = 0, failures = 0, bytes_sent = 0;
+    size_t slow = 0;
+    for(const auto& [name, state] : hosts) {
+      times.push_back(state.clock_us / 1e6);
+      operations += state.operations;
+      failures += state.failures;
+      bytes_sent += state.bytes_sent;
+      if(state.slow)
+        slow++;
+    }
+    std::sort(times.begin(), times.end());
+    std::ios_base::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision(2);
+    out << std::fixed;
+    out << "Simulation: " << hosts.size() << " hosts (" << slow << " slow), virtual makespan " << times.back() 
+      << " s, p50 " << percentile(times, 0.5) << " s, p90 " << percentile(times, 0.9) << " s" << std::endl;
+    out << "Simulation: " << operations << " operations, " << bytes_sent / (1024 * 1024) << " MB sent, " 
+      << failures << " injected failures" << std::endl;
+    out.precision(precision);
+    out.flags(flags);
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,136 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __SIMEXECUTOR_H__
+#define __SIMEXECUTOR_H__
+
+#include "executor.h"
+#include <cstdint>
+#include <string>
+#include <ostream>
+#include <random>
+
+/** Network and hosts of a simulation. 
+ */
+struct SimProfile
+{
+  double rtt_ms = 50;
+  // Bytes/s of every host, 0 is no limit
+  uintmax_t bandwidth = 10 * 1024 * 1024;
+  // Probability (0..1) of losing the connection on every operation
+  double failure_rate = 0;
+  double command_ms = 20;
+  // Fraction (0..1) of hosts with slow_factor times the RTT and command time 
+  // and 1/slow_factor of the bandwidth
+  double slow_fraction = 0;
+  unsigned slow_factor = 10;
+  unsigned seed = 1;
+
+  /** Reads "rtt=50,bw=10240,fail=0.01,cmd=20,slow=0.1,factor=10,seed=1". 
+   * bw is in KB/s. Missing values are not changed.
+   * Throws SimpleException if spec is wrong.
+   */
+  void parse(std::string spec);
+};
+
+/** Executor of a simulated host. Nothing is sent: every operation adds its cost 
+ * (RTT, transfer time and command time) to a virtual clock of the host, so 
+ * thousands of hosts can be run in seconds. Slow hosts and failures of a host
+ * are drawn from a random generator seeded with its name and the seed, so they
+ * are the same in every run.
+ *
+ * Hosts keep a table of their files (path, size, md5), so uploads, remote cache,
+ * P2P relays between hosts and "stat"/"md5sum" checks of the next uploads behave 
+ * as on real hosts. These commands are built by RemoteCommands, checkCommands()
+ * verifies that they are recognized. The status line of the bootstrap script 
+ * is printed with the values of the host. Other commands are successful and 
+ * have no output. Downloads are not simulated.
+ *
+ * Hosts still run in a thread each (ClientThread), so the simulation is 
+ * limited by the number of threads of the system. Waits between hosts (monitor 
+ * lock and P2P seeds) follow the real order of the threads: the waiting host 
+ * gets the clock of the releasing one if it is later, but a host which is 
+ * earlier in virtual time can get a lock or a seed after a later one. 
+ * Bandwidth limits of sites are not simulated.
+ *
+ *  threadSharedData->new_executor = [profile](std::string host, int port) {
+ *    return std::make_shared<SimExecutor>(host, port, profile);
+ *  };
+ *  ...
+ *  SimExecutor::report(std::cout);
+ */
+class SimExecutor : public Executor {
+  public:
+    SimExecutor(std::string host, int port, const SimProfile &profile);
+
+    [[nodiscard]] bool connect(std::string user, std::string password, bool public_key = false) override;
+    inline bool isPublicKeyAuth() override {return public_key_auth;}
+    [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
+      exec(std::string command) override;
+    [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
+      exec_get_output(std::string command) override;
+    [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
+      exec(std::string command, std::string stdin_string) override;
+    [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
+      exec_get_output(std::string command, std::string stdin_string) override;
+    [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
+      exec_sudo(std::string command) override;
+    [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
+      exec_sudo_get_output(std::string command) override;
+    [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
+      exec_write_get_output(std::string command, SshDataSource source, bool sudo = false) override;
+    [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
+      exec_read(std::string command, SshDataSink sink, bool sudo = false) override;
+    [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
+      exec_read(std::vector<std::string> commands, std::vector<SshDataSink> sinks, bool sudo = false) override;
+    void scp_write(std::string filepath, std::string dest) override;
+    [[nodiscard]] std::tuple<std::string /*local md5*/, std::string /*remote md5*/> 
+      stream_write(std::string filepath, std::string dest, CompressType compress = COMPRESS_NONE, uintmax_t offset = 0, std::string prefix_md5 = "") override;
+    void ssh_write_to_file(std::string content, std::string dest) override;
+    inline void setBandwidthLimiter(std::shared_ptr<BandwidthLimiter>, std::string) override {}
+    inline void setMarkerHandler(MarkerHandler) override {}
+    /** Adds seconds to the clock of the host.*/
+    void delay(unsigned seconds) override;
+    uint64_t clock() override;
+    /** The clock of the host is moved forward to clock_us.*/
+    void waitUntil(uint64_t clock_us) override;
+
+    /** Prints the virtual time of hosts (makespan is the time of the slowest one), 
+     * operations, sent bytes and injected failures.
+     */
+    static void report(std::ostream &out);
+    /** Throws SimpleException if a command of RemoteCommands is not recognized 
+     * by the simulator. 
+     */
+    static void checkCommands();
+
+  private:
+    // Runs command on the files table of the host. Adds its cost to the clock.
+    std::tuple<int /*status*/, std::string /*output*/> run(std::string command, uintmax_t stdin_size);
+    // Adds us to the clock of the host and injects failures
+    void spend(uint64_t us);
+    // Microseconds to send size bytes
+    uint64_t transfer_us(uintmax_t size);
+    uint64_t rtt_us();
+
+    std::string host, user;
+    SimProfile profile;
+    bool connected;
+    bool public_key_auth;
+};
+
+#endif
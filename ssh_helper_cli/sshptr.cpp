@@ -18,11 +18,21 @@
 
 #include "sshptr.h"
 #include "string_utils.h"
+#include "hash.h"
+#include "compressor.h"
+#include "simpleexception.h"
+#include "timeline.h"
+#include "metrics.h"
+#include "tracing.h"
+#include "markerparser.h"
 #include <errno.h>
 #include <string.h>
 #include <filesystem>
 #include <sys/stat.h>
 #include <iostream>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
 
 SshException::SshException(std::string error)
 {
@@ -35,6 +45,25 @@ const char *SshException::what()
   return error.c_str();
 }
 
+// Authenticates with the manager key (~/.ssh/id_rsa, see Manager::readPublicKey) only.
+// Keys of the agent are not offered, they would count against MaxAuthTries of the host.
+static int manager_key_auth(ssh_session session, std::string user)
+{
+  char *home = getenv("HOME");
+  if(home == NULL)
+    return SSH_AUTH_DENIED;
+  std::string key_file = std::string(home) + "/.ssh/id_rsa";
+  ssh_key key = NULL;
+  if(ssh_pki_import_privkey_file(key_file.c_str(), NULL, NULL, NULL, &key) != SSH_OK)
+    return SSH_AUTH_DENIED;
+  // The key is only signed if the host accepts it
+  int rc = ssh_userauth_try_publickey(session, user.c_str(), key);
+  if(rc == SSH_AUTH_SUCCESS)
+    rc = ssh_userauth_publickey(session, user.c_str(), key);
+  ssh_key_free(key);
+  return rc;
+}
+
 static int verify_knownhost(ssh_session session)
 {
     enum ssh_known_hosts_e state;
@@ -110,9 +139,22 @@ static int verify_knownhost(ssh_session session)
     return 0;
 }
 
+// Set by setKnownHostsFile. Empty is the libssh default.
+static std::string known_hosts_file;
+
+void SshPtr::setKnownHostsFile(std::string path)
+{
+  known_hosts_file = path;
+}
+
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
 
 SshPtr::SshPtr(std::string host, int port) {
   connected = false;
+  public_key_auth = false;
   session = ssh_new();
   this->port = port;
   this->host = host;
@@ -125,31 +167,54 @@ SshPtr::SshPtr(std::string host, int port) {
   ssh_options_set(session, SSH_OPTIONS_HOST, this->host.c_str());
   ssh_options_set(session, SSH_OPTIONS_LOG_VERBOSITY, &verbosity);
   ssh_options_set(session, SSH_OPTIONS_PORT, &(this->port));
+  if(!known_hosts_file.empty())
+    ssh_options_set(session, SSH_OPTIONS_KNOWNHOSTS, known_hosts_file.c_str());
 }
 
 
 SshPtr::~SshPtr() {
-  if(connected)
+  if(connected) {
+    SessionStats::record(user + "@" + host, getStats());
     ssh_disconnect(session);
+    Metrics::add("ssh_helper_hosts_connected", -1);
+  }
   ssh_free(session);
   printf("SSH session to %s finished.\n", host.c_str());
 }
 
 
-[[nodiscard]] bool SshPtr::connect(std::string user, std::string password) {
-  int rc = ssh_connect(session);
-  connected = rc == SSH_OK;
-  if(!connected) {
-    fprintf(stderr, "Error connecting to host: %s\n", ssh_get_error(session));
-    return false;
+[[nodiscard]] bool SshPtr::connect(std::string user, std::string password, bool public_key) {
+  int rc;
+  auto start = std::chrono::steady_clock::now();
+  {
+    TimelineSpan span("connect", "ssh", host);
+    rc = ssh_connect(session);
+    stats.connect_us += elapsed_us(start);
+    connected = rc == SSH_OK;
+    if(!connected) {
+      TRACE_INSTANT("connect failed", "ssh", host);
+      fprintf(stderr, "Error connecting to host: %s\n", ssh_get_error(session));
+      return false;
+    }
+    if (verify_knownhost(session) < 0) {
+      ssh_disconnect(session);
+      connected = false;
+      return connected;
+    }
   }
-  if (verify_knownhost(session) < 0) {
-    ssh_disconnect(session);
-    connected = false;
-    return connected;
+  TimelineSpan span("auth", "ssh", public_key ? "publickey, password" : "password");
+  start = std::chrono::steady_clock::now();
+  rc = SSH_AUTH_DENIED;
+  public_key_auth = false;
+  if(public_key) {
+    rc = manager_key_auth(session, user);
+    public_key_auth = rc == SSH_AUTH_SUCCESS;
   }
-  rc = ssh_userauth_password(session, user.c_str(), password.c_str());
+  if(rc != SSH_AUTH_SUCCESS)
+    rc = ssh_userauth_password(session, user.c_str(), password.c_str());
+  stats.auth_us += elapsed_us(start);
   if (rc != SSH_AUTH_SUCCESS) {
+    TRACE_INSTANT("auth failed", "ssh", host);
     fprintf(stderr, "Error authenticating with password: %s\n", ssh_get_error(session));
     ssh_disconnect(session);
     connected = false;
@@ -158,16 +223,92 @@ SshPtr::~SshPtr() {
   if(connected) {
     this->user = user;
     this->password = password;
+    Metrics::add("ssh_helper_hosts_connected", 1);
   }
   return connected;
 }
 
-enum LogState {
-  NONE, LOG_SHARP1, LOG_SHARP2, LOG_L, LOG_O, LOG_G, LOG_COLON
+SshStats SshPtr::getStats()
+{
+  if(connected)
+    stats.readTcpInfo(ssh_get_fd(session));
+  return stats;
+}
+
+int SshPtr::channel_write(ssh_channel channel, const void *data, size_t size)
+{
+  auto start = std::chrono::steady_clock::now();
+  int nbytes = ssh_channel_write(channel, data, size);
+  stats.write_blocked_us += elapsed_us(start);
+  if(nbytes > 0)
+    stats.channel_bytes_out += nbytes;
+  return nbytes;
+}
+
+int SshPtr::channel_read(ssh_channel channel, char *buffer, size_t size)
+{
+  auto start = std::chrono::steady_clock::now();
+  int nbytes = ssh_channel_read_timeout(channel, buffer, size, 0, -1);
+  stats.read_blocked_us += elapsed_us(start);
+  if(nbytes > 0)
+    stats.channel_bytes_in += nbytes;
+  return nbytes;
+}
+
+int SshPtr::scp_write_data(ssh_scp scp, const void *data, size_t size)
+{
+  auto start = std::chrono::steady_clock::now();
+  int rc = ssh_scp_write(scp, data, size);
+  stats.write_blocked_us += elapsed_us(start);
+  if(rc == SSH_OK)
+    stats.channel_bytes_out += size;
+  return rc;
+}
+
+// Size of blocks written to stdin of remote commands
+static const size_t SOURCE_BUFFER_SIZE = 64 * 1024;
+
+// sudo for commands whose stdin is data (uploads) or may be read (downloads).
+// The password line is read by the shell and only given to "sudo -S true", so 
+// it never reaches command, even if sudo does not ask for it (NOPASSWD or 
+// cached credentials). Both sudo are children of the same shell, so the
+// credentials of the first one are valid for "sudo -n".
+static std::string sudo_stream_command(const std::string &command)
+{
+  std::string script = "IFS= read -r p; printf '%s\\n' \"$p\" | sudo -Sp '' true && sudo -n " + command;
+  std::string quoted;
+  for(char ch : script) {
+    if(ch == '\'')
+      quoted += "'\\''";
+    else
+      quoted += ch;
+  }
+  return "bash -c '" + quoted + "'";
+}
+
+// Counts the open channels of a command in ssh_helper_active_channels
+class ChannelGauge
+{
+  public:
+    ~ChannelGauge() {
+      if(open_channels > 0)
+        Metrics::add("ssh_helper_active_channels", -open_channels);
+    }
+    void open() {
+      open_channels++;
+      Metrics::add("ssh_helper_active_channels", 1);
+    }
+    void close() {
+      open_channels--;
+      Metrics::add("ssh_helper_active_channels", -1);
+    }
+  private:
+    int open_channels = 0;
 };
 
-[[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> SshPtr::exec_sudo_get_output(std::string command, bool sudo, bool output_to_stdout, std::string stdin_string)
+[[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> SshPtr::exec_sudo_get_output(std::string command, bool sudo, bool output_to_stdout, std::string stdin_string, SshDataSource source)
 {
+  TimelineSpan span(sudo ? "sudo exec" : "exec", "ssh", command);
   ssh_channel channel;
   int rc;
   char buffer[1024];
@@ -175,7 +316,14 @@ enum LogState {
   char *output = (char *) malloc(sizeof(char));
   *output = '\0';
   std::string log;
-  LogState state = LogState::NONE;
+  // "##log:" lines are the log. All markers also go to marker_handler.
+  MarkerParser markers([this, &log](MarkerType type, const std::string &text) {
+    if(type == MarkerType::LOG)
+      log += text;
+    if(marker_handler)
+      marker_handler(type, text);
+  });
+  ChannelGauge gauge;
  
   channel = ssh_channel_new(session);
   if (channel == NULL)
@@ -186,12 +334,15 @@ enum LogState {
     ssh_channel_free(channel);
     throw(SshException(std::string("Error: Channel cannot be opened.")));
   }
+  gauge.open();
+  stats.channels++;
  
   if(sudo)
-    command = "sudo -Sp '' " + command;
+    command = source ? sudo_stream_command(command) : "sudo -Sp '' " + command;
 
   std::cout << "\033[34m" << user << "@" << host << ": \033[1;32m" << command << "\033[0m" << std::endl;
   rc = ssh_channel_request_exec(channel, command.c_str());
+  stats.execs++;
   if (rc != SSH_OK) {
     ssh_channel_close(channel);
     ssh_channel_free(channel);
@@ -200,60 +351,48 @@ enum LogState {
 
   if(sudo) {
     std::string pass = password + "\n";
-    ssh_channel_write(channel, pass.c_str(), strlen(pass.c_str()));
+    channel_write(channel, pass.c_str(), strlen(pass.c_str()));
   }
   
   if(! stdin_string.empty()) {
-    ssh_channel_write(channel, stdin_string.c_str(), strlen(stdin_string.c_str()));
+    channel_write(channel, stdin_string.c_str(), strlen(stdin_string.c_str()));
+    // Commands reading stdin until EOF ("sh -s") would wait forever
+    if(!source)
+      ssh_channel_send_eof(channel);
   }
 
-  nbytes = ssh_channel_read_timeout(channel, buffer, sizeof(buffer), 0, -1);
-  while (nbytes > 0) {
-    // Read log
-    for(int i = 0; i < nbytes; i++) {
-      char ch = buffer[i];
-      switch(state) {
-        case LogState::NONE:
-          if(ch == '#')
-            state = LogState::LOG_SHARP1;
-          break;
-        case LogState::LOG_SHARP1:
-          if(ch == '#')
-            state = LogState::LOG_SHARP2;
-          else
-            state = LogState::NONE;
-          break;
-        case LogState::LOG_SHARP2:
-          if(ch == 'l')
-            state = LogState::LOG_L;
-          else
-            state = LogState::NONE;
-          break;
-        case LogState::LOG_L:
-          if(ch == 'o')
-            state = LogState::LOG_O;
-          else
-            state = LogState::NONE;
-          break;
-        case LogState::LOG_O:
-          if(ch == 'g')
-            state = LogState::LOG_G;
-          else
-            state = LogState::NONE;
-          break;
-        case LogState::LOG_G:
-          if(ch == ':')
-            state = LogState::LOG_COLON;
-          else
-            state = LogState::NONE;
-          break;
-        case LogState::LOG_COLON:
-          log += ch;
-          if(ch == '\n')
-            state = LogState::NONE;
-          break;
+  if(source) {
+    std::unique_ptr<char[]> data(new char[SOURCE_BUFFER_SIZE]);
+    size_t size;
+    // Sources (TarWriter, Compressor...) throw SimpleException on errors
+    auto read_source = [&]() -> size_t {
+      try {
+        return source(data.get(), SOURCE_BUFFER_SIZE);
+      } catch(...) {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        free(output);
+        throw;
+      }
+    };
+    while((size = read_source()) > 0) {
+      if(limiter) {
+        TRACE_ZONE("bandwidth wait", "ssh");
+        limiter->acquire(site, size);
+      }
+      Metrics::add("ssh_helper_uploaded_bytes_total", size);
+      if(channel_write(channel, data.get(), size) != (int) size) {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        throw(SshException(std::string("Error: Input of command '") + command + "' cannot be written."));
       }
     }
+    ssh_channel_send_eof(channel);
+  }
+
+  nbytes = channel_read(channel, buffer, sizeof(buffer));
+  while (nbytes > 0) {
+    markers.parse(buffer, nbytes);
     // Write output to stdout or output
     len += nbytes;
     if(output_to_stdout) {
@@ -269,11 +408,13 @@ enum LogState {
         ssh_channel_free(channel);
         throw(SshException(std::string("Error: Output from command '") + command + "' cannot be read. 2"));
       } else {
-        strncat(output, buffer, nbytes);
+        // Append without scanning output again (strncat is O(len) per read)
+        memcpy(output + len - 1 - nbytes, buffer, nbytes);
+        output[len - 1] = '\0';
       }
     }
     if(!ssh_channel_is_eof(channel) || !ssh_channel_is_closed(channel))
-      nbytes = ssh_channel_read_timeout(channel, buffer, sizeof(buffer), 0, -1);
+      nbytes = channel_read(channel, buffer, sizeof(buffer));
     else
       nbytes = 0;
   }
@@ -285,6 +426,7 @@ enum LogState {
     throw(SshException(std::string("Error: Output from command '") + command + "' cannot be read. 3"));
   }
 #endif
+  markers.finish();
   ssh_channel_send_eof(channel);
   ssh_channel_close(channel);
   int status = ssh_channel_get_exit_status(channel);
@@ -322,6 +464,157 @@ enum LogState {
   return exec_sudo_get_output(command, false, false, stdin_string);
 }
 
+[[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> SshPtr::exec_write_get_output(std::string command, SshDataSource source, bool sudo) // throw(SshException);
+{
+  if(sudo) {
+    int status;
+    std::shared_ptr<char*> output;
+    std::string log;
+    // Check if user is a sudoers
+    std::tie(status, output, log) = exec_sudo_get_output("echo Ok", true, false);
+    log = *output;
+    if(strip(log) != "Ok") { // User is not a sudoer
+      status = -1;
+      log = "Error: " + user + "@" + host + " is not in sudoers.";
+      return std::make_tuple(status, output, log);
+    }
+  }
+  return exec_sudo_get_output(command, sudo, false, "", source);
+}
+
+[[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> SshPtr::exec_read(std::string command, SshDataSink sink, bool sudo) // throw(SshException);
+{
+  return exec_read(std::vector<std::string>{command}, std::vector<SshDataSink>{sink}, sudo);
+}
+
+[[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> SshPtr::exec_read(std::vector<std::string> commands, std::vector<SshDataSink> sinks, bool sudo) // throw(SshException);
+{
+  int status = 0;
+  std::string log;
+  if(sudo) {
+    std::shared_ptr<char*> output;
+    // Check if user is a sudoers
+    std::tie(status, output, log) = exec_sudo_get_output("echo Ok", true, false);
+    if(strip(*output) != "Ok") { // User is not a sudoer
+      status = -1;
+      log = "Error: " + user + "@" + host + " is not in sudoers.";
+      return std::make_tuple(status, log);
+    }
+    status = 0;
+    log.clear();
+  }
+
+  std::string detail;
+  for(size_t i = 0; TimelineSpan::isEnabled() && i < commands.size(); i++)
+    detail += commands[i] + "\n";
+  TimelineSpan span(commands.size() > 1 ? "exec " + std::to_string(commands.size()) + " channels" : "exec", "ssh", detail);
+  std::vector<ssh_channel> channels;
+  ChannelGauge gauge;
+  auto close_channels = [&channels]() {
+    for(ssh_channel channel : channels) {
+      if(channel != NULL) {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+      }
+    }
+  };
+  for(std::string command : commands) {
+    if(sudo)
+      command = sudo_stream_command(command);
+    ssh_channel channel = ssh_channel_new(session);
+    if (channel == NULL) {
+      close_channels();
+      throw(SshException(std::string("Error: Channel cannot be opened.")));
+    }
+    if (ssh_channel_open_session(channel) != SSH_OK) {
+      ssh_channel_free(channel);
+      close_channels();
+      throw(SshException(std::string("Error: Channel cannot be opened.")));
+    }
+    channels.push_back(channel);
+    gauge.open();
+    stats.channels++;
+    TRACE_COUNTER("open channels", channels.size());
+    std::cout << "\033[34m" << user << "@" << host << ": \033[1;32m" << command << "\033[0m" << std::endl;
+    stats.execs++;
+    if (ssh_channel_request_exec(channel, command.c_str()) != SSH_OK) {
+      close_channels();
+      throw(SshException(std::string("Error: Command '") + command + "' cannot be run."));
+    }
+    if(sudo) {
+      std::string pass = password + "\n";
+      channel_write(channel, pass.c_str(), pass.size());
+    }
+  }
+
+  // Channels are read as data arrives, so a slow command does not stop the others
+  std::unique_ptr<char[]> buffer(new char[SOURCE_BUFFER_SIZE]);
+  size_t running = channels.size();
+  while(running > 0) {
+    std::vector<ssh_channel> ready;
+    for(ssh_channel channel : channels) {
+      if(channel != NULL)
+        ready.push_back(channel);
+    }
+    ready.push_back(NULL);
+    struct timeval timeout = {1, 0};
+    auto start = std::chrono::steady_clock::now();
+    {
+      TRACE_ZONE("select", "ssh");
+      ssh_channel_select(ready.data(), NULL, NULL, &timeout);
+    }
+    stats.read_blocked_us += elapsed_us(start);
+    for(size_t i = 0; i < channels.size(); i++) {
+      ssh_channel channel = channels[i];
+      if(channel == NULL)
+        continue;
+      int nbytes;
+      bool stopped = false;
+      while((nbytes = ssh_channel_read_nonblocking(channel, buffer.get(), SOURCE_BUFFER_SIZE, 1)) > 0) {
+        stats.channel_bytes_in += nbytes;
+        log.append(buffer.get(), nbytes);
+      }
+      while((nbytes = ssh_channel_read_nonblocking(channel, buffer.get(), SOURCE_BUFFER_SIZE, 0)) > 0) {
+        stats.channel_bytes_in += nbytes;
+        if(limiter) {
+          TRACE_ZONE("bandwidth wait", "ssh");
+          limiter->acquire(site, nbytes);
+        }
+        Metrics::add("ssh_helper_downloaded_bytes_total", nbytes);
+        bool ok;
+        // Sinks (TarReader, RangeWriter, Decompressor...) throw SimpleException on errors
+        try {
+          ok = sinks[i](buffer.get(), nbytes);
+        } catch(...) {
+          close_channels();
+          throw;
+        }
+        if(!ok) {
+          stopped = true;
+          break;
+        }
+      }
+      if(nbytes == SSH_ERROR) {
+        close_channels();
+        throw(SshException(std::string("Error: Output from command '") + commands[i] + "' cannot be read."));
+      }
+      if(stopped || nbytes == SSH_EOF || ssh_channel_is_eof(channel)) {
+        ssh_channel_send_eof(channel);
+        ssh_channel_close(channel);
+        int rc = stopped ? 1 : ssh_channel_get_exit_status(channel);
+        ssh_channel_free(channel);
+        gauge.close();
+        channels[i] = NULL;
+        running--;
+        TRACE_COUNTER("open channels", running);
+        if(status == 0)
+          status = rc;
+      }
+    }
+  }
+  return std::make_tuple(status, log);
+}
+
 [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> SshPtr::exec_sudo(std::string command) // throw(SshException);
 {
   int status;
@@ -360,6 +653,7 @@ enum LogState {
 
 void SshPtr::scp_write(std::string filepath, std::string dest)
 {
+  TimelineSpan span("scp_write", "transfer", dest);
   // Check file size
   std::filesystem::path path(filepath);
   if(! std::filesystem::exists(path)) {
@@ -392,6 +686,7 @@ void SshPtr::scp_write(std::string filepath, std::string dest)
     ssh_scp_free(scp);
     throw(SshException("[SshPtr::scp_write]: Error initializing scp session: " + filepath + std::string(":") + ssh_get_error(session)));
   }
+  stats.channels++;
  
   rc = ssh_scp_push_file(scp, dest.c_str(), file_length, S_IRUSR | S_IWUSR | S_IRGRP);
   if (rc != SSH_OK)
@@ -405,7 +700,10 @@ void SshPtr::scp_write(std::string filepath, std::string dest)
 
   size_t nbytes = fread(buffer, sizeof(char), sizeof(buffer), in);
   while(nbytes > 0) {
-    rc = ssh_scp_write(scp, buffer, nbytes);
+    if(limiter)
+      limiter->acquire(site, nbytes);
+    Metrics::add("ssh_helper_uploaded_bytes_total", nbytes);
+    rc = scp_write_data(scp, buffer, nbytes);
     if (rc != SSH_OK) {
       ssh_scp_close(scp);
       ssh_scp_free(scp);
@@ -420,6 +718,110 @@ void SshPtr::scp_write(std::string filepath, std::string dest)
   ssh_scp_free(scp);
 }
 
+[[nodiscard]] std::tuple<std::string /*local md5*/, std::string /*remote md5*/> SshPtr::stream_write(std::string filepath, std::string dest, CompressType compress, uintmax_t offset, std::string prefix_md5)
+{
+  TimelineSpan span("stream_write", "transfer", dest);
+  FILE *in = fopen(filepath.c_str(), "r");
+  if(in == nullptr) {
+    throw(SshException("[SshPtr::stream_write]: Cannot open local file: " + filepath));
+  }
+  posix_fadvise(fileno(in), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  std::unique_ptr<Hash> md5 = std::make_unique<Hash>();
+  if(offset > 0) {
+    // Check the bytes already sent. The hash goes on with the rest of the file.
+    std::unique_ptr<char[]> buffer(new char[SOURCE_BUFFER_SIZE]);
+    uintmax_t done = 0;
+    while(done < offset) {
+      size_t nbytes = fread(buffer.get(), sizeof(char), std::min((uintmax_t) SOURCE_BUFFER_SIZE, offset - done), in);
+      if(nbytes == 0)
+        break;
+      md5->update(buffer.get(), nbytes);
+      done += nbytes;
+    }
+    if(done != offset || md5->current() != prefix_md5) {
+      std::cout << user << "@" << host << " " << dest << " is not a part of " << filepath << ". It is sent again." << std::endl;
+      offset = 0;
+      md5 = std::make_unique<Hash>();
+      rewind(in);
+    } else {
+      std::cout << user << "@" << host << " resuming " << filepath << " at byte " << offset << std::endl;
+    }
+  }
+  // md5 of the sent bytes. It is the remote md5 of the received ones.
+  Hash sent_md5;
+  SshDataSource source = [&in, &md5, &sent_md5](char *buffer, size_t size) {
+    size_t nbytes = fread(buffer, sizeof(char), size, in);
+    md5->update(buffer, nbytes);
+    sent_md5.update(buffer, nbytes);
+    return nbytes;
+  };
+
+  std::filesystem::path destPath(dest);
+  // The remote md5 is computed from the received stream by "tee".
+  // When a transfer is resumed, the kept bytes are not read again: their remote md5 
+  // is prefix_md5, so only the received bytes are hashed on the host.
+  std::string receive = Compressor::decompressCommand(compress) + " | tee '" + dest + "'";
+  if(offset > 0)
+    receive = "truncate -s " + std::to_string(offset) + " '" + dest + "' && " 
+      + Compressor::decompressCommand(compress) + " | tee -a '" + dest + "'";
+  std::string command = "bash -c \"set -o pipefail; umask 027; mkdir -p '" + destPath.parent_path().string() + "' && "
+    + receive + " | md5sum -b\"";
+  int rc;
+  std::shared_ptr<char*> output;
+  std::string log;
+  try {
+    if(compress != COMPRESS_NONE) {
+      // Compressor must be finished before md5 is read
+      Compressor compressor(compress, source);
+      SshDataSource compressed = [&compressor](char *buffer, size_t size) {
+        return compressor.read(buffer, size);
+      };
+      std::tie(rc, output, log) = exec_write_get_output(command, compressed);
+    } else {
+      std::tie(rc, output, log) = exec_write_get_output(command, source);
+    }
+  } catch(SshException &error) {
+    fclose(in);
+    throw(error);
+  } catch(SimpleException &error) {
+    fclose(in);
+    throw(SshException(std::string("[SshPtr::stream_write]: ") + error.what()));
+  }
+  bool read_error = ferror(in);
+  fclose(in);
+  if(read_error)
+    throw(SshException("[SshPtr::stream_write]: Cannot read local file: " + filepath));
+  if(rc != 0)
+    throw(SshException("[SshPtr::stream_write]: Cannot write to remote file: " + dest));
+  std::string remote_md5 = strip(*output);
+  remote_md5 = remote_md5.substr(0, remote_md5.find(' '));
+  std::string local_md5 = md5->final();
+  if(offset > 0) {
+    // Kept bytes are the same (prefix_md5 has been checked), so the whole file 
+    // is the same if the received bytes are
+    if(remote_md5 == sent_md5.final())
+      remote_md5 = local_md5;
+  }
+  return std::make_tuple(local_md5, remote_md5);
+}
+
+void SshPtr::setMarkerHandler(MarkerHandler handler)
+{
+  marker_handler = handler;
+}
+
+void SshPtr::delay(unsigned seconds)
+{
+  sleep(seconds);
+}
+
+void SshPtr::setBandwidthLimiter(std::shared_ptr<BandwidthLimiter> limiter, std::string site)
+{
+  this->limiter = limiter;
+  this->site = site;
+}
+
 void SshPtr::ssh_write_to_file(std::string content, std::string dest) // throw(SshException);
 {
   std::error_code error;
@@ -444,13 +846,14 @@ void SshPtr::ssh_write_to_file(std::string content, std::string dest) // throw(S
     ssh_scp_free(scp);
     throw(SshException("[SshPtr::scp_write]: Error initializing scp session: " + dest + std::string(":") + ssh_get_error(session)));
   }
+  stats.channels++;
  
   size_t nbytes = strlen(content.c_str());
   rc = ssh_scp_push_file(scp, dest.c_str(), nbytes, S_IRUSR | S_IWUSR | S_IRGRP);
   if (rc != SSH_OK)
     throw(SshException("[SshPtr::ssh_write_to_file]: Cannot open remote file: " + dest + std::string(":") + ssh_get_error(session)));
 
-  rc = ssh_scp_write(scp, content.c_str(), nbytes);
+  rc = scp_write_data(scp, content.c_str(), nbytes);
   if (rc != SSH_OK) {
     ssh_scp_close(scp);
     ssh_scp_free(scp);
@@ -24,8 +24,11 @@
 #include <string>
 #include <tuple>
 #include <exception>
-
-class SshException;
+#include <functional>
+#include <vector>
+#include <memory>
+#include "executor.h"
+#include "sessionstats.h"
 
 /** Simple wrap for ssh_session C struct. 
  *
@@ -51,56 +54,98 @@ class SshException;
  *  }
  *
  */
-class SshPtr {
+class SshPtr : public Executor {
   public:
     SshPtr(std::string host, int port);
-    ~SshPtr();
+    ~SshPtr() override;
 
     inline ssh_session get() {return session;}
-    [[nodiscard]] bool connect(std::string user, std::string password);
+    /** Opens the session. If public_key is true, authentication with the 
+     * manager key (~/.ssh/id_rsa) is tried before password.*/
+    [[nodiscard]] bool connect(std::string user, std::string password, bool public_key = false) override;
+    /** True if the session was authenticated with the manager key.*/
+    inline bool isPublicKeyAuth() override {return public_key_auth;}
     /** Run remote command.
      * @return status get status of output command and log info.*/
     [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
-      exec(std::string command); // throw(SshException);
+      exec(std::string command) override; // throw(SshException);
     /** Run remote command and get output.*/
     [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
-      exec_get_output(std::string command);// throw(SshException);
+      exec_get_output(std::string command) override;// throw(SshException);
     /** Run remote command. stdin_string in a string that will be write in stdin of command.
      * @return status get status of output command and log info.*/
     [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
-      exec(std::string command, std::string stdin_string); // throw(SshException);
+      exec(std::string command, std::string stdin_string) override; // throw(SshException);
     /** Run remote command and get output. stdin_string in a string that will be write in stdin of command.*/
     [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
-      exec_get_output(std::string command, std::string stdin_string);// throw(SshException);
+      exec_get_output(std::string command, std::string stdin_string) override;// throw(SshException);
     /** Run remote command as sudo. if status == -1, user is not a sudoer.*/
     [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
-      exec_sudo(std::string command);// throw(SshException);
+      exec_sudo(std::string command) override;// throw(SshException);
     /** Run remote command as sudo and get output. if status == -1, user is not a sudoer.*/
     [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
-      exec_sudo_get_output(std::string command);// throw(SshException);
-    void scp_write(std::string filepath, std::string dest);// throw(SshException);
-    void ssh_write_to_file(std::string content, std::string dest);// throw(SshException);
-
+      exec_sudo_get_output(std::string command) override;// throw(SshException);
+    /** Run remote command writing data from source to its stdin and get output.
+     * stdin is closed (EOF) when source ends. With sudo, the password is never
+     * read by command, even if sudo does not ask for it.*/
+    [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> 
+      exec_write_get_output(std::string command, SshDataSource source, bool sudo = false) override;// throw(SshException);
+    /** Run remote command sending its stdout to sink. 
+     * @return status of command and its stderr as log.*/
+    [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
+      exec_read(std::string command, SshDataSink sink, bool sudo = false) override;// throw(SshException);
+    /** Run remote commands at the same time on channels of this session. 
+     * stdout of commands[i] is sent to sinks[i].
+     * @return first failed status (0 if all commands are ok) and stderr of commands as log.*/
+    [[nodiscard]] std::tuple<int /*status*/, std::string /*log*/> 
+      exec_read(std::vector<std::string> commands, std::vector<SshDataSink> sinks, bool sudo = false) override;// throw(SshException);
+    void scp_write(std::string filepath, std::string dest) override;// throw(SshException);
+    /** Sends filepath to dest. md5 is computed while data is being sent and 
+     * while it is being received on the remote host, so no extra read pass is needed.
+     * Data is compressed while it is sent if compress is not COMPRESS_NONE.
+     * If offset > 0, dest has the first offset bytes of the file (an interrupted transfer) 
+     * and prefix_md5 is their md5 on the host. If they are the same as in filepath, only the rest 
+     * of the file is sent and hashed on the host, else the file is sent again.
+     * @return md5 of sent data and md5 of received data (the whole file). */
+    [[nodiscard]] std::tuple<std::string /*local md5*/, std::string /*remote md5*/> 
+      stream_write(std::string filepath, std::string dest, CompressType compress = COMPRESS_NONE, uintmax_t offset = 0, std::string prefix_md5 = "") override;// throw(SshException);
+    void ssh_write_to_file(std::string content, std::string dest) override;// throw(SshException);
+    /** Data sent or received by this session is limited by limiter, as a host of site.
+     */
+    void setBandwidthLimiter(std::shared_ptr<BandwidthLimiter> limiter, std::string site) override;
+    /** Counters of the session. Transport counters are read when it is called.
+     * They are also recorded in SessionStats when the session is finished.
+     */
+    SshStats getStats();
+    /** Receives "##log:", "##metric:" and "##progress:" markers of commands output.
+     */
+    void setMarkerHandler(MarkerHandler handler) override;
+    void delay(unsigned seconds) override;
+    inline uint64_t clock() override {return 0;}
+    inline void waitUntil(uint64_t) override {}
+    /** known_hosts file of the next sessions. By default, libssh uses ~/.ssh/known_hosts.
+     */
+    static void setKnownHostsFile(std::string path);
 
   private:
-    [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> exec_sudo_get_output(std::string command, bool sudo, bool output_to_stdout, std::string stdin_string = "");
+    [[nodiscard]] std::tuple<int /*status*/, std::shared_ptr<char*> /*output*/, std::string /*log*/> exec_sudo_get_output(std::string command, bool sudo, bool output_to_stdout, std::string stdin_string = "", SshDataSource source = nullptr);
+    // ssh_channel_write, ssh_channel_read_timeout and ssh_scp_write counted in stats
+    int channel_write(ssh_channel channel, const void *data, size_t size);
+    int channel_read(ssh_channel channel, char *buffer, size_t size);
+    int scp_write_data(ssh_scp scp, const void *data, size_t size);
 
     ssh_session session;
     std::string host;
     int port;
     int verbosity;
     bool connected;
+    bool public_key_auth;
     std::string user, password;
+    std::shared_ptr<BandwidthLimiter> limiter;
+    std::string site;
+    SshStats stats;
+    MarkerHandler marker_handler;
 };
 
 
-class SshException : public std::exception
-{
-  public:
-    SshException(std::string error);
-    virtual const char *what();
-  private:
-    std::string error;
-};
-
 #endif
@@ -0,0 +1,383 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "tar.h"
+#include "simpleexception.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <filesystem>
+
+static const size_t BLOCK = 512;
+// Size of writes to extracted files
+static const size_t OUT_BUFFER_SIZE = 1024 * 1024;
+
+// Writes value as octal number in field (size bytes, NUL ended). 
+// Big values use GNU base-256 encoding.
+static void tar_number(char *field, size_t size, uintmax_t value)
+{
+  if(value < (1ULL << (3 * (size - 1)))) {
+    snprintf(field, size, "%0*jo", (int)(size - 1), value);
+  } else {
+    memset(field, 0, size);
+    field[0] = (char) 0x80;
+    for(size_t i = size - 1; i > 0 && value > 0; i--) {
+      field[i] = value & 0xff;
+      value >>= 8;
+    }
+  }
+}
+
+static void tar_header(char *block, const std::string &name, char type, uintmax_t size, mode_t mode, time_t mtime)
+{
+  memset(block, 0, BLOCK);
+  strncpy(block, name.c_str(), 100);
+  tar_number(block + 100, 8, mode & 07777);
+  tar_number(block + 108, 8, 0);
+  tar_number(block + 116, 8, 0);
+  tar_number(block + 124, 12, size);
+  tar_number(block + 136, 12, mtime);
+  block[156] = type;
+  memcpy(block + 257, "ustar  ", 8); // GNU magic and version
+  memset(block + 148, ' ', 8);
+  unsigned int sum = 0;
+  for(size_t i = 0; i < BLOCK; i++)
+    sum += (unsigned char) block[i];
+  snprintf(block + 148, 8, "%06o", sum);
+}
+
+TarWriter::TarWriter(std::string base, std::vector<std::string> files)
+{
+  this->base = base;
+  this->files = files;
+  next_file = 0;
+  header_pos = 0;
+  in = nullptr;
+  remaining = padding = 0;
+  finished = false;
+}
+
+TarWriter::~TarWriter()
+{
+  if(in)
+    fclose(in);
+}
+
+void TarWriter::openNext()
+{
+  header.clear();
+  header_pos = 0;
+  if(next_file >= files.size()) {
+    // End of archive: two zero blocks
+    header.resize(2 * BLOCK, 0);
+    finished = true;
+    return;
+  }
+  std::string name = files[next_file++];
+  std::string path = base + "/" + name;
+  struct stat st;
+  in = fopen(path.c_str(), "r");
+  if(in == nullptr || fstat(fileno(in), &st) != 0)
+    throw(SimpleException("[TarWriter] File " + path + " cannot be read."));
+  if(name.size() >= 100) {
+    // GNU long name entry
+    size_t blocks = (name.size() + BLOCK) / BLOCK;
+    header.resize(BLOCK + blocks * BLOCK, 0);
+    tar_header(header.data(), "././@LongLink", 'L', name.size() + 1, 0644, 0);
+    memcpy(header.data() + BLOCK, name.c_str(), name.size());
+  }
+  size_t pos = header.size();
+  header.resize(pos + BLOCK);
+  tar_header(header.data() + pos, name, '0', st.st_size, st.st_mode, st.st_mtime);
+  remaining = st.st_size;
+  padding = (BLOCK - st.st_size % BLOCK) % BLOCK;
+}
+
+size_t TarWriter::read(char *buffer, size_t size)
+{
+  size_t done = 0;
+  while(done < size) {
+    if(header_pos < header.size()) {
+      size_t n = std::min(size - done, header.size() - header_pos);
+      memcpy(buffer + done, header.data() + header_pos, n);
+      header_pos += n;
+      done += n;
+    } else if(remaining > 0) {
+      size_t n = std::min<uintmax_t>(size - done, remaining);
+      size_t nbytes = fread(buffer + done, 1, n, in);
+      if(nbytes < n) {
+        if(ferror(in))
+          throw(SimpleException("[TarWriter] File " + files[next_file - 1] + " cannot be read."));
+        // File has been truncated, fill with zeros to keep archive size
+        memset(buffer + done + nbytes, 0, n - nbytes);
+      }
+      remaining -= n;
+      done += n;
+    } else if(padding > 0) {
+      size_t n = std::min<uintmax_t>(size - done, padding);
+      memset(buffer + done, 0, n);
+      padding -= n;
+      done += n;
+    } else if(finished) {
+      break;
+    } else {
+      if(in) {
+        fclose(in);
+        in = nullptr;
+      }
+      openNext();
+    }
+  }
+  return done;
+}
+
+// Reads octal or GNU base-256 number of a header field
+static uintmax_t tar_value(const char *field, size_t size)
+{
+  uintmax_t value = 0;
+  if((unsigned char) field[0] & 0x80) {
+    for(size_t i = 1; i < size; i++)
+      value = (value << 8) | (unsigned char) field[i];
+    return value;
+  }
+  for(size_t i = 0; i < size && field[i] != '\0'; i++) {
+    if(field[i] >= '0' && field[i] <= '7')
+      value = (value << 3) | (field[i] - '0');
+  }
+  return value;
+}
+
+static std::string tar_string(const char *field, size_t size)
+{
+  return std::string(field, strnlen(field, size));
+}
+
+TarReader::TarReader(std::string dest)
+{
+  this->dest = dest;
+  header_pos = 0;
+  remaining = padding = 0;
+  meta_type = '\0';
+  out = -1;
+  out_buffer.reserve(OUT_BUFFER_SIZE);
+  out_mtime = 0;
+  finished = false;
+}
+
+TarReader::~TarReader()
+{
+  if(out >= 0)
+    close(out);
+}
+
+std::string TarReader::safePath(std::string name)
+{
+  std::filesystem::path path = std::filesystem::path(name).lexically_normal();
+  if(path.is_absolute())
+    throw(SimpleException("[TarReader] Absolute path in archive: " + name));
+  for(const auto& part : path) {
+    if(part == "..")
+      throw(SimpleException("[TarReader] Path out of destination in archive: " + name));
+  }
+  // Parent folders cannot be symbolic links, else files could be written out of dest
+  std::filesystem::path full(dest);
+  std::filesystem::path parent = path.parent_path();
+  for(const auto& part : parent) {
+    if(part == "." || part.empty())
+      continue;
+    full /= part;
+    struct stat st;
+    if(lstat(full.c_str(), &st) == 0 && S_ISLNK(st.st_mode))
+      throw(SimpleException("[TarReader] Path through symbolic link in archive: " + name));
+  }
+  return (std::filesystem::path(dest) / path).string();
+}
+
+void TarReader::startEntry()
+{
+  bool empty = true;
+  for(size_t i = 0; i < BLOCK && empty; i++)
+    empty = header[i] == '\0';
+  if(empty) {
+    finished = true;
+    return;
+  }
+  unsigned int sum = 0;
+  for(size_t i = 0; i < BLOCK; i++)
+    sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) header[i];
+  if(sum != tar_value(header + 148, 8))
+    throw(SimpleException("[TarReader] Bad header checksum."));
+
+  char type = header[156];
+  uintmax_t size = tar_value(header + 124, 12);
+  remaining = size;
+  padding = (BLOCK - size % BLOCK) % BLOCK;
+
+  if(type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+    meta_type = type;
+    meta.clear();
+    if(remaining == 0)
+      endEntry();
+    return;
+  }
+  meta_type = '\0';
+
+  std::string name = tar_string(header, 100);
+  if(memcmp(header + 257, "ustar\0", 6) == 0 && header[345] != '\0')
+    name = tar_string(header + 345, 155) + "/" + name;
+  if(!long_name.empty())
+    name = long_name;
+  std::string link = long_link.empty() ? tar_string(header + 157, 100) : long_link;
+  long_name.clear();
+  long_link.clear();
+  mode_t mode = tar_value(header + 100, 8) & 07777;
+  time_t mtime = tar_value(header + 136, 12);
+
+  std::string path = safePath(name);
+  std::error_code error;
+  std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+  switch(type) {
+    case '\0':
+    case '0':
+    case '7':
+      unlink(path.c_str());
+      out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      if(out < 0)
+        throw(SimpleException("[TarReader] File cannot be written: " + path));
+      fchmod(out, mode & 0777);
+      out_path = path;
+      out_mtime = mtime;
+      if(remaining == 0)
+        endEntry();
+      break;
+    case '5':
+      if(path.ends_with("/."))
+        path.resize(path.size() - 2);
+      std::filesystem::create_directories(path, error);
+      if(error)
+        throw(SimpleException("[TarReader] Folder cannot be made: " + path));
+      chmod(path.c_str(), (mode & 0777) | S_IRWXU);
+      break;
+    case '2':
+      unlink(path.c_str());
+      if(symlink(link.c_str(), path.c_str()) != 0)
+        throw(SimpleException("[TarReader] Symbolic link cannot be made: " + path));
+      break;
+    case '1':
+      unlink(path.c_str());
+      if(::link(safePath(link).c_str(), path.c_str()) != 0)
+        throw(SimpleException("[TarReader] Hard link cannot be made: " + path));
+      break;
+    default:
+      // Devices and fifos are skipped
+      break;
+  }
+}
+
+void TarReader::endEntry()
+{
+  if(meta_type == 'L') {
+    long_name = meta.c_str();
+  } else if(meta_type == 'K') {
+    long_link = meta.c_str();
+  } else if(meta_type == 'x') {
+    // pax records: "length key=value\n"
+    size_t pos = 0;
+    while(pos < meta.size()) {
+      size_t space = meta.find(' ', pos);
+      if(space == std::string::npos)
+        break;
+      size_t length = std::stoul(meta.substr(pos, space - pos));
+      if(length == 0 || pos + length > meta.size())
+        break;
+      std::string record = meta.substr(space + 1, pos + length - space - 2);
+      size_t equal = record.find('=');
+      if(equal != std::string::npos) {
+        std::string key = record.substr(0, equal);
+        if(key == "path")
+          long_name = record.substr(equal + 1);
+        else if(key == "linkpath")
+          long_link = record.substr(equal + 1);
+      }
+      pos += length;
+    }
+  }
+  meta_type = '\0';
+  meta.clear();
+  if(out >= 0) {
+    flush();
+    close(out);
+    out = -1;
+    struct timespec times[2] = {{out_mtime, 0}, {out_mtime, 0}};
+    utimensat(AT_FDCWD, out_path.c_str(), times, 0);
+  }
+}
+
+void TarReader::flush()
+{
+  size_t done = 0;
+  while(done < out_buffer.size()) {
+    ssize_t nbytes = ::write(out, out_buffer.data() + done, out_buffer.size() - done);
+    if(nbytes <= 0)
+      throw(SimpleException("[TarReader] File cannot be written: " + out_path));
+    done += nbytes;
+  }
+  out_buffer.clear();
+}
+
+void TarReader::write(const char *buffer, size_t size)
+{
+  while(size > 0 && !finished) {
+    if(remaining > 0) {
+      size_t n = std::min((uintmax_t) size, remaining);
+      if(meta_type != '\0') {
+        meta.append(buffer, n);
+      } else if(out >= 0) {
+        if(out_buffer.size() + n > OUT_BUFFER_SIZE)
+          flush();
+        out_buffer.insert(out_buffer.end(), buffer, buffer + n);
+      }
+      buffer += n;
+      size -= n;
+      remaining -= n;
+      if(remaining == 0)
+        endEntry();
+    } else if(padding > 0) {
+      size_t n = std::min((uintmax_t) size, padding);
+      buffer += n;
+      size -= n;
+      padding -= n;
+    } else {
+      size_t n = std::min(size, BLOCK - header_pos);
+      memcpy(header + header_pos, buffer, n);
+      header_pos += n;
+      buffer += n;
+      size -= n;
+      if(header_pos == BLOCK) {
+        header_pos = 0;
+        startEntry();
+      }
+    }
+  }
+}
+
+void TarReader::finish()
+{
+  if(!finished && (remaining > 0 || padding > 0 || header_pos > 0 || out >= 0))
+    throw(SimpleException("[TarReader] Archive is not complete."));
+}
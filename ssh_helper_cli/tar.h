@@ -0,0 +1,106 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __TAR_H__
+#define __TAR_H__
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+/** Builds a tar archive (GNU format) of files on the fly, so it can be 
+ * streamed to "tar -x" on remote hosts without temp files.
+ *
+ *  TarWriter tar("/base/folder", {"a.txt", "dir/b.txt"});
+ *  while((n = tar.read(buffer, sizeof(buffer))) > 0)
+ *    ...
+ */
+class TarWriter
+{
+  public:
+    /** files are paths relative to base. Only regular files are supported.
+     */
+    TarWriter(std::string base, std::vector<std::string> files);
+    ~TarWriter();
+
+    /** Fills buffer with the next bytes of the archive. Returns 0 at the end.
+     * Throws SimpleException if a file cannot be read.
+     */
+    size_t read(char *buffer, size_t size);
+
+  private:
+    std::string base;
+    std::vector<std::string> files;
+    size_t next_file;
+    // Pending header (and long name) bytes
+    std::vector<char> header;
+    size_t header_pos;
+    FILE *in;
+    uintmax_t remaining, padding;
+    bool finished;
+
+    void openNext();
+};
+
+/** Extracts a tar archive (GNU, ustar or pax) to dest while it is received.
+ * Regular files, folders, symbolic links and hard links are supported.
+ * Absolute paths, paths with ".." and paths through symbolic links are rejected.
+ *
+ *  TarReader tar("/dest/folder");
+ *  tar.write(buffer, n);
+ *  ...
+ *  tar.finish();
+ */
+class TarReader
+{
+  public:
+    TarReader(std::string dest);
+    ~TarReader();
+
+    /** Extracts next bytes of the archive. 
+     * Throws SimpleException if the archive is not valid or a file cannot be written.
+     */
+    void write(const char *buffer, size_t size);
+    /** Throws SimpleException if the archive is not complete.
+     */
+    void finish();
+
+  private:
+    std::string dest;
+    char header[512];
+    size_t header_pos;
+    // Data of the current entry and its padding
+    uintmax_t remaining, padding;
+    // Data of "L", "K" and "x" entries is kept in meta
+    char meta_type;
+    std::string meta;
+    std::string long_name, long_link;
+    int out;
+    // File data is written in big blocks
+    std::vector<char> out_buffer;
+    std::string out_path;
+    time_t out_mtime;
+    bool finished;
+
+    void startEntry();
+    void endEntry();
+    void flush();
+    std::string safePath(std::string name);
+};
+
+#endif
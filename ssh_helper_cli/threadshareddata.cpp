@@ -17,11 +17,20 @@
 
 #include "threadshareddata.h"
 #include "simpleexception.h"
+#include "sshptr.h"
+#include "hash.h"
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
 
 
 ThreadSharedData::ThreadSharedData(std::shared_ptr<ConfigItemVector> scripts)
 {
   mScripts = scripts;
+  new_executor = [](std::string host, int port) -> std::shared_ptr<Executor> {
+    return std::make_shared<SshPtr>(host, port);
+  };
   if(pthread_mutex_init(&mutex, NULL) != 0) 
     throw(SimpleException("Error: mutex init failed\n"));
 }
@@ -72,3 +81,195 @@ sem_t *ThreadSharedData::getSemaphore(intptr_t monitor, int value)
   }
 }
 
+// Folder without trailing slash, as ClientThread::upload_directory uses it
+static std::filesystem::path folder_path(std::string folder)
+{
+  std::filesystem::path path(folder);
+  if(!path.has_filename())
+    path = path.parent_path();
+  return path;
+}
+
+static std::shared_ptr<FolderManifest> make_manifest(const std::filesystem::path &folder)
+{
+  std::shared_ptr<FolderManifest> manifest = std::make_shared<FolderManifest>();
+  std::vector<std::string> paths;
+  std::error_code error;
+  // An unreadable entry fails the whole folder: with "delete" its remote copies would be removed
+  std::filesystem::recursive_directory_iterator it(folder, error), end;
+  for(; !error && it != end; it.increment(error)) {
+    std::error_code type_error;
+    if(it->is_regular_file(type_error)) {
+      manifest->files.push_back(it->path().lexically_relative(folder).string());
+      paths.push_back(it->path().string());
+    }
+    if(type_error) {
+      error = type_error;
+      break;
+    }
+  }
+  if(error) {
+    manifest->error = "Error: " + folder.string() + " cannot be read: " + error.message();
+    return manifest;
+  }
+  try {
+    manifest->md5s = Hash::files(paths);
+  } catch(SimpleException &e) {
+    manifest->error = e.what();
+  }
+  return manifest;
+}
+
+void ThreadSharedData::hashFolders(const std::vector<std::string> &folders)
+{
+  for(const std::string &folder : folders)
+    getManifest(folder);
+}
+
+std::shared_ptr<const FolderManifest> ThreadSharedData::getManifest(std::string folder)
+{
+  std::filesystem::path path = folder_path(folder);
+  std::shared_ptr<const FolderManifest> manifest;
+  pthread_mutex_lock(&mutex);
+  if(manifests.contains(path.string()))
+    manifest = manifests[path.string()];
+  pthread_mutex_unlock(&mutex);
+  if(manifest)
+    return manifest;
+  // Folders not seen by Manager (e.g. added by a later step) are hashed here
+  manifest = make_manifest(path);
+  pthread_mutex_lock(&mutex);
+  if(manifests.contains(path.string()))
+    manifest = manifests[path.string()];
+  else
+    manifests[path.string()] = manifest;
+  pthread_mutex_unlock(&mutex);
+  return manifest;
+}
+
+uint64_t ThreadSharedData::getMonitorClock(intptr_t monitor)
+{
+  pthread_mutex_lock(&mutex);
+  uint64_t clock_us = monitorClocks.contains(monitor) ? monitorClocks[monitor] : 0;
+  pthread_mutex_unlock(&mutex);
+  return clock_us;
+}
+
+void ThreadSharedData::setMonitorClock(intptr_t monitor, uint64_t clock_us)
+{
+  pthread_mutex_lock(&mutex);
+  monitorClocks[monitor] = std::max(monitorClocks[monitor], clock_us);
+  pthread_mutex_unlock(&mutex);
+}
+
+std::tuple<bool /*ok*/, RemoteFileState> ThreadSharedData::getRemoteFileState(std::string host, std::string path)
+{
+  RemoteFileState state;
+  bool ok = false;
+  pthread_mutex_lock(&mutex);
+  std::string key = host + "\t" + path;
+  if(remoteFileStates.contains(key)) {
+    state = remoteFileStates[key];
+    ok = true;
+  }
+  pthread_mutex_unlock(&mutex);
+  return std::make_tuple(ok, state);
+}
+
+void ThreadSharedData::setRemoteFileState(std::string host, std::string path, RemoteFileState state)
+{
+  pthread_mutex_lock(&mutex);
+  remoteFileStates[host + "\t" + path] = state;
+  pthread_mutex_unlock(&mutex);
+}
+
+void ThreadSharedData::loadRemoteFileStates(std::string filename)
+{
+  std::ifstream in(filename);
+  if(!in.is_open())
+    return;
+  std::string line;
+  pthread_mutex_lock(&mutex);
+  while(std::getline(in, line)) {
+    std::stringstream buffer(line);
+    std::string host, path, size, mtime, md5;
+    if(std::getline(buffer, host, '\t') && std::getline(buffer, path, '\t') && std::getline(buffer, size, '\t')
+        && std::getline(buffer, mtime, '\t') && std::getline(buffer, md5, '\t')) {
+      RemoteFileState state;
+      try {
+        state.size = std::stoull(size);
+      } catch(...) {
+        continue;
+      }
+      state.mtime = mtime;
+      state.md5 = md5;
+      remoteFileStates[host + "\t" + path] = state;
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void ThreadSharedData::saveRemoteFileStates(std::string filename)
+{
+  std::error_code error;
+  std::filesystem::create_directories(std::filesystem::path(filename).parent_path(), error);
+  std::string tmp = filename + ".tmp";
+  std::ofstream out(tmp);
+  if(!out.is_open())
+    return;
+  pthread_mutex_lock(&mutex);
+  for(const auto& [key, state] : remoteFileStates)
+    out << key << "\t" << state.size << "\t" << state.mtime << "\t" << state.md5 << "\n";
+  pthread_mutex_unlock(&mutex);
+  out.close();
+  std::filesystem::rename(tmp, filename, error);
+}
+
+bool ThreadSharedData::isProvisioned(std::string host)
+{
+  pthread_mutex_lock(&mutex);
+  bool ok = !reprovision && provisioned.contains(host) && provisioned[host] == key_fingerprint;
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+void ThreadSharedData::setProvisioned(std::string host, bool ok)
+{
+  pthread_mutex_lock(&mutex);
+  if(ok)
+    provisioned[host] = key_fingerprint;
+  else
+    provisioned.erase(host);
+  pthread_mutex_unlock(&mutex);
+}
+
+void ThreadSharedData::loadProvisioned(std::string filename)
+{
+  std::ifstream in(filename);
+  if(!in.is_open())
+    return;
+  std::string line;
+  pthread_mutex_lock(&mutex);
+  while(std::getline(in, line)) {
+    std::string::size_type pos = line.find('\t');
+    if(pos != std::string::npos)
+      provisioned[line.substr(0, pos)] = line.substr(pos + 1);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void ThreadSharedData::saveProvisioned(std::string filename)
+{
+  std::error_code error;
+  std::filesystem::create_directories(std::filesystem::path(filename).parent_path(), error);
+  std::string tmp = filename + ".tmp";
+  std::ofstream out(tmp);
+  if(!out.is_open())
+    return;
+  pthread_mutex_lock(&mutex);
+  for(const auto& [host, fingerprint] : provisioned)
+    out << host << "\t" << fingerprint << "\n";
+  pthread_mutex_unlock(&mutex);
+  out.close();
+  std::filesystem::rename(tmp, filename, error);
+}
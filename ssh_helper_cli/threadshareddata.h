@@ -21,10 +21,38 @@
 #include <pthread.h>
 #include <memory>
 #include <tuple>
+#include <functional>
 #include <pthread.h>
 #include <semaphore.h>
 #include "configfileparser.h"
 #include "p2pdata.h"
+#include "bandwidthlimiter.h"
+#include "executor.h"
+
+/** Size, modification time and md5 of a file on a remote host, 
+ * saved after successful uploads. mtime is the output of stat %.Y, with 
+ * fractional seconds, so a rewrite in the same second is noticed.
+ */
+struct RemoteFileState {
+  uintmax_t size;
+  std::string mtime;
+  std::string md5;
+};
+
+/** Regular files of an uploaded folder, relative to the folder, and their md5.
+ * error is set if the folder cannot be read.
+ */
+struct FolderManifest {
+  std::vector<std::string> files, md5s;
+  std::string error;
+};
+
+/** When temp folders are removed from hosts: as soon as a host finishes 
+ * its scripts, when all hosts have finished or never.
+ */
+enum class CleanupMode {
+  ASYNC, END, NEVER
+};
 
 class ThreadSharedData {
   public:
@@ -33,6 +61,42 @@ class ThreadSharedData {
 
     std::shared_ptr<ConfigItemVector> getScripts();
     std::string id_session;
+    /** Remote content-addressed cache. cache_size is the size limit in bytes.
+     */
+    bool use_cache = true;
+    uintmax_t cache_size = 0;
+    /** If paranoid is true, remote files are always checked with md5sum.
+     */
+    bool paranoid = false;
+    /** Bandwidth used by all transfers.
+     */
+    std::shared_ptr<BandwidthLimiter> bandwidth = std::make_shared<BandwidthLimiter>();
+    /** Manager public key (a line of id_rsa.pub) and its fingerprint.
+     * If reprovision is true, provisioned hosts are checked again.
+     */
+    std::string public_key, key_fingerprint;
+    bool reprovision = false;
+    CleanupMode cleanup = CleanupMode::ASYNC;
+    /** Creates the executor of each session. By default, a SshPtr.
+     */
+    std::function<std::shared_ptr<Executor>(std::string host, int port)> new_executor;
+
+    /** Returns the saved state of path on host ("user@host").
+     */
+    std::tuple<bool /*ok*/, RemoteFileState> getRemoteFileState(std::string host, std::string path);
+    void setRemoteFileState(std::string host, std::string path, RemoteFileState state);
+    /** Loads and saves remote file states. The file has a line per file:
+     * user@host \t path \t size \t mtime \t md5
+     */
+    void loadRemoteFileStates(std::string filename);
+    void saveRemoteFileStates(std::string filename);
+    /** Hosts ("user@host") which have the manager public key in authorized_keys.
+     * The file has a line per host: user@host \t key fingerprint
+     */
+    bool isProvisioned(std::string host);
+    void setProvisioned(std::string host, bool provisioned);
+    void loadProvisioned(std::string filename);
+    void saveProvisioned(std::string filename);
     /** Returns seeds for file with md5. if ok == false, no seeds are available. 
      * The file must be send to the first seed. 
      */
@@ -43,10 +107,24 @@ class ThreadSharedData {
      * if semophore is not init, value is taken as init value.
      */
     sem_t *getSemaphore(intptr_t monitor, int value);
+    /** Executor::clock() of the last release of the monitor semaphore.
+     */
+    uint64_t getMonitorClock(intptr_t monitor);
+    void setMonitorClock(intptr_t monitor, uint64_t clock_us);
+
+    /** Manifests of the folders of "upload" steps. Manager makes them before 
+     * hosts are started, so the local tree is read and hashed once for all hosts.
+     */
+    void hashFolders(const std::vector<std::string> &folders);
+    std::shared_ptr<const FolderManifest> getManifest(std::string folder);
   private:
     std::shared_ptr<ConfigItemVector> mScripts; // Array of scripts
     std::map<std::string /*md5*/, std::shared_ptr<P2PData> > p2pSeeds;
     std::map<intptr_t /*monitor*/, sem_t* /*semaphore*/> monitorSemaphores;
+    std::map<intptr_t /*monitor*/, uint64_t /*clock*/> monitorClocks;
+    std::map<std::string /*host \t path*/, RemoteFileState> remoteFileStates;
+    std::map<std::string /*host*/, std::string /*key fingerprint*/> provisioned;
+    std::map<std::string /*folder*/, std::shared_ptr<const FolderManifest> > manifests;
     pthread_mutex_t mutex;
 };
 
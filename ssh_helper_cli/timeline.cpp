@@ -0,0 +1,203 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include "timeline.h"
+#include "latency.h"
+#include "tracing.h"
+#include <pthread.h>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <atomic>
+#include <algorithm>
+
+struct TimelineEvent {
+  char phase; // 'X' span, 'C' counter, 'i' instant
+  std::string name, category, detail;
+  int track;
+  long long start, duration; // microseconds
+  long long value;
+};
+
+static std::atomic<bool> enabled(false);
+static std::chrono::steady_clock::time_point origin;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TimelineEvent> events;
+static std::vector<std::string> tracks = {"manager"};
+// Track of every thread. Threads without track use "manager".
+static thread_local int track = 0;
+static thread_local std::string track_name = "manager";
+
+// Commands can be long scripts. Only the start is kept.
+static const size_t MAX_DETAIL = 256;
+
+static void add_event(TimelineEvent &event)
+{
+  event.track = track;
+  event.detail.resize(std::min(event.detail.size(), MAX_DETAIL));
+  pthread_mutex_lock(&mutex);
+  events.push_back(event);
+  pthread_mutex_unlock(&mutex);
+}
+
+static long long since_origin(std::chrono::steady_clock::time_point time)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(time - origin).count();
+}
+
+// Receives the events of TRACE_ZONE, TRACE_COUNTER and TRACE_INSTANT (see tracing.h)
+class TimelineTraceSink : public TraceSink
+{
+  public:
+    void zone(const char *name, const char *category, std::chrono::steady_clock::time_point start, 
+      std::chrono::steady_clock::time_point end, const std::string &detail) override {
+      Timeline::add(name, category, start, end, detail);
+    }
+    void counter(const char *name, long long value, std::chrono::steady_clock::time_point time) override {
+      TimelineEvent event = {'C', name, "counter", "", 0, since_origin(time), 0, value};
+      add_event(event);
+    }
+    void instant(const char *name, const char *category, std::chrono::steady_clock::time_point time, 
+      const std::string &detail) override {
+      TimelineEvent event = {'i', name, category, detail, 0, since_origin(time), 0, 0};
+      add_event(event);
+    }
+};
+
+static TimelineTraceSink trace_sink;
+
+void Timeline::enable()
+{
+  origin = std::chrono::steady_clock::now();
+  enabled = true;
+  if constexpr(TRACING_ENABLED)
+    Tracing::setSink(&trace_sink);
+}
+
+bool Timeline::isEnabled()
+{
+  return enabled;
+}
+
+void Timeline::setTrack(std::string name)
+{
+  pthread_mutex_lock(&mutex);
+  // Threads with the same name share the track
+  auto it = std::find(tracks.begin(), tracks.end(), name);
+  track = it - tracks.begin();
+  if(it == tracks.end())
+    tracks.push_back(name);
+  pthread_mutex_unlock(&mutex);
+  track_name = name;
+}
+
+void Timeline::add(std::string name, std::string category, std::chrono::steady_clock::time_point start, 
+      std::chrono::steady_clock::time_point end, std::string detail)
+{
+  if(!enabled)
+    return;
+  TimelineEvent event = {'X', name, category, detail, 0, since_origin(start), 
+    std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(), 0};
+  add_event(event);
+}
+
+std::string Timeline::trackName()
+{
+  return track_name;
+}
+
+static std::string json_string(const std::string &value)
+{
+  std::string out = "\"";
+  for(unsigned char ch : value) {
+    switch(ch) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if(ch < 0x20) {
+          char buffer[8];
+          snprintf(buffer, sizeof(buffer), "\\u%04x", ch);
+          out += buffer;
+        } else
+          out += ch;
+    }
+  }
+  return out + "\"";
+}
+
+bool Timeline::save(std::string path)
+{
+  std::ofstream out(path);
+  if(!out.is_open())
+    return false;
+  pthread_mutex_lock(&mutex);
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  out << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"ssh_helper_cli\"}}";
+  for(size_t i = 0; i < tracks.size(); i++)
+    out << ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << i << ",\"args\":{\"name\":" << json_string(tracks[i]) << "}}";
+  for(const TimelineEvent &event : events) {
+    if(event.phase == 'C') {
+      // Counters are per process. Every track has its own counter.
+      std::string name = event.track == 0 ? event.name : event.name + " " + tracks[event.track];
+      out << ",\n{\"ph\":\"C\",\"pid\":1,\"ts\":" << event.start << ",\"name\":" << json_string(name) 
+        << ",\"args\":{\"value\":" << event.value << "}}";
+      continue;
+    }
+    out << ",\n{\"ph\":\"" << event.phase << "\",\"pid\":1,\"tid\":" << event.track << ",\"ts\":" << event.start;
+    if(event.phase == 'X')
+      out << ",\"dur\":" << event.duration;
+    else
+      out << ",\"s\":\"t\"";
+    out << ",\"name\":" << json_string(event.name) << ",\"cat\":" << json_string(event.category);
+    if(!event.detail.empty())
+      out << ",\"args\":{\"detail\":" << json_string(event.detail) << "}";
+    out << "}";
+  }
+  out << "\n]}\n";
+  pthread_mutex_unlock(&mutex);
+  out.close();
+  return !out.fail();
+}
+
+bool TimelineSpan::isEnabled()
+{
+  return Timeline::isEnabled() || LatencyStats::isEnabled();
+}
+
+TimelineSpan::TimelineSpan(const std::string &name, const std::string &category, const std::string &detail)
+{
+  active = isEnabled();
+  if(!active)
+    return;
+  this->name = name;
+  this->category = category;
+  this->detail = detail;
+  start = std::chrono::steady_clock::now();
+}
+
+TimelineSpan::~TimelineSpan()
+{
+  if(!active)
+    return;
+  auto end = std::chrono::steady_clock::now();
+  Timeline::add(name, category, start, end, detail);
+  // Script steps are told apart by their names
+  std::string step = category == "script" && !detail.empty() ? name + ": " + detail : name;
+  LatencyStats::record(step, Timeline::trackName(), std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+}
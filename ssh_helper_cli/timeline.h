@@ -0,0 +1,76 @@
+/*
+ * (c)GPL3
+ *
+ * Copyright: 2022 P.L. Lucas <selairi@gmail.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef __TIMELINE_H__
+#define __TIMELINE_H__
+
+#include <string>
+#include <chrono>
+
+/** Spans of time of every phase of a run (connect, auth, scripts, commands...)
+ * measured with a monotonic clock. Every thread writes to its own track 
+ * (usually a host). Spans of a track can be nested.
+ * The timeline can be saved in Chrome trace event format (Perfetto, chrome://tracing).
+ *
+ *  Timeline::enable();
+ *  Timeline::setTrack("user@host");
+ *  {
+ *    TimelineSpan span("connect", "ssh");
+ *    ...
+ *  }
+ *  Timeline::save("out.json");
+ *
+ * Nothing is recorded if the timeline is not enabled.
+ */
+class Timeline
+{
+  public:
+    static void enable();
+    static bool isEnabled();
+    /** Sets the track of the calling thread. Threads with the same name share the track.
+     */
+    static void setTrack(std::string name);
+    static std::string trackName();
+    /** Adds a span to the track of the calling thread. detail is shown as an argument.
+     */
+    static void add(std::string name, std::string category, std::chrono::steady_clock::time_point start, 
+      std::chrono::steady_clock::time_point end, std::string detail = "");
+    /** Saves the timeline in Chrome trace event format. Returns false on error.
+     */
+    static bool save(std::string path);
+};
+
+/** Adds a span from its construction to its destruction. 
+ * Its duration is also recorded in LatencyStats. If neither of them is 
+ * enabled, spans do nothing.
+ */
+class TimelineSpan
+{
+  public:
+    TimelineSpan(const std::string &name, const std::string &category, const std::string &detail = "");
+    ~TimelineSpan();
+    /** False if spans are not recorded, so their details don't need to be built.
+     */
+    static bool isEnabled();
+
+  private:
+    bool active;
+    std::string name, category, detail;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
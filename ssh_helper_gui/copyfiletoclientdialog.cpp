@@ -21,9 +21,10 @@
 #include <QFileDialog>
 #include <QThread>
 #include <QProgressDialog>
-#include <QProcess>
 #include <QErrorMessage>
 #include <QDebug>
+#include "hashcache.h"
+#include "simpleexception.h"
 
 CopyFileToClientDialog::CopyFileToClientDialog(std::shared_ptr<SCPScript> scp, QWidget *parent, Qt::WindowFlags f) : QDialog(parent, f)
 {
@@ -134,31 +135,21 @@ void CopyFileToClientDialog::onUpdateProgress(int value)
 
 void CopyFileToClientDialog::getMD5()
 {
-  QFile file(ui.origLineEdit->text());
-
-  if (!file.open(QIODevice::ReadOnly))
-    return;
-  qint64 size = file.size(), completed = 0;
-  int percent = 0, last_percent = 0;
-  QProcess md5;
-  md5.start("md5sum", QStringList() << "-b" << "-");
-  if(md5.waitForStarted()) {
-    char buffer[1024*1024];
-    while(!file.atEnd() && !mStopMD5Process) {
-      qint64 read = file.read(buffer, sizeof(buffer));
-      md5.write(buffer, read);
-      completed += read;
-      percent = (int)((completed * 100) / size);
-      if(percent > last_percent) 
-        emit updateProgress(percent);
-      last_percent = percent;
-      // Uncomment the next line for testing
-      //QThread::sleep(10);
-    }
-    md5.closeWriteChannel();
-    if(md5.waitForFinished()) {
-      QByteArray result = md5.readAll();
-      mScp->md5 = QString(result).split(" ")[0];
-    }
+  int last_percent = 0;
+  try {
+    std::string md5 = HashCache::file(ui.origLineEdit->text().toStdString(), HashType::MD5, 
+      [this, &last_percent](uintmax_t done, uintmax_t total) {
+        int percent = total > 0 ? (int)((done * 100) / total) : 100;
+        if(percent > last_percent) 
+          emit updateProgress(percent);
+        last_percent = percent;
+        // Uncomment the next line for testing
+        //QThread::sleep(10);
+        return !mStopMD5Process;
+      });
+    if(!md5.empty())
+      mScp->md5 = QString::fromStdString(md5);
+  } catch(SimpleException &error) {
+    qDebug() << error.what();
   }
 }
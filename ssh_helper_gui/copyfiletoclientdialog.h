@@ -20,7 +20,6 @@
 
 #include <QDialog>
 #include <QProgressDialog>
-#include <QProcess>
 #include <QThread>
 #include <memory>
 #include "ui_copyfiletoclientdialog.h"